@@ -21,6 +21,8 @@
 #define PSOARCHIVE__AFS_H
 
 #include "psoarchive-error.h"
+#include "psoarchive-extract.h"
+#include "psoarchive-build.h"
 
 #include <time.h>
 #include <stdint.h>
@@ -34,6 +36,9 @@ typedef struct pso_afs_read pso_afs_read_t;
 struct pso_afs_write;
 typedef struct pso_afs_write pso_afs_write_t;
 
+struct pso_afs_update;
+typedef struct pso_afs_update pso_afs_update_t;
+
 /* Values for the flags parameter of the open and new functions.*/
 /* Use an existing filename table or generate one for the archive creation
    functions. If this flag is specified for _open() or _open_fd() and the
@@ -41,7 +46,47 @@ typedef struct pso_afs_write pso_afs_write_t;
    file_lookup() operations on that archive will fail. */
 #define PSO_AFS_FN_TABLE        (1 << 0)
 
-/* Archive reading functionality... */
+/* Map the whole archive into memory when opening it, rather than reading from
+   the file each time. This allows the use of pso_afs_file_data() to get at the
+   data of each file without copying it anywhere. This flag is only valid for
+   _open() and _open_fd(), and is not supported on Windows. With _open_fd(),
+   PSOARCHIVE_ERANGE is returned if len is larger than the file. */
+#define PSO_AFS_MMAP            (1 << 1)
+
+/* Build a hash index of the filenames when opening the archive, so that
+   pso_afs_file_lookup() doesn't have to search through every file each time.
+   This costs a bit of time when opening the archive and 8 bytes or so of memory
+   per file, so it's only worth it when doing a lot of lookups. This flag only
+   does anything along with PSO_AFS_FN_TABLE, and only for _open() and
+   _open_fd(). */
+#define PSO_AFS_NAME_INDEX      (1 << 2)
+
+/* Only make the file table as large as it needs to be for the files in the
+   archive, rather than leaving room for 65534 of them (which wastes about
+   512KiB in small archives). Unless the size of the table is set up front with
+   pso_afs_write_set_ftab_size(), the whole archive is kept in memory until it
+   is closed. This flag is only valid for _new(), _new_fd(), and the build
+   functions. */
+#define PSO_AFS_COMPACT         (1 << 3)
+
+/* Store only one copy of the data for files with exactly the same contents,
+   with each of their entries in the file table pointing at it. Readers don't
+   need to know anything about this. Files added with pso_afs_write_add_fd() or
+   pso_afs_write_add_file() are read into memory first, so they can be checked.
+   With pso_afs_new_fd(), the file descriptor must be open for reading too, or
+   only files still in the write buffer will be matched. This flag is only
+   valid for _new(), _new_fd(), and the build functions. */
+#define PSO_AFS_DEDUP           (1 << 4)
+
+/* Archive reading functionality...
+
+   Once an archive has been opened, a read handle is never modified until it is
+   closed, and pso_afs_file_read() reads from the file with pread() rather than
+   seeking the shared file descriptor. Thus, any number of threads may look up
+   and read files from the same handle at once (except on Windows, where reads
+   still seek the file descriptor). The same goes for pso_afs_file_data().
+   Closing the handle while any other thread is still using it is, of course,
+   not safe. */
 pso_afs_read_t *pso_afs_read_open_fd(int fd, uint32_t len, uint32_t flags,
                                      pso_error_t *err);
 pso_afs_read_t *pso_afs_read_open(const char *fn, uint32_t flags,
@@ -59,13 +104,57 @@ pso_error_t pso_afs_file_stat(pso_afs_read_t *a, uint32_t hnd,
 ssize_t pso_afs_file_read(pso_afs_read_t *a, uint32_t hnd, uint8_t *buf,
                           size_t len);
 
-
-/* Archive creation/writing functionality... */
+/* Get at the data for a file directly, without copying it. This only works on
+   archives opened with PSO_AFS_MMAP, and returns NULL otherwise. The size of
+   the file is stored in *len (if non-NULL). The pointer returned is only valid
+   until the archive is closed. */
+const uint8_t *pso_afs_file_data(pso_afs_read_t *a, uint32_t hnd,
+                                 size_t *len);
+
+/* Extract every file in the archive, in parallel.
+
+   Each file is read (and decompressed, if PSO_EXTRACT_DECOMPRESS is set in
+   flags) and passed to the callback, using up to the given number of threads
+   (0 means one per CPU). See psoarchive-extract.h for the details. If the
+   archive was opened with PSO_AFS_MMAP, files are not copied out of the map
+   unless they need decompressing. Returns the first error that happened (from
+   the archive or the callback), if any. */
+pso_error_t pso_afs_extract_all(pso_afs_read_t *a, uint32_t flags,
+                                int threads, pso_extract_cb_t cb,
+                                void *udata);
+
+/* Extract every file in the archive into the given directory, which must
+   already exist. Files keep their names from the archive, even when they are
+   decompressed. Any name that would land outside of the directory is replaced
+   with the file's handle (as in "12.bin"). */
+pso_error_t pso_afs_extract_dir(pso_afs_read_t *a, const char *dir,
+                                uint32_t flags, int threads);
+
+
+/* Archive creation/writing functionality...
+
+   Files added to an archive are written out one after another, through a
+   buffer, with the file table held in memory until the archive is closed. If
+   the file descriptor passed to pso_afs_new_fd() can't be seeked (a pipe, for
+   instance), the whole archive is instead kept in memory and written out in
+   order when it is closed. Up to 65534 files can be added to an archive (65535
+   with PSO_AFS_COMPACT or a larger table size set), after which adding any
+   more will fail with PSOARCHIVE_ENOSPC. */
 pso_afs_write_t *pso_afs_new(const char *fn, uint32_t flags, pso_error_t *err);
 pso_afs_write_t *pso_afs_new_fd(int fd, uint32_t flags, pso_error_t *err);
 
 pso_error_t pso_afs_write_close(pso_afs_write_t *a);
 
+/* Set the size of the file table. This is only valid on a newly created write
+   structure. If you have already written files to this archive, this call will
+   fail with PSOARCHIVE_EFATAL. The table is made large enough to hold ents
+   files, and adding more than that will fail with PSOARCHIVE_ENOSPC (the data
+   still starts on a 2048 byte boundary). An archive can't hold more than 65535
+   files, so asking for more than that fails with PSOARCHIVE_EINVAL. This can
+   be used with or without PSO_AFS_COMPACT, and lets the data be written out
+   directly rather than being kept in memory. */
+pso_error_t pso_afs_write_set_ftab_size(pso_afs_write_t *a, uint32_t ents);
+
 pso_error_t pso_afs_write_add(pso_afs_write_t *a, const char *fn,
                               const uint8_t *data, uint32_t len);
 pso_error_t pso_afs_write_add_ex(pso_afs_write_t *a, const char *fn,
@@ -76,4 +165,54 @@ pso_error_t pso_afs_write_add_fd(pso_afs_write_t *a, const char *fn, int fd,
 pso_error_t pso_afs_write_add_file(pso_afs_write_t *a, const char *afn,
                                    const char *fn);
 
+/* Build a whole archive at once.
+
+   This writes out an archive containing every file in the files array (which
+   holds count entries), reading in and compressing them in parallel on up to
+   the given number of threads (0 means one per CPU). Compressed files use the
+   given PRS compression level (see PRS.h). The archive is written out
+   sequentially, so fd doesn't need to be seekable. See psoarchive-build.h for
+   the details. The flags are the same as for pso_afs_new. An archive can't
+   hold more than 65535 files, so anything more than that fails with
+   PSOARCHIVE_ERANGE.
+
+   pso_afs_build_fd does not close the file descriptor when it is done.
+*/
+pso_error_t pso_afs_build(const char *fn, uint32_t flags,
+                          const pso_build_file_t *files, uint32_t count,
+                          int level, int threads);
+pso_error_t pso_afs_build_fd(int fd, uint32_t flags,
+                             const pso_build_file_t *files, uint32_t count,
+                             int level, int threads);
+
+/* In-place archive updating functionality...
+
+   An update handle makes changes to an existing archive without rewriting the
+   whole thing. New data goes into the first free space in the archive that's
+   big enough for it (left behind by files that were removed or moved), or on
+   the end if there isn't any. A file that's replaced with data that still fits
+   in the space it had (padded out to 2048 bytes) is written back in the same
+   place. The file table (and the filename table, if the archive has one) is
+   only written when the archive is closed, and then only the entries that
+   changed (along with any after them, when files are added or deleted).
+
+   Files can only be added as long as there's room in the file table in front
+   of the first file's data, so archives written with PSO_AFS_COMPACT may not
+   have room for any more. Names are only kept (and lookups only work) if the
+   archive has a filename table. Deleting a file moves every file after it down
+   one handle. Until the archive is closed, the tables on disk still describe
+   the archive as it was (although any files replaced in place already have
+   their new data). */
+pso_afs_update_t *pso_afs_update_open(const char *fn, pso_error_t *err);
+pso_error_t pso_afs_update_close(pso_afs_update_t *a);
+
+uint32_t pso_afs_update_count(pso_afs_update_t *a);
+uint32_t pso_afs_update_lookup(pso_afs_update_t *a, const char *fn);
+
+pso_error_t pso_afs_update_add(pso_afs_update_t *a, const char *fn,
+                               const uint8_t *data, uint32_t len);
+pso_error_t pso_afs_update_replace(pso_afs_update_t *a, uint32_t hnd,
+                                   const uint8_t *data, uint32_t len);
+pso_error_t pso_afs_update_delete(pso_afs_update_t *a, uint32_t hnd);
+
 #endif /* !PSOARCHIVE__AFS_H */
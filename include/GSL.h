@@ -21,6 +21,8 @@
 #define PSOARCHIVE__GSL_H
 
 #include "psoarchive-error.h"
+#include "psoarchive-extract.h"
+#include "psoarchive-build.h"
 
 #include <stdint.h>
 #include <sys/types.h>
@@ -32,13 +34,35 @@ typedef struct pso_gsl_read pso_gsl_read_t;
 struct pso_gsl_write;
 typedef struct pso_gsl_write pso_gsl_write_t;
 
+struct pso_gsl_update;
+typedef struct pso_gsl_update pso_gsl_update_t;
+
 /* Parameters for the flags parameter for pso_gsl_read_open() and pso_gsl_new()
    functions. These are optional for _open() (the default will automatically try
    to determine the endianness), but one of these are required for _new(). */
 #define PSO_GSL_BIG_ENDIAN      (1 << 0)
 #define PSO_GSL_LITTLE_ENDIAN   (1 << 1)
 
-/* Archive reading functionality... */
+/* Build a hash index of the filenames when opening the archive, so that
+   pso_gsl_file_lookup() doesn't have to search through every file each time.
+   This costs a bit of time when opening the archive and 8 bytes or so of memory
+   per file, so it's only worth it when doing a lot of lookups. This flag is
+   only valid for _open() and _open_fd(). */
+#define PSO_GSL_NAME_INDEX      (1 << 2)
+
+/* Store only one copy of the data for files with exactly the same contents.
+   This works just like PSO_AFS_DEDUP does for AFS archives (see AFS.h), and is
+   only valid for _new(), _new_fd(), and the build functions. */
+#define PSO_GSL_DEDUP           (1 << 3)
+
+/* Archive reading functionality...
+
+   Once an archive has been opened, a read handle is never modified until it is
+   closed, and pso_gsl_file_read() reads from the file with pread() rather than
+   seeking the shared file descriptor. Thus, any number of threads may look up
+   and read files from the same handle at once (except on Windows, where reads
+   still seek the file descriptor). Closing the handle while any other
+   thread is still using it is, of course, not safe. */
 pso_gsl_read_t *pso_gsl_read_open(const char *fn, uint32_t flags,
                                   pso_error_t *err);
 pso_gsl_read_t *pso_gsl_read_open_fd(int fd, uint32_t len, uint32_t flags,
@@ -55,6 +79,23 @@ pso_error_t pso_gsl_file_name(pso_gsl_read_t *a, uint32_t hnd, char *fn,
 ssize_t pso_gsl_file_read(pso_gsl_read_t *a, uint32_t hnd, uint8_t *buf,
                           size_t len);
 
+/* Extract every file in the archive, in parallel.
+
+   Each file is read (and decompressed, if PSO_EXTRACT_DECOMPRESS is set in
+   flags) and passed to the callback, using up to the given number of threads
+   (0 means one per CPU). See psoarchive-extract.h for the details. Returns
+   the first error that happened (from the archive or the callback), if any. */
+pso_error_t pso_gsl_extract_all(pso_gsl_read_t *a, uint32_t flags,
+                                int threads, pso_extract_cb_t cb,
+                                void *udata);
+
+/* Extract every file in the archive into the given directory, which must
+   already exist. Files keep their names from the archive, even when they are
+   decompressed. Any name that would land outside of the directory is replaced
+   with the file's handle (as in "12.bin"). */
+pso_error_t pso_gsl_extract_dir(pso_gsl_read_t *a, const char *dir,
+                                uint32_t flags, int threads);
+
 /* Archive creation/writing functionality... */
 pso_gsl_write_t *pso_gsl_new(const char *fn, uint32_t flags, pso_error_t *err);
 pso_gsl_write_t *pso_gsl_new_fd(int fd, uint32_t flags, pso_error_t *err);
@@ -79,5 +120,36 @@ pso_error_t pso_gsl_write_add_fd(pso_gsl_write_t *a, const char *fn, int fd,
 pso_error_t pso_gsl_write_add_file(pso_gsl_write_t *a, const char *afn,
                                    const char *fn);
 
+/* Build a whole archive at once, from the count files in the files array.
+
+   This works just like pso_afs_build (see AFS.h and psoarchive-build.h), with
+   the flags being the same as for pso_gsl_new. The file table is made large
+   enough to hold every file. pso_gsl_build_fd does not close the file
+   descriptor when it is done.
+*/
+pso_error_t pso_gsl_build(const char *fn, uint32_t flags,
+                          const pso_build_file_t *files, uint32_t count,
+                          int level, int threads);
+pso_error_t pso_gsl_build_fd(int fd, uint32_t flags,
+                             const pso_build_file_t *files, uint32_t count,
+                             int level, int threads);
+
+/* In-place archive updating functionality...
+
+   These work just like their AFS counterparts (see AFS.h). The flags for
+   pso_gsl_update_open() are the same as for pso_gsl_read_open(). An empty name
+   can't be stored in a GSL archive, so pso_gsl_update_add() refuses one. */
+pso_gsl_update_t *pso_gsl_update_open(const char *fn, uint32_t flags,
+                                      pso_error_t *err);
+pso_error_t pso_gsl_update_close(pso_gsl_update_t *a);
+
+uint32_t pso_gsl_update_count(pso_gsl_update_t *a);
+uint32_t pso_gsl_update_lookup(pso_gsl_update_t *a, const char *fn);
+
+pso_error_t pso_gsl_update_add(pso_gsl_update_t *a, const char *fn,
+                               const uint8_t *data, uint32_t len);
+pso_error_t pso_gsl_update_replace(pso_gsl_update_t *a, uint32_t hnd,
+                                   const uint8_t *data, uint32_t len);
+pso_error_t pso_gsl_update_delete(pso_gsl_update_t *a, uint32_t hnd);
 
 #endif /* !PSOARCHIVE__GSL_H */
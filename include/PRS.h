@@ -43,6 +43,161 @@
 */
 int pso_prs_compress(const uint8_t *src, uint8_t **dst, size_t src_len);
 
+/* Compression levels for pso_prs_compress_ex().
+
+   Much like zlib, the compression level trades off speed for compression ratio.
+   Level 1 is the fastest, and is good for compressing small pieces of data on
+   the fly. Level 0 doesn't compress at all, and is the same as pso_prs_archive.
+   The default level (level 8) is the default greedy/lazy parse that
+   pso_prs_compress uses, which takes the longest match it can find at each
+   point (with a little bit of lookahead). Its output is not byte-for-byte the
+   same as what pso_prs_compress gave in earlier releases, but it is still
+   plain PRS data that any PRS decompressor can read. The optimal level
+   (level 9) instead searches for the cheapest possible encoding of each block
+   of input, which produces noticeably smaller output at the cost of a good bit
+   more time spent compressing.
+*/
+#define PSO_PRS_LEVEL_DEFAULT   -1
+#define PSO_PRS_LEVEL_NONE      0
+#define PSO_PRS_LEVEL_FASTEST   1
+#define PSO_PRS_LEVEL_OPTIMAL   9
+
+/* Compress a buffer with PRS compression at the specified level.
+
+   This function works exactly like pso_prs_compress, except that it allows you
+   to select the level of compression to use (from 0 to 9, or one of the values
+   above).
+
+   It is the caller's responsibility to free *dst when it is no longer in use.
+
+   Returns a negative value on failure (specifically something from
+   psoarchive-error.h). Returns the size of the compressed output on success.
+*/
+int pso_prs_compress_ex(const uint8_t *src, uint8_t **dst, size_t src_len,
+                        int level);
+
+/* Compress a buffer with PRS compression, using multiple threads.
+
+   This function splits the input up into large segments and compresses them
+   in parallel, on up to the given number of threads (or one per CPU if threads
+   is zero or less). The result is a normal PRS stream that any decompressor can
+   handle. Matches can't cross from one segment into the next, so the output is
+   very slightly larger than what pso_prs_compress_ex gives at the same level.
+   Inputs too small to be worth splitting up (less than a few hundred KiB) are
+   just compressed normally.
+
+   It is the caller's responsibility to free *dst when it is no longer in use.
+
+   Returns a negative value on failure (specifically something from
+   psoarchive-error.h). Returns the size of the compressed output on success.
+*/
+int pso_prs_compress_mt(const uint8_t *src, uint8_t **dst, size_t src_len,
+                        int level, int threads);
+
+/* Compress a buffer with PRS compression into a preallocated buffer.
+
+   This function works exactly like pso_prs_compress, except that the output is
+   written into the buffer at dst, which can hold dst_len bytes. If the buffer
+   is at least as large as what pso_prs_max_compressed_size returns for the
+   same input length, the output is guaranteed to fit. Otherwise, it may or may
+   not (depending on how well the data compresses).
+
+   Returns a negative value on failure (specifically something from
+   psoarchive-error.h, PSOARCHIVE_ENOSPC if the output doesn't fit). Returns the
+   size of the compressed output on success.
+*/
+int pso_prs_compress2(const uint8_t *src, uint8_t *dst, size_t src_len,
+                      size_t dst_len);
+
+/* Opaque reusable compression context. */
+struct pso_prs_compressor;
+typedef struct pso_prs_compressor pso_prs_compressor_t;
+
+/* Create a reusable compression context.
+
+   Compressing anything requires a fair bit of memory for the match finder,
+   which the normal compression functions allocate (and free) every time they
+   are called. A compressor holds onto that memory, so that it can be used to
+   compress any number of buffers (one at a time) without allocating anything.
+   The level is the same as for pso_prs_compress_ex.
+
+   Returns NULL on failure, setting *err (if non-NULL) to the reason why.
+*/
+pso_prs_compressor_t *pso_prs_compressor_init(int level, pso_error_t *err);
+
+/* Compress a buffer with a reusable compression context.
+
+   This works just like pso_prs_compress2, but uses the compressor (and the
+   level it was set up with) rather than allocating a new one. The same
+   compressor must not be used by more than one thread at a time.
+
+   Returns a negative value on failure (specifically something from
+   psoarchive-error.h). Returns the size of the compressed output on success.
+*/
+int pso_prs_compressor_compress(pso_prs_compressor_t *c, const uint8_t *src,
+                                uint8_t *dst, size_t src_len,
+                                size_t dst_len);
+
+/* Clean up a reusable compression context. */
+pso_error_t pso_prs_compressor_end(pso_prs_compressor_t *c);
+
+/* Opaque streaming compression context. */
+struct pso_prs_cstream;
+typedef struct pso_prs_cstream pso_prs_cstream_t;
+
+/* Output function for streaming compression.
+
+   This is called with each piece of compressed output as it is produced. The
+   data at buf is only valid until the function returns. Return a negative
+   value (something from psoarchive-error.h) to stop compressing with that
+   error, or zero to keep going.
+*/
+typedef int (*pso_prs_sink_t)(const uint8_t *buf, size_t len, void *udata);
+
+/* Create a context for compressing data into a PRS stream incrementally.
+
+   The streaming compressor takes input a piece at a time with
+   pso_prs_cstream_feed, and passes compressed output to the sink function as
+   it is produced. Only a small, fixed amount of the input (the 8KiB window plus
+   a bit) is kept in memory, so memory use does not depend on the size of the
+   data at all. The level is the same as for pso_prs_compress_ex.
+
+   Returns NULL on failure, setting *err (if non-NULL) to the reason why.
+*/
+pso_prs_cstream_t *pso_prs_cstream_init(int level, pso_prs_sink_t sink,
+                                        void *udata, pso_error_t *err);
+
+/* Feed data to be compressed into a compression stream.
+
+   All of the data passed in is used (or copied somewhere internally), and the
+   sink may be called any number of times before this returns.
+
+   Returns PSOARCHIVE_OK on success, or a negative value on failure
+   (specifically something from psoarchive-error.h, or whatever the sink
+   returned). Once an error has been returned, the stream is no longer usable,
+   and will return the same error on every call.
+*/
+pso_error_t pso_prs_cstream_feed(pso_prs_cstream_t *s, const uint8_t *src,
+                                 size_t len);
+
+/* Finish a compression stream.
+
+   This compresses whatever input is left and writes the end of the compressed
+   data out to the sink. Nothing else may be fed to the stream afterwards.
+
+   Returns a negative value on failure (specifically something from
+   psoarchive-error.h). Returns the total size of the compressed output on
+   success.
+*/
+ssize_t pso_prs_cstream_finish(pso_prs_cstream_t *s);
+
+/* Clean up a compression stream.
+
+   This frees the stream, whether or not it was finished. Any data that was fed
+   into an unfinished stream is lost.
+*/
+pso_error_t pso_prs_cstream_end(pso_prs_cstream_t *s);
+
 /* Archive a buffer in PRS format.
 
    This function archives the data in the src buffer into a new buffer. This
@@ -135,4 +290,63 @@ int pso_prs_decompress_buf2(const uint8_t *src, uint8_t *dst, size_t src_len,
 */
 int pso_prs_decompress_size(const uint8_t *src, size_t src_len);
 
+/* Opaque streaming decompression context. */
+struct pso_prs_dstream;
+typedef struct pso_prs_dstream pso_prs_dstream_t;
+
+/* Create a context for decompressing a PRS stream incrementally.
+
+   Streaming decompression works much like zlib's inflate. Compressed data is
+   pushed into the stream with pso_prs_dstream_feed, and decompressed data is
+   pulled back out with pso_prs_dstream_drain. The stream only keeps the last
+   8KiB of output (and whatever hasn't been drained yet) around, so memory use
+   does not depend on the size of the data at all.
+
+   Returns NULL on failure, setting *err (if non-NULL) to the reason why.
+*/
+pso_prs_dstream_t *pso_prs_dstream_init(pso_error_t *err);
+
+/* Feed compressed data into a decompression stream.
+
+   This function decompresses as much of the data in src as it can and returns
+   the number of bytes of it that were used. If that is less than len, there's
+   no more room for output in the stream, so call pso_prs_dstream_drain and then
+   feed in the rest. Once the end of the compressed data has been reached, no
+   more input will be used (so anything past the end is left for the caller).
+
+   Returns a negative value on failure (specifically something from
+   psoarchive-error.h). Once an error has been returned, the stream is no longer
+   usable, and will return the same error on every call.
+*/
+ssize_t pso_prs_dstream_feed(pso_prs_dstream_t *s, const uint8_t *src,
+                             size_t len);
+
+/* Pull decompressed data out of a decompression stream.
+
+   This copies up to len bytes of decompressed data into dst. A return value of
+   zero means that all of the output so far has been drained, and more input is
+   needed (or the stream is finished).
+
+   Returns a negative value on failure (specifically something from
+   psoarchive-error.h). Returns the number of bytes copied on success.
+*/
+ssize_t pso_prs_dstream_drain(pso_prs_dstream_t *s, uint8_t *dst,
+                              size_t len);
+
+/* Determine if a decompression stream is finished.
+
+   Returns 1 once the end of the compressed data has been seen and all of the
+   output has been drained, or 0 otherwise.
+*/
+int pso_prs_dstream_finished(pso_prs_dstream_t *s);
+
+/* Clean up a decompression stream.
+
+   Returns PSOARCHIVE_OK if the end of the compressed data was seen without any
+   errors. Otherwise, returns the error that the stream ran into (or
+   PSOARCHIVE_EBADMSG if the compressed data was never finished). Either way,
+   the stream is freed.
+*/
+pso_error_t pso_prs_dstream_end(pso_prs_dstream_t *s);
+
 #endif /* !PSOARCHIVE__PRS_H */
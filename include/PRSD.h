@@ -25,6 +25,7 @@
 #include <sys/types.h>
 
 #include "psoarchive-error.h"
+#include "PRS.h"
 
 /* Endianness values. Auto is only valid for decompression. */
 #define PSO_PRSD_AUTO_ENDIAN            0
@@ -45,6 +46,35 @@
 int pso_prsd_compress(const uint8_t *src, uint8_t **dst, size_t src_len,
                       uint32_t key, int endian);
 
+/* Compress a buffer with PRSD compression and encryption into a preallocated
+   buffer.
+
+   This function works exactly like pso_prsd_compress, except that the output
+   is written into the buffer at dst, which can hold dst_len bytes. If the
+   buffer is at least as large as what pso_prsd_max_compressed_size returns for
+   the same input length, the output is guaranteed to fit.
+
+   Returns a negative value on failure (specifically something from
+   psoarchive-error.h, PSOARCHIVE_ENOSPC if the output doesn't fit). Returns the
+   size of the compressed output on success.
+*/
+int pso_prsd_compress2(const uint8_t *src, uint8_t *dst, size_t src_len,
+                       size_t dst_len, uint32_t key, int endian);
+
+/* Compress a buffer with PRSD compression and encryption, using a reusable
+   compression context.
+
+   This works just like pso_prsd_compress2, but uses the compressor (and the
+   level it was set up with) from pso_prs_compressor_init rather than
+   allocating a new one every time.
+
+   Returns a negative value on failure (specifically something from
+   psoarchive-error.h). Returns the size of the compressed output on success.
+*/
+int pso_prsd_compressor_compress(pso_prs_compressor_t *c, const uint8_t *src,
+                                 uint8_t *dst, size_t src_len, size_t dst_len,
+                                 uint32_t key, int endian);
+
 /* Archive and encrypt a buffer in PRSD format.
 
    This function archives the data in the src buffer into a new buffer. This
@@ -59,6 +89,18 @@ int pso_prsd_compress(const uint8_t *src, uint8_t **dst, size_t src_len,
 int pso_prsd_archive(const uint8_t *src, uint8_t **dst, size_t src_len,
                      uint32_t key, int endian);
 
+/* Archive and encrypt a buffer in PRSD format into a preallocated buffer.
+
+   This function works just like pso_prsd_archive, except that the output is
+   written into the buffer at dst. The buffer must be at least as large as what
+   pso_prsd_max_compressed_size returns when given the same input length.
+
+   Returns a negative value on failure (specifically something from
+   psoarchive-error.h). Returns the size of the output on success.
+*/
+int pso_prsd_archive2(const uint8_t *src, uint8_t *dst, size_t src_len,
+                      size_t dst_len, uint32_t key, int endian);
+
 /* Return the maximum size of archiving a buffer in PRSD format.
 
    This function returns the size that prsd_archive will spit out. This is used
@@ -0,0 +1,72 @@
+/*
+    This file is part of libpsoarchive.
+
+    Copyright (C) 2026 Lawrence Sebald
+
+    This library is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 2.1 or
+    version 3 of the License.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PSOARCHIVE__ALLOC_H
+#define PSOARCHIVE__ALLOC_H
+
+#include <stddef.h>
+
+#include "psoarchive-error.h"
+
+/* Memory allocation functions.
+
+   Every bit of memory that the library allocates (including the buffers that
+   are handed back to you from the various compression and decompression
+   functions) goes through these functions. By default, they just call the
+   standard malloc, realloc, and free. If you want allocations to go somewhere
+   else (an arena or pool allocator, or something that counts how much is being
+   allocated), set your own with pso_set_allocator.
+
+   The udata pointer in the structure is passed to each of the functions, and
+   isn't otherwise touched by the library.
+*/
+typedef struct pso_allocator {
+    void *(*malloc_fn)(size_t size, void *udata);
+    void *(*realloc_fn)(void *ptr, size_t size, void *udata);
+    void (*free_fn)(void *ptr, void *udata);
+    void *udata;
+} pso_allocator_t;
+
+/* Set the memory allocation functions used throughout the library.
+
+   All three of the functions must be set. Passing NULL restores the default
+   functions. The new functions are used for everything allocated from then
+   on, so this should be done before using anything else in the library (and
+   certainly not while another thread is in the middle of using it). Anything
+   that was allocated with the old functions must still be freed with them.
+
+   Returns PSOARCHIVE_OK on success, or PSOARCHIVE_EINVAL if any of the
+   functions are missing.
+*/
+pso_error_t pso_set_allocator(const pso_allocator_t *a);
+
+/* Retrieve the memory allocation functions currently in use. */
+void pso_get_allocator(pso_allocator_t *a);
+
+/* Allocate, resize, and free memory with the current allocation functions.
+
+   Buffers that the library hands back to you (for instance, from
+   pso_prs_decompress_buf) can be freed with pso_free. That's the same as
+   calling free if you haven't changed the allocation functions.
+*/
+void *pso_malloc(size_t size);
+void *pso_realloc(void *ptr, size_t size);
+void pso_free(void *ptr);
+
+#endif /* !PSOARCHIVE__ALLOC_H */
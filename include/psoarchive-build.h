@@ -0,0 +1,67 @@
+/*
+    This file is part of libpsoarchive.
+
+    Copyright (C) 2026 Lawrence Sebald
+
+    This library is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 2.1 or
+    version 3 of the License.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PSOARCHIVE__BUILD_H
+#define PSOARCHIVE__BUILD_H
+
+#include <time.h>
+#include <stdint.h>
+
+#include "psoarchive-error.h"
+
+/* Building whole archives at once.
+
+   The build functions in AFS.h and GSL.h take a list of every file that is to
+   go into an archive and write the whole thing out in one go. Files are read
+   in (and compressed, if asked for) in parallel across a number of threads.
+   Once that's done, the position of every file is known up front, so the
+   archive is written from start to finish in large sequential writes, rather
+   than seeking back and forth for each file like the pso_*_write_add functions
+   do. Everything going into the archive is held in memory until it has been
+   written out.
+*/
+
+/* Values for the compress field of pso_build_file_t. */
+#define PSO_BUILD_RAW               0
+#define PSO_BUILD_PRS               1
+#define PSO_BUILD_PRSD_LE           2
+#define PSO_BUILD_PRSD_BE           3
+
+typedef struct pso_build_file {
+    /* Name of the file in the archive. */
+    const char *name;
+
+    /* Data for the file. If this is NULL, the file at path is read in
+       instead. */
+    const uint8_t *data;
+    uint32_t len;
+    const char *path;
+
+    /* Timestamp for the file (only used in AFS archives with a filename
+       table). If zero, the modification time of the file at path is used, or
+       the current time if data was given. */
+    time_t ts;
+
+    /* How to compress the file (one of the values above) and, for PRSD, the
+       key to encrypt it with. Empty files are always stored as-is. */
+    int compress;
+    uint32_t key;
+} pso_build_file_t;
+
+#endif /* !PSOARCHIVE__BUILD_H */
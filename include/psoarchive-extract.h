@@ -0,0 +1,67 @@
+/*
+    This file is part of libpsoarchive.
+
+    Copyright (C) 2026 Lawrence Sebald
+
+    This library is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 2.1 or
+    version 3 of the License.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PSOARCHIVE__EXTRACT_H
+#define PSOARCHIVE__EXTRACT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "psoarchive-error.h"
+
+/* Bulk extraction of archives.
+
+   The extract functions in AFS.h and GSL.h pull every file out of an archive
+   at once, reading (and optionally decompressing) them in parallel across a
+   number of threads. Each file is either handed off to a callback function or
+   written out to a directory.
+*/
+
+/* Values for the flags parameter of the extract functions. */
+/* Decompress files that look like they're PRS or PRSD compressed. This is
+   decided by the name of the file: anything ending in .prs is treated as PRS,
+   and anything ending in .pr2 or .pr3 as PRSD (of either endianness). If a file
+   doesn't actually decompress properly, it's passed along as-is. */
+#define PSO_EXTRACT_DECOMPRESS      (1 << 0)
+
+/* What each file was stored as (in the format field below). */
+#define PSO_EXTRACT_RAW             0
+#define PSO_EXTRACT_PRS             1
+#define PSO_EXTRACT_PRSD            2
+
+typedef struct pso_extract_file {
+    uint32_t hnd;
+    const char *name;
+    const uint8_t *data;
+    size_t len;
+    int format;
+} pso_extract_file_t;
+
+/* Callback for each file extracted from an archive.
+
+   This is called once for each file in the archive, with its handle, name, and
+   data (decompressed, if the format is anything other than raw). Everything
+   passed in is only valid until the function returns. The callback is called
+   from several threads at once (in no particular order), so it must be safe
+   to do so. Return a negative value (something from psoarchive-error.h) to
+   stop extracting with that error, or zero to keep going.
+*/
+typedef int (*pso_extract_cb_t)(const pso_extract_file_t *f, void *udata);
+
+#endif /* !PSOARCHIVE__EXTRACT_H */
@@ -0,0 +1,143 @@
+/*
+    This file is part of libpsoarchive.
+
+    Copyright (C) 2026 Lawrence Sebald
+
+    This library is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 2.1 or
+    version 3 of the License.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PSOARCHIVE__ARCHIVE_H
+#define PSOARCHIVE__ARCHIVE_H
+
+#include "psoarchive-error.h"
+#include "psoarchive-extract.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Reading archives of any supported type.
+
+   The functions here work on both AFS and GSL archives, figuring out which
+   kind of archive they've been given when it is opened, and then passing
+   everything along to the right reader from AFS.h or GSL.h. Handles in one of
+   these archives are the same as they would be with the format's own reader,
+   and the same rules about using a handle from several threads at once apply.
+*/
+
+/* Opaque archive structure. */
+struct pso_archive;
+typedef struct pso_archive pso_archive_t;
+
+/* Archive types, as returned by pso_archive_detect() and pso_archive_type(). */
+#define PSO_ARCHIVE_UNKNOWN         0
+#define PSO_ARCHIVE_AFS             1
+#define PSO_ARCHIVE_GSL             2
+
+/* Values for the flags parameter of the open functions. */
+/* Map the whole archive into memory when opening it, so that
+   pso_archive_file_data() can be used. This is only supported for AFS
+   archives, and is ignored for anything else. */
+#define PSO_ARCHIVE_MMAP            (1 << 1)
+
+/* Build a hash index of the filenames when opening the archive, to speed up
+   pso_archive_file_lookup(). See PSO_AFS_NAME_INDEX for more details. */
+#define PSO_ARCHIVE_NAME_INDEX      (1 << 2)
+
+/* Figure out what kind of archive starts with the given data. At least the
+   first 48 bytes of the archive (or all of it, if it is shorter than that)
+   should be passed in buf, and total is the length of the whole archive. AFS
+   archives are easy to spot by their magic number. GSL archives don't have
+   one, so the first entry of the file table is checked to see if it makes any
+   sense instead (a filename, followed by a file that fits in the archive). */
+int pso_archive_detect(const uint8_t *buf, size_t len, uint32_t total);
+
+pso_archive_t *pso_archive_open(const char *fn, uint32_t flags,
+                                pso_error_t *err);
+pso_archive_t *pso_archive_open_fd(int fd, uint32_t len, uint32_t flags,
+                                   pso_error_t *err);
+pso_error_t pso_archive_close(pso_archive_t *a);
+
+int pso_archive_type(pso_archive_t *a);
+uint32_t pso_archive_file_count(pso_archive_t *a);
+
+uint32_t pso_archive_file_lookup(pso_archive_t *a, const char *fn);
+pso_error_t pso_archive_file_name(pso_archive_t *a, uint32_t hnd, char *fn,
+                                  size_t len);
+ssize_t pso_archive_file_size(pso_archive_t *a, uint32_t hnd);
+ssize_t pso_archive_file_read(pso_archive_t *a, uint32_t hnd, uint8_t *buf,
+                              size_t len);
+
+/* Get at the data for a file directly, without copying it. This only works on
+   AFS archives opened with PSO_ARCHIVE_MMAP, and returns NULL otherwise. */
+const uint8_t *pso_archive_file_data(pso_archive_t *a, uint32_t hnd,
+                                     size_t *len);
+
+/* Reading compressed files.
+
+   Most of the files in PSO's archives are PRS or PRSD compressed. These
+   functions decompress them straight out of the archive, without reading the
+   compressed data into a buffer first. If the archive is mapped, the data is
+   decompressed right out of the map. Otherwise, it is read in a few KiB at a
+   time, just ahead of the decompressor. Anything that isn't compressed is read
+   in as-is.
+
+   Whether a file is compressed is decided by its name first, just like
+   PSO_EXTRACT_DECOMPRESS does (see psoarchive-extract.h). Files whose names
+   don't say (like the numbered files in AFS archives without a filename table)
+   are checked by trying to decode the first few KiB of them. Since that only
+   looks at the start of the file, a file that turns out not to decompress
+   after all is read in as-is instead. If that guess isn't good enough, the
+   _as versions of these functions take the format to use (one of the
+   PSO_EXTRACT_* values, or PSOARCHIVE_EINVAL is returned) instead. */
+
+/* Figure out how a file is stored. Returns one of the PSO_EXTRACT_* format
+   values from psoarchive-extract.h, or a negative error code. */
+int pso_archive_file_format(pso_archive_t *a, uint32_t hnd);
+
+/* Figure out how big a file will be once it is decompressed. For PRSD files,
+   this is in the header, but PRS files don't have one, so they have to be
+   decompressed (without keeping the output) to tell. */
+ssize_t pso_archive_file_decompressed_size(pso_archive_t *a, uint32_t hnd);
+ssize_t pso_archive_file_decompressed_size_as(pso_archive_t *a, uint32_t hnd,
+                                              int fmt);
+
+/* Decompress a file into the len bytes at buf. Returns the size of the
+   decompressed data, or a negative error code (PSOARCHIVE_ENOSPC if it doesn't
+   fit). Nothing in the buffer past the end of the data is written. */
+ssize_t pso_archive_file_read_decompressed(pso_archive_t *a, uint32_t hnd,
+                                           uint8_t *buf, size_t len);
+ssize_t pso_archive_file_read_decompressed_as(pso_archive_t *a, uint32_t hnd,
+                                              int fmt, uint8_t *buf,
+                                              size_t len);
+
+/* Decompress a file into a newly allocated buffer, which is stored in *dst.
+   This is just like reading the file and passing it to pso_prs_decompress_buf
+   or pso_prsd_decompress_buf, but the output is the only buffer allocated.
+   It is the caller's responsibility to free *dst when it is no longer in use.
+   Returns the size of the decompressed data, or a negative error code. */
+ssize_t pso_archive_file_decompress(pso_archive_t *a, uint32_t hnd,
+                                    uint8_t **dst);
+ssize_t pso_archive_file_decompress_as(pso_archive_t *a, uint32_t hnd,
+                                       int fmt, uint8_t **dst);
+
+/* Extract every file in the archive, in parallel. These work just like the
+   pso_afs_extract_all() and pso_afs_extract_dir() functions in AFS.h. */
+pso_error_t pso_archive_extract_all(pso_archive_t *a, uint32_t flags,
+                                    int threads, pso_extract_cb_t cb,
+                                    void *udata);
+pso_error_t pso_archive_extract_dir(pso_archive_t *a, const char *dir,
+                                    uint32_t flags, int threads);
+
+#endif /* !PSOARCHIVE__ARCHIVE_H */
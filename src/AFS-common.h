@@ -0,0 +1,34 @@
+/*
+    This file is part of libpsoarchive.
+
+    Copyright (C) 2026 Lawrence Sebald
+
+    This library is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 2.1 or
+    version 3 of the License.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <time.h>
+#include <stdint.h>
+
+#include "AFS.h"
+
+/* Where the data starts in an archive (leaving room for 65534 files). */
+#define AFS_DATA_START      0x80000
+
+/* Most files the reader will take in one archive. */
+#define AFS_MAX_FILES       65535
+
+/* These functions are all for internal use only. */
+void pso_afs_fill_fn(uint8_t *buf, const char *fn, time_t ts, uint32_t len);
+ssize_t pso_afs_file_read_at(pso_afs_read_t *a, uint32_t hnd, uint8_t *buf,
+                             size_t len, uint32_t offset);
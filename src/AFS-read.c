@@ -29,9 +29,13 @@
 #ifndef _WIN32
 #include <unistd.h>
 #include <inttypes.h>
+#include <sys/mman.h>
 #endif
 
-#include "AFS.h"
+#include "psoarchive-alloc.h"
+#include "AFS-common.h"
+#include "name-index.h"
+#include "extract.h"
 
 struct afs_filename_ent {
     char filename[32];
@@ -56,6 +60,13 @@ struct pso_afs_read {
 
     uint32_t file_count;
     uint32_t flags;
+
+    /* Only used with PSO_AFS_MMAP. */
+    const uint8_t *map;
+    size_t map_len;
+
+    /* Only used with PSO_AFS_NAME_INDEX. */
+    struct pso_name_index idx;
 };
 
 #ifdef _WIN32
@@ -91,59 +102,165 @@ static int digits(uint32_t n) {
     return r;
 }
 
+/* Read len bytes from the file at the given offset, without touching the file
+   position, so that multiple threads can read from the same archive at once.
+   Windows doesn't have pread(), so it gets the old seek and read instead (and
+   thus isn't safe to use that way). */
+static int read_at(int fd, uint8_t *buf, size_t len, off_t offset) {
+    ssize_t rv;
+
+#ifndef _WIN32
+    while(len) {
+        if((rv = pread(fd, buf, len, offset)) <= 0)
+            return -1;
+
+        buf += rv;
+        len -= (size_t)rv;
+        offset += rv;
+    }
+#else
+    if(lseek(fd, offset, SEEK_SET) == (off_t)-1)
+        return -1;
+
+    if((rv = read(fd, buf, len)) < 0 || (size_t)rv != len)
+        return -1;
+#endif
+
+    return 0;
+}
+
+/* Get at len bytes of the archive starting at offset. If the archive is
+   mapped, this just points into the mapping. Otherwise, the bytes are read into
+   a newly allocated buffer, which is stored in *tmp for the caller to free. */
+static const uint8_t *get_region(pso_afs_read_t *a, uint32_t offset,
+                                 size_t len, uint8_t **tmp, pso_error_t *err) {
+    *tmp = NULL;
+
+    if(a->map) {
+        if(offset > a->map_len || len > a->map_len - offset) {
+            *err = PSOARCHIVE_ERANGE;
+            return NULL;
+        }
+
+        return a->map + offset;
+    }
+
+    /* Make sure we don't try to allocate 0 bytes... */
+    if(!(*tmp = (uint8_t *)pso_malloc(len ? len : 1))) {
+        *err = PSOARCHIVE_EMEM;
+        return NULL;
+    }
+
+    if(read_at(a->fd, *tmp, len, (off_t)offset)) {
+        pso_free(*tmp);
+        *tmp = NULL;
+        *err = PSOARCHIVE_EIO;
+        return NULL;
+    }
+
+    return *tmp;
+}
+
 pso_afs_read_t *pso_afs_read_open_fd(int fd, uint32_t len, uint32_t flags,
                                      pso_error_t *err) {
     pso_afs_read_t *rv;
     pso_error_t erv = PSOARCHIVE_EFATAL;
-    uint32_t i, files;
-    uint8_t buf[48];
+    uint32_t i, files, fn_offset, fn_size;
+    const uint8_t *buf;
+    uint8_t *tmp = NULL;
+
+    /* Allocate our archive handle... */
+    if(!(rv = (pso_afs_read_t *)pso_malloc(sizeof(pso_afs_read_t)))) {
+        erv = PSOARCHIVE_EMEM;
+        goto ret_err;
+    }
+
+    rv->fd = fd;
+    rv->files = NULL;
+    rv->map = NULL;
+    rv->map_len = 0;
+    rv->idx.slots = NULL;
+
+    /* If the user wants the archive mapped into memory, do that now, so we can
+       read everything straight out of it. */
+    if((flags & PSO_AFS_MMAP)) {
+#ifndef _WIN32
+        struct stat st;
+        void *map;
+
+        /* Anything mapped past the end of the file would fault when touched,
+           so don't trust len to be right. */
+        if(fstat(fd, &st)) {
+            erv = PSOARCHIVE_EIO;
+            goto ret_handle;
+        }
+
+        if((off_t)len > st.st_size) {
+            erv = PSOARCHIVE_ERANGE;
+            goto ret_handle;
+        }
+
+        if(!len || (map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd,
+                               0)) == MAP_FAILED) {
+            erv = PSOARCHIVE_EIO;
+            goto ret_handle;
+        }
+
+        rv->map = (const uint8_t *)map;
+        rv->map_len = len;
+#else
+        erv = PSOARCHIVE_ENOTSUPP;
+        goto ret_handle;
+#endif
+    }
 
     /* Read the beginning of the file to make sure it is an AFS archive and to
        get the number of files... */
-    if(read(fd, buf, 8) != 8) {
+    if(!(buf = get_region(rv, 0, 8, &tmp, &erv))) {
         erv = PSOARCHIVE_NOARCHIVE;
-        goto ret_err;
+        goto ret_map;
     }
 
     /* The first 4 bytes must be 'AFS\0' */
     if(buf[0] != 0x41 || buf[1] != 0x46 || buf[2] != 0x53 || buf[3] != 0x00) {
         erv = PSOARCHIVE_NOARCHIVE;
-        goto ret_err;
+        goto ret_map;
     }
 
     files = buf[4] | (buf[5] << 8) | (buf[6] << 16) | (buf[7] << 24);
     if(files > 65535) {
         erv = PSOARCHIVE_EFATAL;
-        goto ret_err;
+        goto ret_map;
     }
 
-    /* Allocate our archive handle... */
-    if(!(rv = (pso_afs_read_t *)malloc(sizeof(pso_afs_read_t)))) {
-        erv = PSOARCHIVE_EMEM;
-        goto ret_err;
-    }
+    pso_free(tmp);
+    tmp = NULL;
 
     /* Allocate some file handles... */
-    rv->files = (struct afs_file *)malloc(sizeof(struct afs_file) * files + 1);
+    rv->files = (struct afs_file *)
+        pso_malloc(sizeof(struct afs_file) * files + 1);
     if(!rv->files) {
         erv = PSOARCHIVE_EMEM;
-        goto ret_handle;
+        goto ret_map;
     }
 
-    /* Read each file's metadata in. */
-    for(i = 0; i < files; ++i) {
-        if(read(fd, buf, 8) != 8) {
-            erv = PSOARCHIVE_EIO;
-            goto ret_files;
-        }
+    /* Grab the whole table of contents at once (including the pointer to the
+       filename table, if we care about it)... */
+    i = (flags & PSO_AFS_FN_TABLE) ? files + 1 : files;
+
+    if(!(buf = get_region(rv, 8, i * 8, &tmp, &erv)))
+        goto ret_files;
 
+    /* Parse each file's metadata. */
+    for(i = 0; i < files; ++i, buf += 8) {
         rv->files[i].offset = buf[0] | (buf[1] << 8) | (buf[2] << 16) |
             (buf[3] << 24);
         rv->files[i].size = buf[4] | (buf[5] << 8) | (buf[6] << 16) |
             (buf[7] << 24);
 
         /* Make sure it looks sane... */
-        if(rv->files[i].offset + rv->files[i].size > len) {
+        if(rv->files[i].offset > len ||
+           rv->files[i].size > len - rv->files[i].offset) {
             erv = PSOARCHIVE_ERANGE;
             goto ret_files;
         }
@@ -152,43 +269,32 @@ pso_afs_read_t *pso_afs_read_open_fd(int fd, uint32_t len, uint32_t flags,
     /* If the file has a filename list and the user has asked for support for
        it, read it in. */
     if((flags & PSO_AFS_FN_TABLE)) {
-        if(read(fd, buf, 8) != 8) {
-            erv = PSOARCHIVE_EIO;
-            goto ret_files;
-        }
+        fn_offset = buf[0] | (buf[1] << 8) | (buf[2] << 16) | (buf[3] << 24);
+        fn_size = buf[4] | (buf[5] << 8) | (buf[6] << 16) | (buf[7] << 24);
 
-        rv->files[files].offset = buf[0] | (buf[1] << 8) | (buf[2] << 16) |
-            (buf[3] << 24);
-        rv->files[files].size = buf[4] | (buf[5] << 8) | (buf[6] << 16) |
-            (buf[7] << 24);
+        pso_free(tmp);
+        tmp = NULL;
 
         /* See if there's anything there... */
-        if(rv->files[files].offset != 0 && rv->files[files].size != 0) {
+        if(fn_offset != 0 && fn_size != 0) {
             /* Make sure it looks sane... */
-            if(rv->files[files].offset + rv->files[files].size > len) {
+            if(fn_offset > len || fn_size > len - fn_offset) {
                 erv = PSOARCHIVE_ERANGE;
                 goto ret_files;
             }
 
             /* Make sure the size is right. */
-            if(rv->files[files].size != files * 48) {
+            if(fn_size != files * 48) {
                 erv = PSOARCHIVE_EBADMSG;
                 goto ret_files;
             }
 
-            /* Move the file pointer to the filename table.*/
-            if(lseek(fd, rv->files[files].offset, SEEK_SET) == (off_t)-1) {
-                erv = PSOARCHIVE_EIO;
+            /* Grab the whole filename table at once too... */
+            if(!(buf = get_region(rv, fn_offset, fn_size, &tmp, &erv)))
                 goto ret_files;
-            }
-
-            /* Read each one in...  */
-            for(i = 0; i < files; ++i) {
-                if(read(fd, buf, 48) != 48) {
-                    erv = PSOARCHIVE_EIO;
-                    goto ret_files;
-                }
 
+            /* Parse each one...  */
+            for(i = 0; i < files; ++i, buf += 48) {
                 memcpy(rv->files[i].fn_ent.filename, buf, 32);
                 rv->files[i].fn_ent.year = buf[32] | (buf[33] << 8);
                 rv->files[i].fn_ent.month = buf[34] | (buf[35] << 8);
@@ -211,8 +317,18 @@ pso_afs_read_t *pso_afs_read_open_fd(int fd, uint32_t len, uint32_t flags,
         }
     }
 
+    pso_free(tmp);
+    tmp = NULL;
+
+    /* Build the filename index, if we've got filenames and the user wants
+       it. */
+    if((flags & PSO_AFS_NAME_INDEX) && (flags & PSO_AFS_FN_TABLE)) {
+        if((erv = pso_name_index_build(&rv->idx, rv->files[0].fn_ent.filename,
+                                       sizeof(struct afs_file), files)))
+            goto ret_files;
+    }
+
     /* Set the file count in the handle */
-    rv->fd = fd;
     rv->file_count = files;
     rv->flags = flags;
 
@@ -223,9 +339,15 @@ pso_afs_read_t *pso_afs_read_open_fd(int fd, uint32_t len, uint32_t flags,
     return rv;
 
 ret_files:
-    free(rv->files);
+    pso_free(rv->files);
+ret_map:
+    pso_free(tmp);
+#ifndef _WIN32
+    if(rv->map)
+        munmap((void *)rv->map, rv->map_len);
+#endif
 ret_handle:
-    free(rv);
+    pso_free(rv);
 ret_err:
     if(err)
         *err = erv;
@@ -241,7 +363,7 @@ pso_afs_read_t *pso_afs_read_open(const char *fn, uint32_t flags,
     pso_afs_read_t *rv;
 
     /* Open the file... */
-    if(!(fd = open(fn, O_RDONLY))) {
+    if((fd = open(fn, O_RDONLY)) < 0) {
         erv = PSOARCHIVE_EFILE;
         goto ret_err;
     }
@@ -279,9 +401,15 @@ pso_error_t pso_afs_read_close(pso_afs_read_t *a) {
     if(!a || a->fd < 0 || !a->files)
         return PSOARCHIVE_EFATAL;
 
+#ifndef _WIN32
+    if(a->map)
+        munmap((void *)a->map, a->map_len);
+#endif
+
     close(a->fd);
-    free(a->files);
-    free(a);
+    pso_name_index_free(&a->idx);
+    pso_free(a->files);
+    pso_free(a);
 
     return PSOARCHIVE_OK;
 }
@@ -302,9 +430,12 @@ uint32_t pso_afs_file_lookup(pso_afs_read_t *a, const char *fn) {
     if(!(a->flags & PSO_AFS_FN_TABLE))
         return PSOARCHIVE_HND_INVALID;
 
+    if(a->idx.slots)
+        return pso_name_index_lookup(&a->idx, fn);
+
     /* Look through the list for the one specified. */
     for(i = 0; i < a->file_count; ++i) {
-        if(!strcmp(a->files[i].fn_ent.filename, fn))
+        if(!strncmp(a->files[i].fn_ent.filename, fn, 32))
             return i;
     }
 
@@ -384,20 +515,93 @@ pso_error_t pso_afs_file_stat(pso_afs_read_t *a, uint32_t hnd,
 
 ssize_t pso_afs_file_read(pso_afs_read_t *a, uint32_t hnd, uint8_t *buf,
                           size_t len) {
+    return pso_afs_file_read_at(a, hnd, buf, len, 0);
+}
+
+ssize_t pso_afs_file_read_at(pso_afs_read_t *a, uint32_t hnd, uint8_t *buf,
+                             size_t len, uint32_t offset) {
     /* Make sure the arguments are sane... */
-    if(!a || hnd > a->file_count || !buf || !len)
+    if(!a || hnd >= a->file_count || !buf || !len)
         return PSOARCHIVE_EFATAL;
 
-    /* Seek to the appropriate position in the file. */
-    if(lseek(a->fd, a->files[hnd].offset, SEEK_SET) == (off_t) -1)
-        return PSOARCHIVE_EIO;
-
     /* Figure out how much we're going to read... */
-    if(a->files[hnd].size < len)
-        len = a->files[hnd].size;
+    if(offset >= a->files[hnd].size)
+        return 0;
 
-    if(read(a->fd, buf, len) != len)
+    if(a->files[hnd].size - offset < len)
+        len = a->files[hnd].size - offset;
+
+    offset += a->files[hnd].offset;
+
+    /* If the archive is mapped, this is easy. */
+    if(a->map) {
+        memcpy(buf, a->map + offset, len);
+        return (ssize_t)len;
+    }
+
+    if(read_at(a->fd, buf, len, (off_t)offset))
         return PSOARCHIVE_EIO;
 
     return (ssize_t)len;
 }
+
+const uint8_t *pso_afs_file_data(pso_afs_read_t *a, uint32_t hnd,
+                                 size_t *len) {
+    /* Make sure the arguments are sane... */
+    if(!a || hnd >= a->file_count || !a->map)
+        return NULL;
+
+    if(len)
+        *len = a->files[hnd].size;
+
+    return a->map + a->files[hnd].offset;
+}
+
+/* Glue between the reader and the bulk extraction code. */
+static ssize_t ex_size(void *a, uint32_t hnd) {
+    return pso_afs_file_size((pso_afs_read_t *)a, hnd);
+}
+
+static pso_error_t ex_name(void *a, uint32_t hnd, char *fn, size_t len) {
+    return pso_afs_file_name((pso_afs_read_t *)a, hnd, fn, len);
+}
+
+static ssize_t ex_read(void *a, uint32_t hnd, uint8_t *buf, size_t len) {
+    return pso_afs_file_read((pso_afs_read_t *)a, hnd, buf, len);
+}
+
+static const uint8_t *ex_data(void *a, uint32_t hnd, size_t *len) {
+    return pso_afs_file_data((pso_afs_read_t *)a, hnd, len);
+}
+
+static void ex_src(pso_afs_read_t *a, struct pso_extract_src *src) {
+    src->arc = a;
+    src->count = a->file_count;
+    src->size = &ex_size;
+    src->name = &ex_name;
+    src->read = &ex_read;
+    src->data = &ex_data;
+}
+
+pso_error_t pso_afs_extract_all(pso_afs_read_t *a, uint32_t flags,
+                                int threads, pso_extract_cb_t cb,
+                                void *udata) {
+    struct pso_extract_src src;
+
+    if(!a || !cb)
+        return PSOARCHIVE_EFAULT;
+
+    ex_src(a, &src);
+    return pso_extract_run(&src, flags, threads, cb, udata);
+}
+
+pso_error_t pso_afs_extract_dir(pso_afs_read_t *a, const char *dir,
+                                uint32_t flags, int threads) {
+    struct pso_extract_src src;
+
+    if(!a || !dir)
+        return PSOARCHIVE_EFAULT;
+
+    ex_src(a, &src);
+    return pso_extract_dir(&src, dir, flags, threads);
+}
@@ -0,0 +1,558 @@
+/*
+    This file is part of libpsoarchive.
+
+    Copyright (C) 2026 Lawrence Sebald
+
+    This library is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 2.1 or
+    version 3 of the License.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include <fcntl.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include "psoarchive-alloc.h"
+#include "AFS-common.h"
+#include "update.h"
+
+#define ALIGN(x)    (((x) + 0x7FF) & ~(uint64_t)0x7FF)
+
+struct afs_uent {
+    uint32_t offset;
+    uint32_t size;
+    uint8_t fn[48];
+    int changed;
+};
+
+/* Everything about the archive is kept in memory. File data is written out as
+   soon as it is added, but the tables only get written (and then, only the
+   parts of them that changed) when the archive is closed. Files that have been
+   replaced are marked as changed, so that only their own entries get written.
+   Adding or deleting a file moves everything after it around, so dirty holds
+   the first entry that needs to be written from there on through to the end
+   of the table. */
+struct pso_afs_update {
+    int fd;
+
+    uint32_t count;
+    uint32_t disk_count;
+    uint32_t max;
+    uint32_t allocd;
+    uint32_t dirty;
+
+    int has_fns;
+    int fns_dirty;
+    uint32_t fn_offset;
+    uint32_t fn_size;
+
+    uint64_t data_start;
+    uint64_t end;
+
+    struct afs_uent *ents;
+};
+
+static uint32_t get_le32(const uint8_t *buf) {
+    return buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t)buf[3] << 24);
+}
+
+static void put_le32(uint8_t *buf, uint32_t v) {
+    buf[0] = (uint8_t)(v);
+    buf[1] = (uint8_t)(v >> 8);
+    buf[2] = (uint8_t)(v >> 16);
+    buf[3] = (uint8_t)(v >> 24);
+}
+
+pso_afs_update_t *pso_afs_update_open(const char *fn, pso_error_t *err) {
+    pso_afs_update_t *rv;
+    pso_error_t erv = PSOARCHIVE_OK;
+    uint8_t hdr[8], *buf = NULL;
+    struct stat st;
+    uint32_t i;
+    uint64_t start;
+
+    /* Allocate our archive handle... */
+    if(!(rv = (pso_afs_update_t *)pso_malloc(sizeof(pso_afs_update_t)))) {
+        erv = PSOARCHIVE_EMEM;
+        goto ret_err;
+    }
+
+    memset(rv, 0, sizeof(pso_afs_update_t));
+
+    if((rv->fd = open(fn, O_RDWR)) < 0) {
+        erv = PSOARCHIVE_EFILE;
+        goto ret_handle;
+    }
+
+    if(fstat(rv->fd, &st) < 0) {
+        erv = PSOARCHIVE_EFILE;
+        goto ret_file;
+    }
+
+    rv->end = (uint64_t)st.st_size;
+
+    /* Make sure it's actually an AFS archive... */
+    if(pso_update_read_at(rv->fd, hdr, 8, 0) ||
+       hdr[0] != 0x41 || hdr[1] != 0x46 || hdr[2] != 0x53 || hdr[3] != 0x00) {
+        erv = PSOARCHIVE_NOARCHIVE;
+        goto ret_file;
+    }
+
+    rv->count = rv->disk_count = get_le32(hdr + 4);
+    if(rv->count > AFS_MAX_FILES) {
+        erv = PSOARCHIVE_EFATAL;
+        goto ret_file;
+    }
+
+    rv->allocd = rv->count + 16;
+    rv->dirty = rv->count + 1;
+
+    if(!(rv->ents = (struct afs_uent *)
+         pso_malloc(sizeof(struct afs_uent) * rv->allocd))) {
+        erv = PSOARCHIVE_EMEM;
+        goto ret_file;
+    }
+
+    memset(rv->ents, 0, sizeof(struct afs_uent) * rv->allocd);
+
+    /* Read in the file table, along with the pointer to the filename table. */
+    if(!(buf = (uint8_t *)pso_malloc((rv->count + 1) * 8))) {
+        erv = PSOARCHIVE_EMEM;
+        goto ret_ents;
+    }
+
+    if((erv = pso_update_read_at(rv->fd, buf, (rv->count + 1) * 8, 8)))
+        goto ret_buf;
+
+    start = rv->end;
+
+    for(i = 0; i < rv->count; ++i) {
+        rv->ents[i].offset = get_le32(buf + i * 8);
+        rv->ents[i].size = get_le32(buf + i * 8 + 4);
+
+        if(rv->ents[i].offset > rv->end ||
+           rv->ents[i].size > rv->end - rv->ents[i].offset) {
+            erv = PSOARCHIVE_ERANGE;
+            goto ret_buf;
+        }
+
+        if(rv->ents[i].size && rv->ents[i].offset < start)
+            start = rv->ents[i].offset;
+    }
+
+    rv->fn_offset = get_le32(buf + i * 8);
+    rv->fn_size = get_le32(buf + i * 8 + 4);
+    pso_free(buf);
+    buf = NULL;
+
+    /* Read the filename table too, if there is one. */
+    if(rv->fn_offset && rv->fn_size) {
+        if(rv->fn_offset > rv->end || rv->fn_size > rv->end - rv->fn_offset) {
+            erv = PSOARCHIVE_ERANGE;
+            goto ret_ents;
+        }
+
+        if(rv->fn_size != rv->count * 48) {
+            erv = PSOARCHIVE_EBADMSG;
+            goto ret_ents;
+        }
+
+        if(!(buf = (uint8_t *)pso_malloc(rv->fn_size))) {
+            erv = PSOARCHIVE_EMEM;
+            goto ret_ents;
+        }
+
+        if((erv = pso_update_read_at(rv->fd, buf, rv->fn_size,
+                                     rv->fn_offset)))
+            goto ret_buf;
+
+        for(i = 0; i < rv->count; ++i) {
+            memcpy(rv->ents[i].fn, buf + i * 48, 48);
+        }
+
+        if(rv->fn_offset < start)
+            start = rv->fn_offset;
+
+        rv->has_fns = 1;
+        pso_free(buf);
+    }
+
+    /* The table runs up to wherever the first thing after it is. If there's
+       nothing in the archive at all, assume it's laid out like pso_afs_new()
+       would do it. */
+    if(start == rv->end && start < AFS_DATA_START)
+        start = AFS_DATA_START;
+
+    rv->data_start = start;
+    rv->max = start < 16 + (uint64_t)rv->count * 8 ? rv->count :
+        (uint32_t)((start - 16) / 8);
+
+    if(rv->max > AFS_MAX_FILES)
+        rv->max = AFS_MAX_FILES;
+
+    if(err)
+        *err = PSOARCHIVE_OK;
+
+    return rv;
+
+ret_buf:
+    pso_free(buf);
+ret_ents:
+    pso_free(rv->ents);
+ret_file:
+    close(rv->fd);
+ret_handle:
+    pso_free(rv);
+ret_err:
+    if(err)
+        *err = erv;
+
+    return NULL;
+}
+
+/* Find a place for len bytes of data, steering clear of everything else in the
+   archive (other than the file skip or the filename table, if either is being
+   replaced). */
+static pso_error_t find_space(pso_afs_update_t *a, uint32_t skip, int skip_fns,
+                              uint32_t len, uint64_t *rv) {
+    struct pso_extent *ext;
+    uint32_t i, n = 0;
+
+    if(!(ext = (struct pso_extent *)
+         pso_malloc(sizeof(struct pso_extent) * (a->count + 1))))
+        return PSOARCHIVE_EMEM;
+
+    for(i = 0; i < a->count; ++i) {
+        if(i != skip) {
+            ext[n].offset = a->ents[i].offset;
+            ext[n++].len = a->ents[i].size;
+        }
+    }
+
+    if(a->has_fns && !skip_fns) {
+        ext[n].offset = a->fn_offset;
+        ext[n++].len = a->fn_size;
+    }
+
+    *rv = pso_update_find_space(ext, n, a->data_start, &a->end, len);
+    pso_free(ext);
+
+    if(*rv + len > 0xFFFFFFFF)
+        return PSOARCHIVE_ERANGE;
+
+    return PSOARCHIVE_OK;
+}
+
+/* Can the data at offset off be replaced with len bytes without running into
+   anything else in the archive? */
+static int fits_in_place(pso_afs_update_t *a, uint32_t hnd, uint32_t len) {
+    uint64_t off = a->ents[hnd].offset, end = off + ALIGN(len);
+    uint32_t i;
+
+    if(!a->ents[hnd].size || ALIGN(len) > ALIGN(a->ents[hnd].size))
+        return 0;
+
+    for(i = 0; i < a->count; ++i) {
+        if(i == hnd || !a->ents[i].size)
+            continue;
+
+        /* Don't scribble on data that another file shares with this one. */
+        if(a->ents[i].offset == off)
+            return 0;
+
+        if(a->ents[i].offset > off && a->ents[i].offset < end)
+            return 0;
+    }
+
+    if(a->has_fns && a->fn_offset > off && a->fn_offset < end)
+        return 0;
+
+    return 1;
+}
+
+static void set_fn(pso_afs_update_t *a, uint32_t hnd, const char *fn) {
+    char name[33];
+
+    memcpy(name, a->ents[hnd].fn, 32);
+    name[32] = 0;
+
+    pso_afs_fill_fn(a->ents[hnd].fn, fn ? fn : name, time(NULL),
+                    a->ents[hnd].size);
+    a->ents[hnd].changed = 1;
+}
+
+uint32_t pso_afs_update_count(pso_afs_update_t *a) {
+    if(!a)
+        return 0;
+
+    return a->count;
+}
+
+uint32_t pso_afs_update_lookup(pso_afs_update_t *a, const char *fn) {
+    uint32_t i;
+
+    if(!a || !a->has_fns)
+        return PSOARCHIVE_HND_INVALID;
+
+    for(i = 0; i < a->count; ++i) {
+        if(!strncmp((const char *)a->ents[i].fn, fn, 32))
+            return i;
+    }
+
+    return PSOARCHIVE_HND_INVALID;
+}
+
+pso_error_t pso_afs_update_replace(pso_afs_update_t *a, uint32_t hnd,
+                                   const uint8_t *data, uint32_t len) {
+    uint64_t pos;
+    pso_error_t rv;
+
+    if(!a || hnd >= a->count || (!data && len))
+        return PSOARCHIVE_EFATAL;
+
+    /* Put it back where it was if there's room, otherwise find a new home. */
+    if(fits_in_place(a, hnd, len))
+        pos = a->ents[hnd].offset;
+    else if((rv = find_space(a, hnd, 0, len, &pos)))
+        return rv;
+
+    if(len && (rv = pso_update_write_data(a->fd, data, len, pos)))
+        return rv;
+
+    a->ents[hnd].offset = (uint32_t)pos;
+    a->ents[hnd].size = len;
+    set_fn(a, hnd, NULL);
+
+    return PSOARCHIVE_OK;
+}
+
+pso_error_t pso_afs_update_add(pso_afs_update_t *a, const char *fn,
+                               const uint8_t *data, uint32_t len) {
+    struct afs_uent *tmp;
+    uint64_t pos;
+    pso_error_t rv;
+
+    if(!a || !fn || (!data && len))
+        return PSOARCHIVE_EFATAL;
+
+    /* Make sure there's room in the table for it. */
+    if(a->count >= a->max)
+        return PSOARCHIVE_ENOSPC;
+
+    if(a->count == a->allocd) {
+        tmp = (struct afs_uent *)pso_realloc(a->ents, sizeof(struct afs_uent) *
+                                             a->allocd * 2);
+        if(!tmp)
+            return PSOARCHIVE_EMEM;
+
+        a->ents = tmp;
+        a->allocd *= 2;
+    }
+
+    if((rv = find_space(a, PSOARCHIVE_HND_INVALID, 0, len, &pos)))
+        return rv;
+
+    if(len && (rv = pso_update_write_data(a->fd, data, len, pos)))
+        return rv;
+
+    a->ents[a->count].offset = (uint32_t)pos;
+    a->ents[a->count].size = len;
+    set_fn(a, a->count, fn);
+
+    a->fns_dirty = 1;
+
+    if(a->count < a->dirty)
+        a->dirty = a->count;
+
+    ++a->count;
+
+    return PSOARCHIVE_OK;
+}
+
+pso_error_t pso_afs_update_delete(pso_afs_update_t *a, uint32_t hnd) {
+    if(!a || hnd >= a->count)
+        return PSOARCHIVE_EFATAL;
+
+    memmove(a->ents + hnd, a->ents + hnd + 1,
+            sizeof(struct afs_uent) * (a->count - hnd - 1));
+    --a->count;
+
+    a->fns_dirty = 1;
+
+    if(hnd < a->dirty)
+        a->dirty = hnd;
+
+    return PSOARCHIVE_OK;
+}
+
+/* Write out n entries of the file table, starting with first. Anything past
+   the end of the files is cleared out, other than the pointer to the filename
+   table. */
+static pso_error_t write_toc(pso_afs_update_t *a, uint32_t first,
+                             uint32_t n) {
+    uint8_t *buf;
+    uint32_t i;
+    pso_error_t rv;
+
+    if(!(buf = (uint8_t *)pso_malloc(n * 8)))
+        return PSOARCHIVE_EMEM;
+
+    memset(buf, 0, n * 8);
+
+    for(i = first; i < first + n && i < a->count; ++i) {
+        put_le32(buf + (i - first) * 8, a->ents[i].offset);
+        put_le32(buf + (i - first) * 8 + 4, a->ents[i].size);
+    }
+
+    if(a->has_fns && a->count >= first && a->count < first + n) {
+        put_le32(buf + (a->count - first) * 8, a->fn_offset);
+        put_le32(buf + (a->count - first) * 8 + 4, a->fn_size);
+    }
+
+    rv = pso_update_write_at(a->fd, buf, n * 8, 8 + (uint64_t)first * 8);
+    pso_free(buf);
+
+    return rv;
+}
+
+/* Write out n entries of the filename table, starting with first. If pad is
+   set, the rest of the table's last block is cleared out too. */
+static pso_error_t write_fns(pso_afs_update_t *a, uint32_t first, uint32_t n,
+                             int pad) {
+    uint8_t *buf;
+    uint32_t i;
+    uint64_t pos = a->fn_offset + (uint64_t)first * 48;
+    pso_error_t rv;
+
+    if(!(buf = (uint8_t *)pso_malloc(n ? n * 48 : 1)))
+        return PSOARCHIVE_EMEM;
+
+    for(i = 0; i < n; ++i) {
+        memcpy(buf + i * 48, a->ents[first + i].fn, 48);
+    }
+
+    if(pad)
+        rv = pso_update_write_data(a->fd, buf, n * 48, pos);
+    else
+        rv = pso_update_write_at(a->fd, buf, n * 48, pos);
+
+    pso_free(buf);
+    return rv;
+}
+
+/* Write out each run of changed entries before end, in both tables. */
+static pso_error_t write_changed(pso_afs_update_t *a, uint32_t end,
+                                 uint32_t fn_end) {
+    uint32_t i, j;
+    pso_error_t rv;
+
+    for(i = 0; i < end || i < fn_end; i = j) {
+        if(!a->ents[i].changed) {
+            j = i + 1;
+            continue;
+        }
+
+        j = i + 1;
+        while((j < end || j < fn_end) && a->ents[j].changed)
+            ++j;
+
+        if(i < end && (rv = write_toc(a, i, (j < end ? j : end) - i)))
+            return rv;
+
+        if(i < fn_end && (rv = write_fns(a, i, (j < fn_end ? j : fn_end) - i,
+                                         0)))
+            return rv;
+    }
+
+    return PSOARCHIVE_OK;
+}
+
+/* Write out everything in the tables that has changed. */
+static pso_error_t write_tables(pso_afs_update_t *a) {
+    uint32_t last, size, fn_from = a->count;
+    uint64_t pos;
+    pso_error_t rv;
+
+    /* The filename table goes first, since we need to know where it is. If it
+       has to move, the whole thing gets written out. Otherwise, only the part
+       after the first file that was added or deleted does. */
+    if(a->has_fns && a->fns_dirty) {
+        size = a->count * 48;
+        fn_from = a->dirty < a->count ? a->dirty : a->count;
+
+        if(ALIGN(size) > ALIGN(a->fn_size)) {
+            if((rv = find_space(a, PSOARCHIVE_HND_INVALID, 1, size, &pos)))
+                return rv;
+
+            a->fn_offset = (uint32_t)pos;
+            fn_from = 0;
+        }
+
+        a->fn_size = size;
+
+        if((rv = write_fns(a, fn_from, a->count - fn_from, 1)))
+            return rv;
+
+        /* The pointer to the table is right after the last file. */
+        if(a->dirty > a->count)
+            a->dirty = a->count;
+    }
+
+    /* Then the file table, from the first entry that moved through to the
+       last one that's on the disk (clearing out any that aren't used now). */
+    last = a->count > a->disk_count ? a->count : a->disk_count;
+
+    if(a->dirty <= last &&
+       (rv = write_toc(a, a->dirty, last - a->dirty + 1)))
+        return rv;
+
+    /* Anything before those that was replaced only needs its own entries. */
+    if((rv = write_changed(a, a->dirty < a->count ? a->dirty : a->count,
+                           a->has_fns ? fn_from : 0)))
+        return rv;
+
+    if(a->count != a->disk_count) {
+        uint8_t cnt[4];
+
+        put_le32(cnt, a->count);
+
+        if((rv = pso_update_write_at(a->fd, cnt, 4, 4)))
+            return rv;
+    }
+
+    return PSOARCHIVE_OK;
+}
+
+pso_error_t pso_afs_update_close(pso_afs_update_t *a) {
+    pso_error_t rv;
+
+    if(!a)
+        return PSOARCHIVE_EFATAL;
+
+    rv = write_tables(a);
+
+    if(close(a->fd) && !rv)
+        rv = PSOARCHIVE_EIO;
+
+    pso_free(a->ents);
+    pso_free(a);
+
+    return rv;
+}
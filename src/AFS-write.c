@@ -30,105 +30,121 @@
 #include <unistd.h>
 #endif
 
-#include "AFS.h"
-
-#if defined(__BIG_ENDIAN__) || defined(WORDS_BIGENDIAN)
-#define LE16(x) (((x >> 8) & 0xFF00) | ((x & 0xFF00) << 8))
-#define LE32(x) (((x >> 24) & 0x00FF) | \
-                 ((x >>  8) & 0xFF00) | \
-                 ((x & 0xFF00) <<  8) | \
-                 ((x & 0x00FF) << 24))
-#else
-#define LE16(x) x
-#define LE32(x) x
-#endif
+#include "psoarchive-alloc.h"
+#include "AFS-common.h"
+#include "build.h"
+#include "dedup.h"
+
 
-struct afs_fn {
+/* Where the data starts if the table only has room for n files. */
+#define TABLE_END(n)    ((16 + (uint64_t)(n) * 8 + 0x7FF) & ~(uint64_t)0x7FF)
+
+struct afs_ent {
     char filename[32];
-    uint16_t year;
-    uint16_t month;
-    uint16_t day;
-    uint16_t hour;
-    uint16_t minute;
-    uint16_t second;
+    time_t ts;
+    uint32_t offset;
     uint32_t size;
 };
 
+/* Files are written out sequentially, through a buffer. If the file descriptor
+   can be seeked, the data goes straight out to the file (with the tables being
+   written at the beginning when the archive is closed). Otherwise, everything
+   is held in memory until the archive is closed, and then written out from
+   start to finish. The same goes for compact archives that haven't had their
+   table size set, since there's no way to know where the data starts until
+   then. Either way, the positions in out are relative to the start of the
+   data. */
 struct pso_afs_write {
     int fd;
 
     int ftab_used;
+    int ftab_max;
+    int direct;
+    int grow;
 
     uint32_t flags;
 
-    off_t ftab_pos;
-    off_t data_pos;
+    uint32_t data_pos;
+
+    struct afs_ent *ents;
+    int ents_allocd;
 
-    struct afs_fn *fns;
-    int fns_allocd;
+    struct pso_build_out out;
+    struct pso_dedup dedup;
 };
 
-static off_t pad_file(int fd, int boundary) {
-    off_t pos = lseek(fd, 0, SEEK_CUR);
-    uint8_t tmp = 0;
+static void put_le32(uint8_t *buf, uint32_t v) {
+    buf[0] = (uint8_t)(v);
+    buf[1] = (uint8_t)(v >> 8);
+    buf[2] = (uint8_t)(v >> 16);
+    buf[3] = (uint8_t)(v >> 24);
+}
+
+static void put_le16(uint8_t *buf, int v) {
+    buf[0] = (uint8_t)(v);
+    buf[1] = (uint8_t)(v >> 8);
+}
+
+/* Fill in an entry in the filename table. */
+void pso_afs_fill_fn(uint8_t *buf, const char *fn, time_t ts, uint32_t len) {
+    struct tm *tmv;
 
-    /* If we aren't actually padding, don't do anything. */
-    if(boundary <= 0)
-        return pos;
+    memset(buf, 0, 48);
+    strncpy((char *)buf, fn, 32);
 
-    pos = (pos & ~(boundary - 1)) + boundary;
+    if((tmv = gmtime(&ts))) {
+        put_le16(buf + 32, tmv->tm_year + 1900);
+        put_le16(buf + 34, tmv->tm_mon);
+        put_le16(buf + 36, tmv->tm_mday);
+        put_le16(buf + 38, tmv->tm_hour);
+        put_le16(buf + 40, tmv->tm_min);
+        put_le16(buf + 42, tmv->tm_sec);
+    }
 
-    if(lseek(fd, pos - 1, SEEK_SET) == (off_t)-1)
-        return (off_t)-1;
+    put_le32(buf + 44, len);
+}
 
-    if(write(fd, &tmp, 1) != 1)
-        return (off_t)-1;
+/* Pad the data out to where the next file will start. */
+static pso_error_t pad_data(pso_afs_write_t *a) {
+    return pso_build_out_zero(&a->out, (0x800 - (a->out.pos & 0x7FF)) & 0x7FF);
+}
 
-    return pos;
+/* Get ready to write out the data. */
+static pso_error_t setup_out(pso_afs_write_t *a) {
+    /* Skip past where the tables go, if we can. If not (or if we don't know
+       where that is yet), we'll have to keep everything in memory until the
+       end. */
+    a->direct = !a->grow &&
+        lseek(a->fd, (off_t)a->data_pos, SEEK_SET) != (off_t)-1;
+
+    if(a->direct)
+        return pso_build_out_init(&a->out, a->fd);
+    else
+        return pso_build_out_init_mem(&a->out);
 }
 
 pso_afs_write_t *pso_afs_new(const char *fn, uint32_t flags, pso_error_t *err) {
     pso_afs_write_t *rv;
     pso_error_t erv = PSOARCHIVE_OK;
-
-    /* Allocate space for our write context. */
-    if(!(rv = (pso_afs_write_t *)malloc(sizeof(pso_afs_write_t)))) {
-        erv = PSOARCHIVE_EMEM;
-        goto ret_err;
-    }
+    int fd;
 
     /* Open the file specified. */
-    if((rv->fd = open(fn, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+    if((fd = open(fn, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
         erv = PSOARCHIVE_EFILE;
-        goto ret_mem;
+        goto ret_err;
     }
 
-    /* Allocate a filename table array, if the user has asked for it. */
-    if((flags & PSO_AFS_FN_TABLE)) {
-        if(!(rv->fns = (struct afs_fn *)malloc(sizeof(struct afs_fn) * 64))) {
-            erv = PSOARCHIVE_EMEM;
-            close(rv->fd);
-            goto ret_mem;
-        }
-
-        memset(rv->fns, 0, sizeof(struct afs_fn) * 64);
-        rv->fns_allocd = 64;
+    if(!(rv = pso_afs_new_fd(fd, flags, &erv))) {
+        close(fd);
+        goto ret_err;
     }
 
-    /* Fill in the base structure with our defaults. */
-    rv->ftab_used = 0;
-    rv->ftab_pos = 8;
-    rv->data_pos = 0x80000;
-    rv->flags = flags;
-
     /* We're done, return success. */
     if(err)
         *err = PSOARCHIVE_OK;
 
     return rv;
 
-ret_mem:
-    free(rv);
 ret_err:
     if(err)
         *err = erv;
@@ -141,36 +157,50 @@ pso_afs_write_t *pso_afs_new_fd(int fd, uint32_t flags, pso_error_t *err) {
     pso_error_t erv = PSOARCHIVE_OK;
 
     /* Allocate space for our write context. */
-    if(!(rv = (pso_afs_write_t *)malloc(sizeof(pso_afs_write_t)))) {
+    if(!(rv = (pso_afs_write_t *)pso_malloc(sizeof(pso_afs_write_t)))) {
         erv = PSOARCHIVE_EMEM;
         goto ret_err;
     }
 
-    /* Allocate a filename table array, if the user has asked for it. */
-    if((flags & PSO_AFS_FN_TABLE)) {
-        if(!(rv->fns = (struct afs_fn *)malloc(sizeof(struct afs_fn) * 64))) {
-            erv = PSOARCHIVE_EMEM;
-            free(rv);
-            goto ret_err;
-        }
-
-        memset(rv->fns, 0, sizeof(struct afs_fn) * 64);
-        rv->fns_allocd = 64;
+    /* Allocate the file table. */
+    rv->ents = (struct afs_ent *)pso_malloc(sizeof(struct afs_ent) * 64);
+    if(!rv->ents) {
+        erv = PSOARCHIVE_EMEM;
+        goto ret_mem;
     }
 
     /* Fill in the base structure with our data. */
     rv->fd = fd;
+    rv->ents_allocd = 64;
     rv->ftab_used = 0;
-    rv->ftab_pos = 8;
-    rv->data_pos = 0x80000;
     rv->flags = flags;
 
+    if((flags & PSO_AFS_COMPACT)) {
+        rv->ftab_max = AFS_MAX_FILES;
+        rv->data_pos = (uint32_t)TABLE_END(0);
+        rv->grow = 1;
+    }
+    else {
+        rv->ftab_max = (AFS_DATA_START - 16) / 8;
+        rv->data_pos = AFS_DATA_START;
+        rv->grow = 0;
+    }
+
+    if((erv = setup_out(rv)) != PSOARCHIVE_OK)
+        goto ret_ents;
+
+    pso_dedup_init(&rv->dedup);
+
     /* We're done, return success. */
     if(err)
         *err = PSOARCHIVE_OK;
 
     return rv;
 
+ret_ents:
+    pso_free(rv->ents);
+ret_mem:
+    pso_free(rv);
 ret_err:
     if(err)
         *err = erv;
@@ -178,251 +208,306 @@ ret_err:
     return NULL;
 }
 
-pso_error_t pso_afs_write_close(pso_afs_write_t *a) {
+static pso_error_t write_tables(pso_afs_write_t *a) {
+    struct pso_build_out hdr;
     uint8_t buf[48];
-    uint32_t len;
+    uint32_t fn_pos = 0;
     int i;
+    pso_error_t rv;
 
-    if(!a || a->fd < 0)
-        return PSOARCHIVE_EFATAL;
+    /* If the user has asked for a filename table, it goes after the data. */
+    if((a->flags & PSO_AFS_FN_TABLE)) {
+        fn_pos = a->data_pos + (uint32_t)a->out.pos;
 
-    /* Put the header at the beginning of the file. */
-    if(lseek(a->fd, 0, SEEK_SET) == (off_t)-1)
-        return PSOARCHIVE_EIO;
+        for(i = 0; i < a->ftab_used; ++i) {
+            pso_afs_fill_fn(buf, a->ents[i].filename, a->ents[i].ts,
+                            a->ents[i].size);
 
-    buf[0] = 0x41;
-    buf[1] = 0x46;
-    buf[2] = 0x53;
-    buf[3] = 0x00;
-    buf[4] = (uint8_t)(a->ftab_used);
-    buf[5] = (uint8_t)(a->ftab_used >> 8);
-    buf[6] = (uint8_t)(a->ftab_used >> 16);
-    buf[7] = (uint8_t)(a->ftab_used >> 24);
+            if((rv = pso_build_out_write(&a->out, buf, 48)))
+                return rv;
+        }
 
-    if(write(a->fd, buf, 8) != 8)
-        return PSOARCHIVE_EIO;
+        if((rv = pad_data(a)))
+            return rv;
+    }
 
-    /* If the user has asked for a filename array, write it out too. */
-    if((a->flags & PSO_AFS_FN_TABLE)) {
-        /* First, write the entry in the file table. */
-        len = a->ftab_used * 48;
+    /* Build the header and file table. */
+    if(a->direct) {
+        if((rv = pso_build_out_finish(&a->out)))
+            return rv;
 
-        if(lseek(a->fd, a->ftab_pos, SEEK_SET) == (off_t)-1)
+        if(lseek(a->fd, 0, SEEK_SET) == (off_t)-1)
             return PSOARCHIVE_EIO;
+    }
 
-        /* Copy the file data into the buffer... */
-        buf[0] = (uint8_t)(a->data_pos);
-        buf[1] = (uint8_t)(a->data_pos >> 8);
-        buf[2] = (uint8_t)(a->data_pos >> 16);
-        buf[3] = (uint8_t)(a->data_pos >> 24);
-        buf[4] = (uint8_t)(len);
-        buf[5] = (uint8_t)(len >> 8);
-        buf[6] = (uint8_t)(len >> 16);
-        buf[7] = (uint8_t)(len >> 24);
-
-        if(write(a->fd, buf, 8) != 8)
-            return PSOARCHIVE_EIO;
+    if((rv = pso_build_out_init(&hdr, a->fd)))
+        return rv;
 
-        /* Next, write out the data. */
-        if(lseek(a->fd, a->data_pos, SEEK_SET) == (off_t)-1)
-            return PSOARCHIVE_EIO;
+    memcpy(buf, "AFS", 4);
+    put_le32(buf + 4, (uint32_t)a->ftab_used);
 
-        for(i = 0; i < a->ftab_used; ++i) {
-            /* Fill it in first. */
-            memcpy(buf, a->fns[i].filename, 32);
-            buf[32] = (uint8_t)(a->fns[i].year);
-            buf[33] = (uint8_t)(a->fns[i].year >> 8);
-            buf[34] = (uint8_t)(a->fns[i].month);
-            buf[35] = (uint8_t)(a->fns[i].month >> 8);
-            buf[36] = (uint8_t)(a->fns[i].day);
-            buf[37] = (uint8_t)(a->fns[i].day >> 8);
-            buf[38] = (uint8_t)(a->fns[i].hour);
-            buf[39] = (uint8_t)(a->fns[i].hour >> 8);
-            buf[40] = (uint8_t)(a->fns[i].minute);
-            buf[41] = (uint8_t)(a->fns[i].minute >> 8);
-            buf[42] = (uint8_t)(a->fns[i].second);
-            buf[43] = (uint8_t)(a->fns[i].second >> 8);
-            buf[44] = (uint8_t)(a->fns[i].size);
-            buf[45] = (uint8_t)(a->fns[i].size >> 8);
-            buf[46] = (uint8_t)(a->fns[i].size >> 16);
-            buf[47] = (uint8_t)(a->fns[i].size >> 24);
-
-            /* Write it out. */
-            if(write(a->fd, buf, 48) != 48)
-                return PSOARCHIVE_EIO;
-        }
+    if((rv = pso_build_out_write(&hdr, buf, 8)))
+        goto out;
 
-        /* Pad the data position out to a nice boundary. */
-        a->data_pos = pad_file(a->fd, 2048);
+    for(i = 0; i < a->ftab_used; ++i) {
+        put_le32(buf, a->data_pos + a->ents[i].offset);
+        put_le32(buf + 4, a->ents[i].size);
+
+        if((rv = pso_build_out_write(&hdr, buf, 8)))
+            goto out;
+    }
+
+    memset(buf, 0, 8);
+
+    if((a->flags & PSO_AFS_FN_TABLE)) {
+        put_le32(buf, fn_pos);
+        put_le32(buf + 4, (uint32_t)a->ftab_used * 48);
     }
 
+    if((rv = pso_build_out_write(&hdr, buf, 8)))
+        goto out;
+
+    /* If we couldn't write the data out as we went, it all goes now. */
+    if(!a->direct) {
+        if((rv = pso_build_out_zero(&hdr, a->data_pos - hdr.pos)) ||
+           (rv = pso_build_out_write(&hdr, a->out.buf, a->out.used)))
+            goto out;
+    }
+
+out:
+    if(pso_build_out_finish(&hdr) && !rv)
+        rv = PSOARCHIVE_EIO;
+
+    return rv;
+}
+
+pso_error_t pso_afs_write_close(pso_afs_write_t *a) {
+    pso_error_t rv;
+
+    if(!a || a->fd < 0)
+        return PSOARCHIVE_EFATAL;
+
+    rv = write_tables(a);
+
+    pso_build_out_finish(&a->out);
+    pso_dedup_free(&a->dedup);
     close(a->fd);
-    free(a);
+    pso_free(a->ents);
+    pso_free(a);
+
+    return rv;
+}
+
+pso_error_t pso_afs_write_set_ftab_size(pso_afs_write_t *a, uint32_t ents) {
+    pso_afs_write_t old;
+    pso_error_t rv;
+
+    if(!a || a->ftab_used)
+        return PSOARCHIVE_EFATAL;
 
+    if(!ents || ents > AFS_MAX_FILES)
+        return PSOARCHIVE_EINVAL;
+
+    if(TABLE_END(ents) > 0xFFFFFFFF)
+        return PSOARCHIVE_ERANGE;
+
+    /* Now that we know where the data starts, start over with the output (in
+       case we can write it straight out now). */
+    old = *a;
+    a->ftab_max = (int)ents;
+    a->data_pos = (uint32_t)TABLE_END(ents);
+    a->grow = 0;
+
+    if((rv = setup_out(a))) {
+        *a = old;
+        return rv;
+    }
+
+    pso_build_out_finish(&old.out);
     return PSOARCHIVE_OK;
 }
 
+/* Add an entry to the file table, for a file that's about to be written. */
+static struct afs_ent *add_ent(pso_afs_write_t *a, const char *fn,
+                               uint32_t len, pso_error_t *err) {
+    struct afs_ent *rv;
+    void *tmp;
+
+    if(a->ftab_used == a->ftab_max) {
+        *err = PSOARCHIVE_ENOSPC;
+        return NULL;
+    }
+
+    /* If the table grows with the archive, the data gets pushed back. */
+    if(a->grow)
+        a->data_pos = (uint32_t)TABLE_END(a->ftab_used + 1);
+
+    /* Make sure the file will fit in the archive. */
+    if((uint64_t)a->data_pos + a->out.pos + len + 0x800 > 0xFFFFFFFF) {
+        *err = PSOARCHIVE_ERANGE;
+        return NULL;
+    }
+
+    /* Do we need to reallocate the file table? */
+    if(a->ftab_used == a->ents_allocd) {
+        tmp = pso_realloc(a->ents, sizeof(struct afs_ent) *
+                          (a->ents_allocd * 2));
+        if(!tmp) {
+            *err = PSOARCHIVE_EMEM;
+            return NULL;
+        }
+
+        a->ents_allocd *= 2;
+        a->ents = (struct afs_ent *)tmp;
+    }
+
+    rv = &a->ents[a->ftab_used];
+    strncpy(rv->filename, fn, 32);
+    rv->offset = (uint32_t)a->out.pos;
+    rv->size = len;
+    rv->ts = 0;
+
+    return rv;
+}
+
 pso_error_t pso_afs_write_add(pso_afs_write_t *a, const char *fn,
                               const uint8_t *data, uint32_t len) {
     return pso_afs_write_add_ex(a, fn, data, len, time(NULL));
 }
 
+/* Is the data at off (from the start of the data) the same as what's in data?
+   Some of it might have been written out already, and the rest might still be
+   in the buffer. */
+static int same_data(pso_afs_write_t *a, uint64_t off, const uint8_t *data,
+                     uint32_t len) {
+    uint64_t flushed = a->out.pos - a->out.used;
+    uint32_t n;
+
+    if(off < flushed) {
+        n = flushed - off < len ? (uint32_t)(flushed - off) : len;
+
+        if(!pso_dedup_same_fd(a->fd, a->data_pos + off, data, n))
+            return 0;
+
+        off += n;
+        data += n;
+        len -= n;
+    }
+
+    return !len || !memcmp(a->out.buf + (off - flushed), data, len);
+}
+
 pso_error_t pso_afs_write_add_ex(pso_afs_write_t *a, const char *fn,
                                  const uint8_t *data, uint32_t len,
                                  time_t ts) {
-    uint8_t buf[8];
-    void *tmp;
-    struct tm *tmv;
+    struct afs_ent *ent;
+    uint64_t hash = 0, where;
+    uint32_t iter = 0;
+    int dedup;
+    pso_error_t rv;
 
     if(!a)
         return PSOARCHIVE_EFATAL;
 
-    /* Go to where we'll be writing into the file table... */
-    if(lseek(a->fd, a->ftab_pos, SEEK_SET) == (off_t)-1)
-        return PSOARCHIVE_EIO;
-
-    /* Copy the file data into the buffer... */
-    buf[0] = (uint8_t)(a->data_pos);
-    buf[1] = (uint8_t)(a->data_pos >> 8);
-    buf[2] = (uint8_t)(a->data_pos >> 16);
-    buf[3] = (uint8_t)(a->data_pos >> 24);
-    buf[4] = (uint8_t)(len);
-    buf[5] = (uint8_t)(len >> 8);
-    buf[6] = (uint8_t)(len >> 16);
-    buf[7] = (uint8_t)(len >> 24);
-
-    /* Fill in the file information in the filename table, if applicable. */
-    if((a->flags & PSO_AFS_FN_TABLE)) {
-        /* Do we need to reallocate the filename table? */
-        if(a->ftab_used == a->fns_allocd) {
-            tmp = realloc(a->fns, sizeof(struct afs_fn) * (a->fns_allocd * 2));
-            if(!tmp)
-                return PSOARCHIVE_EMEM;
-
-            a->fns_allocd *= 2;
-            a->fns = (struct afs_fn *)tmp;
-        }
+    if(!(ent = add_ent(a, fn, len, &rv)))
+        return rv;
 
-        /* Fill in the entry. */
-        strncpy(a->fns[a->ftab_used].filename, fn, 32);
+    ent->ts = ts;
 
-        /* Parse the date from the timestamp passed in and save it. */
-        tmv = gmtime(&ts);
+    /* If we've already stored the same data, just point at that. */
+    if((dedup = (a->flags & PSO_AFS_DEDUP) && len)) {
+        hash = pso_dedup_hash(data, len);
 
-        a->fns[a->ftab_used].year = LE16(tmv->tm_year + 1900);
-        a->fns[a->ftab_used].month = LE16(tmv->tm_mon);
-        a->fns[a->ftab_used].day = LE16(tmv->tm_mday);
-        a->fns[a->ftab_used].hour = LE16(tmv->tm_hour);
-        a->fns[a->ftab_used].minute = LE16(tmv->tm_min);
-        a->fns[a->ftab_used].second = LE16(tmv->tm_sec);
-        a->fns[a->ftab_used].size = LE32(len);
+        while(pso_dedup_next(&a->dedup, hash, len, &iter, &where)) {
+            if(same_data(a, where, data, len)) {
+                ent->offset = (uint32_t)where;
+                ++a->ftab_used;
+                return PSOARCHIVE_OK;
+            }
+        }
     }
 
-    /* Write out the header... */
-    if(write(a->fd, buf, 8) != 8)
-        return PSOARCHIVE_EIO;
+    /* Write the file data out, padding it out to where the next file will
+       start. */
+    if((rv = pso_build_out_write(&a->out, data, len)) || (rv = pad_data(a)))
+        return rv;
 
-    a->ftab_pos += 8;
     ++a->ftab_used;
 
-    /* Seek to where the file data goes... */
-    if(lseek(a->fd, a->data_pos, SEEK_SET) == (off_t)-1)
-        return PSOARCHIVE_EIO;
-
-    /* Write the file data out. */
-    if(write(a->fd, data, len) != (ssize_t)len)
-        return PSOARCHIVE_EIO;
-
-    /* Pad the data position out to where the next file will start. */
-    a->data_pos = pad_file(a->fd, 2048);
+    /* Remember where it went. If this fails, all we lose is the chance to
+       share this file's data, so don't worry about it. */
+    if(dedup)
+        pso_dedup_add(&a->dedup, hash, len, ent->offset);
 
     /* Done. */
     return PSOARCHIVE_OK;
 }
 
-pso_error_t pso_afs_write_add_fd(pso_afs_write_t *a, const char *fn, int fd,
-                                 uint32_t len) {
-    uint8_t buf[512];
-    ssize_t bytes;
-    void *tmp;
+/* With deduplication, the data has to be read in first to see if it's already
+   in the archive. */
+static pso_error_t add_fd_dedup(pso_afs_write_t *a, const char *fn, int fd,
+                                uint32_t len) {
     struct stat st;
-    struct tm *tmv;
-
-    if(!a)
-        return PSOARCHIVE_EFATAL;
+    uint8_t *buf;
+    uint32_t pos = 0;
+    ssize_t r;
+    time_t ts = time(NULL);
+    pso_error_t rv;
 
-    /* Go to where we'll be writing into the file table... */
-    if(lseek(a->fd, a->ftab_pos, SEEK_SET) == (off_t)-1)
-        return PSOARCHIVE_EIO;
-
-    /* Copy the file data into the buffer... */
-    buf[0] = (uint8_t)(a->data_pos);
-    buf[1] = (uint8_t)(a->data_pos >> 8);
-    buf[2] = (uint8_t)(a->data_pos >> 16);
-    buf[3] = (uint8_t)(a->data_pos >> 24);
-    buf[4] = (uint8_t)(len);
-    buf[5] = (uint8_t)(len >> 8);
-    buf[6] = (uint8_t)(len >> 16);
-    buf[7] = (uint8_t)(len >> 24);
-
-    /* Fill in the file information in the filename table, if applicable. */
     if((a->flags & PSO_AFS_FN_TABLE)) {
-        /* Do we need to reallocate the filename table? */
-        if(a->ftab_used == a->fns_allocd) {
-            tmp = realloc(a->fns, sizeof(struct afs_fn) * (a->fns_allocd * 2));
-            if(!tmp)
-                return PSOARCHIVE_EMEM;
-
-            a->fns_allocd *= 2;
-            a->fns = (struct afs_fn *)tmp;
-        }
-
-        /* Fill in the entry. */
-        strncpy(a->fns[a->ftab_used].filename, fn, 32);
-
-        /* Get the modification date of the file, so we can fill in the
-           timestamp properly. */
         if((fstat(fd, &st)) < 0)
             return PSOARCHIVE_EFILE;
 
-        tmv = gmtime(&st.st_mtime);
+        ts = st.st_mtime;
+    }
+
+    if(!(buf = (uint8_t *)pso_malloc(len ? len : 1)))
+        return PSOARCHIVE_EMEM;
+
+    while(pos < len) {
+        if((r = read(fd, buf + pos, len - pos)) <= 0) {
+            pso_free(buf);
+            return PSOARCHIVE_EIO;
+        }
 
-        a->fns[a->ftab_used].year = LE16(tmv->tm_year + 1900);
-        a->fns[a->ftab_used].month = LE16(tmv->tm_mon);
-        a->fns[a->ftab_used].day = LE16(tmv->tm_mday);
-        a->fns[a->ftab_used].hour = LE16(tmv->tm_hour);
-        a->fns[a->ftab_used].minute = LE16(tmv->tm_min);
-        a->fns[a->ftab_used].second = LE16(tmv->tm_sec);
-        a->fns[a->ftab_used].size = LE32(len);
+        pos += (uint32_t)r;
     }
 
-    /* Write out the header... */
-    if(write(a->fd, buf, 8) != 8)
-        return PSOARCHIVE_EIO;
+    rv = pso_afs_write_add_ex(a, fn, buf, len, ts);
+    pso_free(buf);
 
-    a->ftab_pos += 8;
-    ++a->ftab_used;
+    return rv;
+}
 
-    /* Seek to where the file data goes... */
-    if(lseek(a->fd, a->data_pos, SEEK_SET) == (off_t)-1)
-        return PSOARCHIVE_EIO;
+pso_error_t pso_afs_write_add_fd(pso_afs_write_t *a, const char *fn, int fd,
+                                 uint32_t len) {
+    struct afs_ent *ent;
+    struct stat st;
+    pso_error_t rv;
+
+    if(!a)
+        return PSOARCHIVE_EFATAL;
 
-    /* While there's still data to be read from the file, read it into our
-       buffer and write it out to the file. */
-    while(len) {
-        bytes = len > 512 ? 512 : len;
+    if((a->flags & PSO_AFS_DEDUP))
+        return add_fd_dedup(a, fn, fd, len);
 
-        if(read(fd, buf, bytes) != bytes)
-            return PSOARCHIVE_EIO;
+    if(!(ent = add_ent(a, fn, len, &rv)))
+        return rv;
 
-        if(write(a->fd, buf, bytes) != bytes)
-            return PSOARCHIVE_EIO;
+    /* Get the modification date of the file, so we can fill in the timestamp
+       properly. */
+    if((a->flags & PSO_AFS_FN_TABLE)) {
+        if((fstat(fd, &st)) < 0)
+            return PSOARCHIVE_EFILE;
 
-        len -= bytes;
+        ent->ts = st.st_mtime;
     }
 
-    /* Pad the data position out to where the next file will start. */
-    a->data_pos = pad_file(a->fd, 2048);
+    /* Copy the data in, padding it out to where the next file will start. */
+    if((rv = pso_build_out_copy_fd(&a->out, fd, len)) || (rv = pad_data(a)))
+        return rv;
+
+    ++a->ftab_used;
 
     /* Done. */
     return PSOARCHIVE_OK;
@@ -456,3 +541,149 @@ pso_error_t pso_afs_write_add_file(pso_afs_write_t *a, const char *afn,
     close(fd);
     return err;
 }
+
+pso_error_t pso_afs_build_fd(int fd, uint32_t flags,
+                             const pso_build_file_t *files, uint32_t count,
+                             int level, int threads) {
+    struct pso_build_item *items;
+    struct pso_build_out out;
+    uint8_t buf[48];
+    uint64_t pos, data_start, fn_pos = 0;
+    uint32_t i, *offs;
+    pso_error_t rv;
+
+    if(fd < 0)
+        return PSOARCHIVE_EFATAL;
+
+    /* The reader won't take any more files than this. */
+    if(count > AFS_MAX_FILES)
+        return PSOARCHIVE_ERANGE;
+
+    /* Read in and compress everything first... */
+    if((rv = pso_build_prepare(files, count, level, threads, &items)))
+        return rv;
+
+    if(!(offs = (uint32_t *)pso_malloc(sizeof(uint32_t) * (count + 1)))) {
+        rv = PSOARCHIVE_EMEM;
+        goto out_items;
+    }
+
+    /* Files with the same contents as an earlier one just share its data. */
+    if((flags & PSO_AFS_DEDUP) && (rv = pso_build_dedup(items, count)))
+        goto out_offs;
+
+    /* Figure out where everything goes. The data starts at the same place as
+       it does with pso_afs_new (unless the table won't fit in front of it), and
+       each file starts on a 2048 byte boundary. */
+    data_start = TABLE_END(count);
+
+    if(!(flags & PSO_AFS_COMPACT) && data_start < AFS_DATA_START)
+        data_start = AFS_DATA_START;
+
+    pos = data_start;
+    for(i = 0; i < count; ++i) {
+        if(items[i].same != i) {
+            offs[i] = offs[items[i].same];
+            continue;
+        }
+
+        offs[i] = (uint32_t)pos;
+        pos = (pos + items[i].len + 0x7FF) & ~(uint64_t)0x7FF;
+
+        if(pos > 0xFFFFFFFF) {
+            rv = PSOARCHIVE_ERANGE;
+            goto out_offs;
+        }
+    }
+
+    if((flags & PSO_AFS_FN_TABLE)) {
+        fn_pos = pos;
+        pos = (pos + (uint64_t)count * 48 + 0x7FF) & ~(uint64_t)0x7FF;
+
+        if(pos > 0xFFFFFFFF) {
+            rv = PSOARCHIVE_ERANGE;
+            goto out_offs;
+        }
+    }
+
+    if((rv = pso_build_out_init(&out, fd)))
+        goto out_offs;
+
+    /* Write the header and the file table... */
+    memcpy(buf, "AFS", 4);
+    put_le32(buf + 4, count);
+
+    if((rv = pso_build_out_write(&out, buf, 8)))
+        goto out_close;
+
+    for(i = 0; i < count; ++i) {
+        put_le32(buf, offs[i]);
+        put_le32(buf + 4, items[i].len);
+
+        if((rv = pso_build_out_write(&out, buf, 8)))
+            goto out_close;
+    }
+
+    memset(buf, 0, 8);
+
+    if((flags & PSO_AFS_FN_TABLE)) {
+        put_le32(buf, (uint32_t)fn_pos);
+        put_le32(buf + 4, count * 48);
+    }
+
+    if((rv = pso_build_out_write(&out, buf, 8)))
+        goto out_close;
+
+    /* ... then all the data... */
+    for(i = 0; i < count; ++i) {
+        if(items[i].same != i)
+            continue;
+
+        if((rv = pso_build_out_zero(&out, offs[i] - out.pos)))
+            goto out_close;
+
+        if((rv = pso_build_out_write(&out, items[i].data, items[i].len)))
+            goto out_close;
+    }
+
+    /* ... and the filename table, if we're doing that. */
+    if((flags & PSO_AFS_FN_TABLE)) {
+        if((rv = pso_build_out_zero(&out, fn_pos - out.pos)))
+            goto out_close;
+
+        for(i = 0; i < count; ++i) {
+            pso_afs_fill_fn(buf, files[i].name, items[i].ts, items[i].len);
+
+            if((rv = pso_build_out_write(&out, buf, 48)))
+                goto out_close;
+        }
+    }
+
+    rv = pso_build_out_zero(&out, pos - out.pos);
+
+out_close:
+    if(pso_build_out_finish(&out) && !rv)
+        rv = PSOARCHIVE_EIO;
+out_offs:
+    pso_free(offs);
+out_items:
+    pso_build_cleanup(items, count);
+    return rv;
+}
+
+pso_error_t pso_afs_build(const char *fn, uint32_t flags,
+                          const pso_build_file_t *files, uint32_t count,
+                          int level, int threads) {
+    pso_error_t rv;
+    int fd;
+
+    if((fd = open(fn, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+        return PSOARCHIVE_EFILE;
+
+    rv = pso_afs_build_fd(fd, flags, files, count, level, threads);
+
+    if(close(fd) && !rv)
+        rv = PSOARCHIVE_EIO;
+
+    return rv;
+}
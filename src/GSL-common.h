@@ -27,3 +27,9 @@ struct gsl_file {
     uint32_t offset;
     uint32_t size;
 };
+
+/* These functions are all for internal use only. */
+void pso_gsl_fill_entry(uint8_t *buf, const char *fn, uint32_t blk,
+                        uint32_t len, uint32_t flags);
+ssize_t pso_gsl_file_read_at(pso_gsl_read_t *a, uint32_t hnd, uint8_t *buf,
+                             size_t len, uint32_t offset);
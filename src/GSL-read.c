@@ -28,7 +28,10 @@
 #include <unistd.h>
 #endif
 
+#include "psoarchive-alloc.h"
 #include "GSL-common.h"
+#include "name-index.h"
+#include "extract.h"
 
 struct pso_gsl_read {
     int fd;
@@ -36,39 +39,63 @@ struct pso_gsl_read {
 
     uint32_t file_count;
     uint32_t flags;
+
+    /* Only used with PSO_GSL_NAME_INDEX. */
+    struct pso_name_index idx;
 };
 
+/* Read len bytes from the file at the given offset, without touching the file
+   position, so that multiple threads can read from the same archive at once.
+   Windows doesn't have pread(), so it gets the old seek and read instead (and
+   thus isn't safe to use that way). */
+static int read_at(int fd, uint8_t *buf, size_t len, off_t offset) {
+    ssize_t rv;
+
+#ifndef _WIN32
+    while(len) {
+        if((rv = pread(fd, buf, len, offset)) <= 0)
+            return -1;
+
+        buf += rv;
+        len -= (size_t)rv;
+        offset += rv;
+    }
+#else
+    if(lseek(fd, offset, SEEK_SET) == (off_t)-1)
+        return -1;
+
+    if((rv = read(fd, buf, len)) < 0 || (size_t)rv != len)
+        return -1;
+#endif
+
+    return 0;
+}
+
 pso_gsl_read_t *pso_gsl_read_open_fd(int fd, uint32_t len, uint32_t flags,
                                      pso_error_t *err) {
     pso_gsl_read_t *rv;
     pso_error_t erv = PSOARCHIVE_EFATAL;
-    uint32_t i, allocd = 256, offset, size, maxfiles;
-    uint8_t buf[48];
+    uint32_t i, offset, size, maxfiles;
+    uint8_t buf[48], *raw;
+    struct gsl_file *f;
     void *tmp;
 
     /* Allocate our archive handle... */
-    if(!(rv = (pso_gsl_read_t *)malloc(sizeof(pso_gsl_read_t)))) {
+    if(!(rv = (pso_gsl_read_t *)pso_malloc(sizeof(pso_gsl_read_t)))) {
         erv = PSOARCHIVE_EMEM;
         goto ret_err;
     }
 
-    /* Allocate some file handles... */
-    rv->files = (struct gsl_file *)malloc(sizeof(struct gsl_file) * 256);
-    if(!rv->files) {
-        erv = PSOARCHIVE_EMEM;
-        goto ret_handle;
-    }
-
     /* Read the first header in... */
-    if(read(fd, buf, 48) != 48) {
+    if(read_at(fd, buf, 48, 0)) {
         erv = PSOARCHIVE_NOARCHIVE;
-        goto ret_files;
+        goto ret_handle;
     }
 
     /* Make sure there's at least one file... */
     if(buf[0] == 0) {
         erv = PSOARCHIVE_EMPTY;
-        goto ret_files;
+        goto ret_handle;
     }
 
     /* If the user hasn't specified the endianness, then try to guess. */
@@ -91,7 +118,7 @@ pso_gsl_read_t *pso_gsl_read_open_fd(int fd, uint32_t len, uint32_t flags,
 
             if(offset * 2048 > len || size > len) {
                 erv = PSOARCHIVE_ERANGE;
-                goto ret_files;
+                goto ret_handle;
             }
         }
     }
@@ -104,71 +131,93 @@ pso_gsl_read_t *pso_gsl_read_open_fd(int fd, uint32_t len, uint32_t flags,
         size = (buf[39] << 24) | (buf[38] << 16) | (buf[37] << 8) | (buf[36]);
     }
 
-    memcpy(rv->files[0].filename, buf, 32);
-    rv->files[0].offset = offset * 2048;
-    rv->files[0].size = size;
-    maxfiles = rv->files[0].offset / 48;
+    /* The headers run up until the start of the first file. */
+    if(offset > len / 2048) {
+        erv = PSOARCHIVE_ERANGE;
+        goto ret_handle;
+    }
+
+    maxfiles = offset * 2048 / 48;
+
+    if(!maxfiles)
+        maxfiles = 1;
+
+    /* Allocate one buffer big enough for all of the headers, and read them all
+       in at once. The file handles get built in the same buffer, on top of the
+       raw headers (which works, since each handle is smaller than a header, so
+       we never overwrite anything we haven't looked at yet). */
+    if(!(raw = (uint8_t *)pso_malloc(maxfiles * 48))) {
+        erv = PSOARCHIVE_EMEM;
+        goto ret_handle;
+    }
+
+    memcpy(raw, buf, 48);
+
+    if(maxfiles > 1 && read_at(fd, raw + 48, (maxfiles - 1) * 48, 48)) {
+        erv = PSOARCHIVE_EIO;
+        goto ret_files;
+    }
 
-    /* Read the headers for each file... */
+    f = (struct gsl_file *)raw;
+    memmove(f[0].filename, raw, 32);
+    f[0].offset = offset * 2048;
+    f[0].size = size;
+
+    /* Parse the headers for each file... */
     for(i = 1; i < maxfiles; ++i) {
-        /* Read in the header... */
-        if(read(fd, buf, 48) != 48) {
-            erv = PSOARCHIVE_EIO;
-            goto ret_files;
-        }
+        const uint8_t *ent = raw + i * 48;
 
         /* Did we hit the end of the file list? */
-        if(buf[0] == 0)
+        if(ent[0] == 0)
             break;
 
         /* Parse out the size/offset. */
         if((flags & PSO_GSL_BIG_ENDIAN)) {
-            offset = (buf[35]) | (buf[34] << 8) | (buf[33] << 16) |
-                (buf[32] << 24);
-            size = (buf[39]) | (buf[38] << 8) | (buf[37] << 16) |
-                (buf[36] << 24);
+            offset = (ent[35]) | (ent[34] << 8) | (ent[33] << 16) |
+                (ent[32] << 24);
+            size = (ent[39]) | (ent[38] << 8) | (ent[37] << 16) |
+                (ent[36] << 24);
         }
         else /* if((flags & PSO_GSL_LITTLE_ENDIAN)) */ {
-            offset = (buf[35] << 24) | (buf[34] << 16) | (buf[33] << 8) |
-                (buf[32]);
-            size = (buf[39] << 24) | (buf[38] << 16) | (buf[37] << 8) |
-                (buf[36]);
+            offset = (ent[35] << 24) | (ent[34] << 16) | (ent[33] << 8) |
+                (ent[32]);
+            size = (ent[39] << 24) | (ent[38] << 16) | (ent[37] << 8) |
+                (ent[36]);
         }
 
-        /* Make sure we have space in the array... */
-        if(i == allocd) {
-            allocd *= 2;
-
-            if(!(tmp = realloc(rv->files, allocd * sizeof(struct gsl_file)))) {
-                erv = PSOARCHIVE_EMEM;
-                goto ret_files;
-            }
-
-            rv->files = (struct gsl_file *)tmp;
-        }
-
-        memcpy(rv->files[i].filename, buf, 32);
-        rv->files[i].offset = offset * 2048;
-        rv->files[i].size = size;
-
         /* Sanity check... */
-        if(rv->files[i].offset + rv->files[i].size > len) {
+        if(offset > len / 2048 || size > len - offset * 2048) {
             erv = PSOARCHIVE_ERANGE;
             goto ret_files;
         }
+
+        memmove(f[i].filename, ent, 32);
+        f[i].offset = offset * 2048;
+        f[i].size = size;
     }
 
-    /* Set the file count in the handle and shrink the files array... */
+    /* Set the file count in the handle and shrink the files array down to
+       what we actually used... */
     rv->fd = fd;
+    rv->files = f;
     rv->file_count = i;
     rv->flags = flags;
 
-    if(i != allocd) {
-        /* Don't fail if we can't do the realloc... It'll just waste a bit of
-           memory... Won't really hurt anything, though... */
-        if((tmp = realloc(rv->files, i * sizeof(struct gsl_file))))
-            rv->files = (struct gsl_file *)tmp;
+    /* Don't fail if we can't do the realloc... It'll just waste a bit of
+       memory... Won't really hurt anything, though... */
+    if((tmp = pso_realloc(rv->files, i * sizeof(struct gsl_file))))
+        rv->files = (struct gsl_file *)tmp;
+
+    /* Build the filename index, if the user wants it. This has to wait until
+       the files array is done moving around. */
+    rv->idx.slots = NULL;
 
+    if((flags & PSO_GSL_NAME_INDEX)) {
+        if((erv = pso_name_index_build(&rv->idx, rv->files[0].filename,
+                                       sizeof(struct gsl_file), i))) {
+            raw = (uint8_t *)rv->files;
+            goto ret_files;
+        }
     }
 
     /* We're done, return... */
@@ -178,9 +227,9 @@ pso_gsl_read_t *pso_gsl_read_open_fd(int fd, uint32_t len, uint32_t flags,
     return rv;
 
 ret_files:
-    free(rv->files);
+    pso_free(raw);
 ret_handle:
-    free(rv);
+    pso_free(rv);
 ret_err:
     if(err)
         *err = erv;
@@ -196,7 +245,7 @@ pso_gsl_read_t *pso_gsl_read_open(const char *fn, uint32_t flags,
     pso_gsl_read_t *rv;
 
     /* Open the file... */
-    if(!(fd = open(fn, O_RDONLY))) {
+    if((fd = open(fn, O_RDONLY)) < 0) {
         erv = PSOARCHIVE_EFILE;
         goto ret_err;
     }
@@ -235,8 +284,9 @@ pso_error_t pso_gsl_read_close(pso_gsl_read_t *a) {
         return PSOARCHIVE_EFATAL;
 
     close(a->fd);
-    free(a->files);
-    free(a);
+    pso_name_index_free(&a->idx);
+    pso_free(a->files);
+    pso_free(a);
 
     return PSOARCHIVE_OK;
 }
@@ -255,6 +305,9 @@ uint32_t pso_gsl_file_lookup(pso_gsl_read_t *a, const char *fn) {
     if(!a || !fn)
         return PSOARCHIVE_HND_INVALID;
 
+    if(a->idx.slots)
+        return pso_name_index_lookup(&a->idx, fn);
+
     /* Linear search through the archive for the file we want... */
     for(i = 0; i < a->file_count; ++i) {
         if(!strncmp(fn, a->files[i].filename, 32))
@@ -285,20 +338,69 @@ ssize_t pso_gsl_file_size(pso_gsl_read_t *a, uint32_t hnd) {
 
 ssize_t pso_gsl_file_read(pso_gsl_read_t *a, uint32_t hnd, uint8_t *buf,
                           size_t len) {
-    /* Make sure the arguments are sane... */
-    if(!a || hnd > a->file_count || !buf || !len)
-        return -1;
+    return pso_gsl_file_read_at(a, hnd, buf, len, 0);
+}
 
-    /* Seek to the appropriate position in the file. */
-    if(lseek(a->fd, a->files[hnd].offset, SEEK_SET) == (off_t) -1)
+ssize_t pso_gsl_file_read_at(pso_gsl_read_t *a, uint32_t hnd, uint8_t *buf,
+                             size_t len, uint32_t offset) {
+    /* Make sure the arguments are sane... */
+    if(!a || hnd >= a->file_count || !buf || !len)
         return -1;
 
     /* Figure out how much we're going to read... */
-    if(a->files[hnd].size < len)
-        len = a->files[hnd].size;
+    if(offset >= a->files[hnd].size)
+        return 0;
+
+    if(a->files[hnd].size - offset < len)
+        len = a->files[hnd].size - offset;
 
-    if(read(a->fd, buf, len) != len)
+    if(read_at(a->fd, buf, len, (off_t)a->files[hnd].offset + offset))
         return -1;
 
     return (ssize_t)len;
 }
+
+/* Glue between the reader and the bulk extraction code. */
+static ssize_t ex_size(void *a, uint32_t hnd) {
+    return pso_gsl_file_size((pso_gsl_read_t *)a, hnd);
+}
+
+static pso_error_t ex_name(void *a, uint32_t hnd, char *fn, size_t len) {
+    return pso_gsl_file_name((pso_gsl_read_t *)a, hnd, fn, len);
+}
+
+static ssize_t ex_read(void *a, uint32_t hnd, uint8_t *buf, size_t len) {
+    return pso_gsl_file_read((pso_gsl_read_t *)a, hnd, buf, len);
+}
+
+static void ex_src(pso_gsl_read_t *a, struct pso_extract_src *src) {
+    src->arc = a;
+    src->count = a->file_count;
+    src->size = &ex_size;
+    src->name = &ex_name;
+    src->read = &ex_read;
+    src->data = NULL;
+}
+
+pso_error_t pso_gsl_extract_all(pso_gsl_read_t *a, uint32_t flags,
+                                int threads, pso_extract_cb_t cb,
+                                void *udata) {
+    struct pso_extract_src src;
+
+    if(!a || !cb)
+        return PSOARCHIVE_EFAULT;
+
+    ex_src(a, &src);
+    return pso_extract_run(&src, flags, threads, cb, udata);
+}
+
+pso_error_t pso_gsl_extract_dir(pso_gsl_read_t *a, const char *dir,
+                                uint32_t flags, int threads) {
+    struct pso_extract_src src;
+
+    if(!a || !dir)
+        return PSOARCHIVE_EFAULT;
+
+    ex_src(a, &src);
+    return pso_extract_dir(&src, dir, flags, threads);
+}
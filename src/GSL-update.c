@@ -0,0 +1,450 @@
+/*
+    This file is part of libpsoarchive.
+
+    Copyright (C) 2026 Lawrence Sebald
+
+    This library is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 2.1 or
+    version 3 of the License.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <fcntl.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include "psoarchive-alloc.h"
+#include "GSL-common.h"
+#include "update.h"
+
+#define ALIGN(x)    (((x) + 0x7FF) & ~(uint64_t)0x7FF)
+
+/* Where the data starts in an archive made by pso_gsl_new(). */
+#define DATA_START  (256 * 48)
+
+/* Like with AFS archives, file data is written out as soon as it is added, and
+   the changed parts of the file table are written when the archive is closed.
+   Files that have been replaced are marked in changed, so only their own
+   entries get written, and dirty is the first entry that has moved around
+   (from adding or deleting files). */
+struct pso_gsl_update {
+    int fd;
+
+    uint32_t count;
+    uint32_t disk_count;
+    uint32_t max;
+    uint32_t allocd;
+    uint32_t dirty;
+    uint32_t flags;
+
+    uint64_t data_start;
+    uint64_t end;
+
+    struct gsl_file *files;
+    uint8_t *changed;
+};
+
+static uint32_t get32(const uint8_t *buf, int big) {
+    if(big)
+        return ((uint32_t)buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) |
+            buf[3];
+    else
+        return ((uint32_t)buf[3] << 24) | (buf[2] << 16) | (buf[1] << 8) |
+            buf[0];
+}
+
+pso_gsl_update_t *pso_gsl_update_open(const char *fn, uint32_t flags,
+                                      pso_error_t *err) {
+    pso_gsl_update_t *rv;
+    pso_error_t erv = PSOARCHIVE_OK;
+    uint8_t ent[48], *buf = NULL;
+    struct stat st;
+    uint32_t i, maxfiles, offset, size;
+    uint64_t start;
+    int big;
+
+    /* Allocate our archive handle... */
+    if(!(rv = (pso_gsl_update_t *)pso_malloc(sizeof(pso_gsl_update_t)))) {
+        erv = PSOARCHIVE_EMEM;
+        goto ret_err;
+    }
+
+    memset(rv, 0, sizeof(pso_gsl_update_t));
+
+    if((rv->fd = open(fn, O_RDWR)) < 0) {
+        erv = PSOARCHIVE_EFILE;
+        goto ret_handle;
+    }
+
+    if(fstat(rv->fd, &st) < 0) {
+        erv = PSOARCHIVE_EFILE;
+        goto ret_file;
+    }
+
+    rv->end = (uint64_t)st.st_size;
+
+    if(pso_update_read_at(rv->fd, ent, 48, 0)) {
+        erv = PSOARCHIVE_NOARCHIVE;
+        goto ret_file;
+    }
+
+    /* Figure out the endianness, if we weren't told, the same way the reader
+       does: big endian, unless that puts the first file outside the archive. */
+    if((flags & GSL_ENDIANNESS) == GSL_ENDIANNESS) {
+        erv = PSOARCHIVE_EFATAL;
+        goto ret_file;
+    }
+    else if(!(flags & GSL_ENDIANNESS)) {
+        offset = get32(ent + 32, 1);
+        size = get32(ent + 36, 1);
+
+        if(offset > rv->end / 2048 || size > rv->end)
+            flags |= PSO_GSL_LITTLE_ENDIAN;
+        else
+            flags |= PSO_GSL_BIG_ENDIAN;
+    }
+
+    big = !!(flags & PSO_GSL_BIG_ENDIAN);
+    rv->flags = flags;
+
+    /* The table runs up until the first file (or to where pso_gsl_new() would
+       have started things, if the archive is empty). */
+    if(ent[0])
+        start = (uint64_t)get32(ent + 32, big) * 2048;
+    else
+        start = DATA_START;
+
+    if(start > rv->end && ent[0]) {
+        erv = PSOARCHIVE_ERANGE;
+        goto ret_file;
+    }
+
+    maxfiles = (uint32_t)(start / 48);
+
+    if(!(buf = (uint8_t *)pso_malloc(maxfiles ? maxfiles * 48 : 1))) {
+        erv = PSOARCHIVE_EMEM;
+        goto ret_file;
+    }
+
+    if(ent[0] && (erv = pso_update_read_at(rv->fd, buf, maxfiles * 48, 0)))
+        goto ret_buf;
+
+    rv->allocd = maxfiles ? maxfiles : 1;
+
+    if(!(rv->files = (struct gsl_file *)
+         pso_malloc(sizeof(struct gsl_file) * rv->allocd))) {
+        erv = PSOARCHIVE_EMEM;
+        goto ret_buf;
+    }
+
+    if(!(rv->changed = (uint8_t *)pso_malloc(rv->allocd))) {
+        erv = PSOARCHIVE_EMEM;
+        goto ret_files;
+    }
+
+    memset(rv->changed, 0, rv->allocd);
+
+    /* Parse the headers for each file... */
+    for(i = 0; ent[0] && i < maxfiles && buf[i * 48]; ++i) {
+        offset = get32(buf + i * 48 + 32, big);
+        size = get32(buf + i * 48 + 36, big);
+
+        if(offset > rv->end / 2048 || size > rv->end - offset * 2048) {
+            erv = PSOARCHIVE_ERANGE;
+            goto ret_files;
+        }
+
+        memcpy(rv->files[i].filename, buf + i * 48, 32);
+        rv->files[i].offset = offset * 2048;
+        rv->files[i].size = size;
+
+        if(size && rv->files[i].offset < start)
+            start = rv->files[i].offset;
+    }
+
+    pso_free(buf);
+
+    rv->count = rv->disk_count = i;
+    rv->dirty = i + 1;
+    rv->data_start = start;
+
+    /* Leave room for the empty entry at the end of the table. If the table is
+       already full, there's no room for one, so nothing can be added (but the
+       files that are there can still be replaced or deleted). */
+    rv->max = start / 48 > 0 ? (uint32_t)(start / 48) - 1 : 0;
+
+    if(rv->max < rv->count)
+        rv->max = rv->count;
+
+    if(err)
+        *err = PSOARCHIVE_OK;
+
+    return rv;
+
+ret_files:
+    pso_free(rv->changed);
+    pso_free(rv->files);
+ret_buf:
+    pso_free(buf);
+ret_file:
+    close(rv->fd);
+ret_handle:
+    pso_free(rv);
+ret_err:
+    if(err)
+        *err = erv;
+
+    return NULL;
+}
+
+/* Find a place for len bytes of data, steering clear of every file in the
+   archive other than skip (which is being replaced). */
+static pso_error_t find_space(pso_gsl_update_t *a, uint32_t skip,
+                              uint32_t len, uint64_t *rv) {
+    struct pso_extent *ext;
+    uint32_t i, n = 0;
+
+    if(!(ext = (struct pso_extent *)
+         pso_malloc(sizeof(struct pso_extent) * (a->count + 1))))
+        return PSOARCHIVE_EMEM;
+
+    for(i = 0; i < a->count; ++i) {
+        if(i != skip) {
+            ext[n].offset = a->files[i].offset;
+            ext[n++].len = a->files[i].size;
+        }
+    }
+
+    *rv = pso_update_find_space(ext, n, a->data_start, &a->end, len);
+    pso_free(ext);
+
+    if((*rv >> 11) > 0xFFFFFFFF)
+        return PSOARCHIVE_ERANGE;
+
+    return PSOARCHIVE_OK;
+}
+
+/* Can the file hnd be replaced with len bytes of data without running into
+   anything else in the archive? */
+static int fits_in_place(pso_gsl_update_t *a, uint32_t hnd, uint32_t len) {
+    uint64_t off = a->files[hnd].offset, end = off + ALIGN(len);
+    uint32_t i;
+
+    if(!a->files[hnd].size || ALIGN(len) > ALIGN(a->files[hnd].size))
+        return 0;
+
+    for(i = 0; i < a->count; ++i) {
+        if(i == hnd || !a->files[i].size)
+            continue;
+
+        /* Don't scribble on data that another file shares with this one. */
+        if(a->files[i].offset == off)
+            return 0;
+
+        if(a->files[i].offset > off && a->files[i].offset < end)
+            return 0;
+    }
+
+    return 1;
+}
+
+uint32_t pso_gsl_update_count(pso_gsl_update_t *a) {
+    if(!a)
+        return 0;
+
+    return a->count;
+}
+
+uint32_t pso_gsl_update_lookup(pso_gsl_update_t *a, const char *fn) {
+    uint32_t i;
+
+    if(!a)
+        return PSOARCHIVE_HND_INVALID;
+
+    for(i = 0; i < a->count; ++i) {
+        if(!strncmp(a->files[i].filename, fn, GSL_FILENAME_LEN))
+            return i;
+    }
+
+    return PSOARCHIVE_HND_INVALID;
+}
+
+pso_error_t pso_gsl_update_replace(pso_gsl_update_t *a, uint32_t hnd,
+                                   const uint8_t *data, uint32_t len) {
+    uint64_t pos;
+    pso_error_t rv;
+
+    if(!a || hnd >= a->count || (!data && len))
+        return PSOARCHIVE_EFATAL;
+
+    /* Put it back where it was if there's room, otherwise find a new home. */
+    if(fits_in_place(a, hnd, len))
+        pos = a->files[hnd].offset;
+    else if((rv = find_space(a, hnd, len, &pos)))
+        return rv;
+
+    if(len && (rv = pso_update_write_data(a->fd, data, len, pos)))
+        return rv;
+
+    a->files[hnd].offset = (uint32_t)pos;
+    a->files[hnd].size = len;
+    a->changed[hnd] = 1;
+
+    return PSOARCHIVE_OK;
+}
+
+pso_error_t pso_gsl_update_add(pso_gsl_update_t *a, const char *fn,
+                               const uint8_t *data, uint32_t len) {
+    struct gsl_file *tmp;
+    uint8_t *ch;
+    uint64_t pos;
+    pso_error_t rv;
+
+    /* An empty name would look like the end of the table. */
+    if(!a || !fn || !fn[0] || (!data && len))
+        return PSOARCHIVE_EFATAL;
+
+    /* Make sure there's room in the table for it. */
+    if(a->count >= a->max)
+        return PSOARCHIVE_ENOSPC;
+
+    if(a->count == a->allocd) {
+        tmp = (struct gsl_file *)pso_realloc(a->files, sizeof(struct gsl_file) *
+                                             a->allocd * 2);
+        if(!tmp)
+            return PSOARCHIVE_EMEM;
+
+        a->files = tmp;
+
+        if(!(ch = (uint8_t *)pso_realloc(a->changed, a->allocd * 2)))
+            return PSOARCHIVE_EMEM;
+
+        a->changed = ch;
+        a->allocd *= 2;
+    }
+
+    if((rv = find_space(a, PSOARCHIVE_HND_INVALID, len, &pos)))
+        return rv;
+
+    if(len && (rv = pso_update_write_data(a->fd, data, len, pos)))
+        return rv;
+
+    strncpy(a->files[a->count].filename, fn, GSL_FILENAME_LEN);
+    a->files[a->count].offset = (uint32_t)pos;
+    a->files[a->count].size = len;
+    a->changed[a->count] = 0;
+
+    if(a->count < a->dirty)
+        a->dirty = a->count;
+
+    ++a->count;
+
+    return PSOARCHIVE_OK;
+}
+
+pso_error_t pso_gsl_update_delete(pso_gsl_update_t *a, uint32_t hnd) {
+    if(!a || hnd >= a->count)
+        return PSOARCHIVE_EFATAL;
+
+    memmove(a->files + hnd, a->files + hnd + 1,
+            sizeof(struct gsl_file) * (a->count - hnd - 1));
+    memmove(a->changed + hnd, a->changed + hnd + 1, a->count - hnd - 1);
+    --a->count;
+
+    if(hnd < a->dirty)
+        a->dirty = hnd;
+
+    return PSOARCHIVE_OK;
+}
+
+/* Write out n entries of the file table, starting with first (clearing out
+   any past the end of the files). */
+static pso_error_t write_ents(pso_gsl_update_t *a, uint32_t first,
+                              uint32_t n) {
+    uint8_t *buf;
+    uint32_t i;
+    pso_error_t rv;
+
+    if(!(buf = (uint8_t *)pso_malloc(n * 48)))
+        return PSOARCHIVE_EMEM;
+
+    memset(buf, 0, n * 48);
+
+    for(i = first; i < first + n && i < a->count; ++i) {
+        pso_gsl_fill_entry(buf + (i - first) * 48, a->files[i].filename,
+                           a->files[i].offset >> 11, a->files[i].size,
+                           a->flags);
+    }
+
+    rv = pso_update_write_at(a->fd, buf, n * 48, (uint64_t)first * 48);
+    pso_free(buf);
+
+    return rv;
+}
+
+/* Write out the parts of the file table that changed: each run of replaced
+   files, then everything from the first entry that moved through to the last
+   one that's on the disk (clearing out any that aren't used now). Nothing gets
+   written past the end of the table, so a full table doesn't get an empty
+   entry on the end of it. */
+static pso_error_t write_table(pso_gsl_update_t *a) {
+    uint32_t i, j, last, end, slots;
+    pso_error_t rv;
+
+    end = a->dirty < a->count ? a->dirty : a->count;
+
+    for(i = 0; i < end; i = j) {
+        j = i + 1;
+
+        if(!a->changed[i])
+            continue;
+
+        while(j < end && a->changed[j])
+            ++j;
+
+        if((rv = write_ents(a, i, j - i)))
+            return rv;
+    }
+
+    last = a->count > a->disk_count ? a->count : a->disk_count;
+    slots = (uint32_t)(a->data_start / 48);
+    end = last < slots ? last + 1 : slots;
+
+    if(a->dirty >= end)
+        return PSOARCHIVE_OK;
+
+    return write_ents(a, a->dirty, end - a->dirty);
+}
+
+pso_error_t pso_gsl_update_close(pso_gsl_update_t *a) {
+    pso_error_t rv;
+
+    if(!a)
+        return PSOARCHIVE_EFATAL;
+
+    rv = write_table(a);
+
+    if(close(a->fd) && !rv)
+        rv = PSOARCHIVE_EIO;
+
+    pso_free(a->changed);
+    pso_free(a->files);
+    pso_free(a);
+
+    return rv;
+}
@@ -28,7 +28,10 @@
 #include <unistd.h>
 #endif
 
+#include "psoarchive-alloc.h"
 #include "GSL-common.h"
+#include "build.h"
+#include "dedup.h"
 
 struct pso_gsl_write {
     int fd;
@@ -40,6 +43,8 @@ struct pso_gsl_write {
 
     off_t ftab_pos;
     off_t data_pos;
+
+    struct pso_dedup dedup;
 };
 
 static off_t pad_file(int fd, int boundary) {
@@ -61,6 +66,36 @@ static off_t pad_file(int fd, int boundary) {
     return pos;
 }
 
+/* Fill in an entry in the file table. The offset is in 2048 byte blocks. */
+void pso_gsl_fill_entry(uint8_t *buf, const char *fn, uint32_t blk,
+                        uint32_t len, uint32_t flags) {
+    strncpy((char *)buf, fn, 32);
+
+    if((flags & PSO_GSL_BIG_ENDIAN)) {
+        buf[32] = (uint8_t)(blk >> 24);
+        buf[33] = (uint8_t)(blk >> 16);
+        buf[34] = (uint8_t)(blk >> 8);
+        buf[35] = (uint8_t)(blk);
+        buf[36] = (uint8_t)(len >> 24);
+        buf[37] = (uint8_t)(len >> 16);
+        buf[38] = (uint8_t)(len >> 8);
+        buf[39] = (uint8_t)(len);
+    }
+    else {
+        buf[32] = (uint8_t)(blk);
+        buf[33] = (uint8_t)(blk >> 8);
+        buf[34] = (uint8_t)(blk >> 16);
+        buf[35] = (uint8_t)(blk >> 24);
+        buf[36] = (uint8_t)(len);
+        buf[37] = (uint8_t)(len >> 8);
+        buf[38] = (uint8_t)(len >> 16);
+        buf[39] = (uint8_t)(len >> 24);
+    }
+
+    buf[40] = buf[41] = buf[42] = buf[43] = 0;
+    buf[44] = buf[45] = buf[46] = buf[47] = 0;
+}
+
 pso_gsl_write_t *pso_gsl_new(const char *fn, uint32_t flags, pso_error_t *err) {
     pso_gsl_write_t *rv;
     pso_error_t erv = PSOARCHIVE_OK;
@@ -73,7 +108,7 @@ pso_gsl_write_t *pso_gsl_new(const char *fn, uint32_t flags, pso_error_t *err) {
     }
 
     /* Allocate space for our write context. */
-    if(!(rv = (pso_gsl_write_t *)malloc(sizeof(pso_gsl_write_t)))) {
+    if(!(rv = (pso_gsl_write_t *)pso_malloc(sizeof(pso_gsl_write_t)))) {
         erv = PSOARCHIVE_EMEM;
         goto ret_err;
     }
@@ -90,6 +125,7 @@ pso_gsl_write_t *pso_gsl_new(const char *fn, uint32_t flags, pso_error_t *err) {
     rv->ftab_pos = 0;
     rv->data_pos = 256 * 48;
     rv->flags = flags;
+    pso_dedup_init(&rv->dedup);
 
     /* We're done, return success. */
     if(err)
@@ -98,7 +134,7 @@ pso_gsl_write_t *pso_gsl_new(const char *fn, uint32_t flags, pso_error_t *err) {
     return rv;
 
 ret_mem:
-    free(rv);
+    pso_free(rv);
 ret_err:
     if(err)
         *err = erv;
@@ -118,7 +154,7 @@ pso_gsl_write_t *pso_gsl_new_fd(int fd, uint32_t flags, pso_error_t *err) {
     }
 
     /* Allocate space for our write context. */
-    if(!(rv = (pso_gsl_write_t *)malloc(sizeof(pso_gsl_write_t)))) {
+    if(!(rv = (pso_gsl_write_t *)pso_malloc(sizeof(pso_gsl_write_t)))) {
         erv = PSOARCHIVE_EMEM;
         goto ret_err;
     }
@@ -130,6 +166,7 @@ pso_gsl_write_t *pso_gsl_new_fd(int fd, uint32_t flags, pso_error_t *err) {
     rv->ftab_pos = 0;
     rv->data_pos = 256 * 48;
     rv->flags = flags;
+    pso_dedup_init(&rv->dedup);
 
     /* We're done, return success. */
     if(err)
@@ -138,7 +175,7 @@ pso_gsl_write_t *pso_gsl_new_fd(int fd, uint32_t flags, pso_error_t *err) {
     return rv;
 
 //ret_mem:
-//    free(rv);
+//    pso_free(rv);
 ret_err:
     if(err)
         *err = erv;
@@ -150,8 +187,9 @@ pso_error_t pso_gsl_write_close(pso_gsl_write_t *a) {
     if(!a || a->fd < 0)
         return PSOARCHIVE_EFATAL;
 
+    pso_dedup_free(&a->dedup);
     close(a->fd);
-    free(a);
+    pso_free(a);
 
     return PSOARCHIVE_OK;
 }
@@ -178,7 +216,10 @@ pso_error_t pso_gsl_write_set_ftab_size(pso_gsl_write_t *a, uint32_t ents) {
 pso_error_t pso_gsl_write_add(pso_gsl_write_t *a, const char *fn,
                               const uint8_t *data, uint32_t len) {
     uint8_t buf[48];
-    uint32_t tmp;
+    uint64_t hash = 0, where;
+    uint32_t iter = 0;
+    off_t pos;
+    int dedup;
 
     if(!a)
         return PSOARCHIVE_EFATAL;
@@ -187,37 +228,26 @@ pso_error_t pso_gsl_write_add(pso_gsl_write_t *a, const char *fn,
     if(a->ftab_used == a->ftab_entries - 1)
         return PSOARCHIVE_EFATAL;
 
+    /* If we've already stored the same data, just point at that. */
+    pos = a->data_pos;
+
+    if((dedup = (a->flags & PSO_GSL_DEDUP) && len)) {
+        hash = pso_dedup_hash(data, len);
+
+        while(pso_dedup_next(&a->dedup, hash, len, &iter, &where)) {
+            if(pso_dedup_same_fd(a->fd, where, data, len)) {
+                pos = (off_t)where;
+                break;
+            }
+        }
+    }
+
     /* Go to where we'll be writing into the file table... */
     if(lseek(a->fd, a->ftab_pos, SEEK_SET) == (off_t)-1)
         return PSOARCHIVE_EIO;
 
     /* Copy the file data into the buffer... */
-    strncpy((char *)buf, fn, 32);
-    tmp = a->data_pos >> 11;
-
-    if((a->flags & PSO_GSL_BIG_ENDIAN)) {
-        buf[32] = (uint8_t)(tmp >> 24);
-        buf[33] = (uint8_t)(tmp >> 16);
-        buf[34] = (uint8_t)(tmp >> 8);
-        buf[35] = (uint8_t)(tmp);
-        buf[36] = (uint8_t)(len >> 24);
-        buf[37] = (uint8_t)(len >> 16);
-        buf[38] = (uint8_t)(len >> 8);
-        buf[39] = (uint8_t)(len);
-    }
-    else {
-        buf[32] = (uint8_t)(tmp);
-        buf[33] = (uint8_t)(tmp >> 8);
-        buf[34] = (uint8_t)(tmp >> 16);
-        buf[35] = (uint8_t)(tmp >> 24);
-        buf[36] = (uint8_t)(len);
-        buf[37] = (uint8_t)(len >> 8);
-        buf[38] = (uint8_t)(len >> 16);
-        buf[39] = (uint8_t)(len >> 24);
-    }
-
-    buf[40] = buf[41] = buf[42] = buf[43] = 0;
-    buf[44] = buf[45] = buf[46] = buf[47] = 0;
+    pso_gsl_fill_entry(buf, fn, (uint32_t)(pos >> 11), len, a->flags);
 
     /* Write out the header... */
     if(write(a->fd, buf, 48) != 48)
@@ -226,6 +256,10 @@ pso_error_t pso_gsl_write_add(pso_gsl_write_t *a, const char *fn,
     a->ftab_pos += 48;
     ++a->ftab_used;
 
+    /* Nothing more to do if the data is already there. */
+    if(pos != a->data_pos)
+        return PSOARCHIVE_OK;
+
     /* Seek to where the file data goes... */
     if(lseek(a->fd, a->data_pos, SEEK_SET) == (off_t)-1)
         return PSOARCHIVE_EIO;
@@ -237,19 +271,53 @@ pso_error_t pso_gsl_write_add(pso_gsl_write_t *a, const char *fn,
     /* Pad the data position out to where the next file will start. */
     a->data_pos = pad_file(a->fd, 2048);
 
+    /* Remember where it went. If this fails, all we lose is the chance to
+       share this file's data, so don't worry about it. */
+    if(dedup)
+        pso_dedup_add(&a->dedup, hash, len, (uint64_t)pos);
+
     /* Done. */
     return PSOARCHIVE_OK;
 }
 
+/* With deduplication, the data has to be read in first to see if it's already
+   in the archive. */
+static pso_error_t add_fd_dedup(pso_gsl_write_t *a, const char *fn, int fd,
+                                uint32_t len) {
+    uint8_t *buf;
+    uint32_t pos = 0;
+    ssize_t r;
+    pso_error_t rv;
+
+    if(!(buf = (uint8_t *)pso_malloc(len ? len : 1)))
+        return PSOARCHIVE_EMEM;
+
+    while(pos < len) {
+        if((r = read(fd, buf + pos, len - pos)) <= 0) {
+            pso_free(buf);
+            return PSOARCHIVE_EIO;
+        }
+
+        pos += (uint32_t)r;
+    }
+
+    rv = pso_gsl_write_add(a, fn, buf, len);
+    pso_free(buf);
+
+    return rv;
+}
+
 pso_error_t pso_gsl_write_add_fd(pso_gsl_write_t *a, const char *fn, int fd,
                                  uint32_t len) {
     uint8_t buf[512];
-    uint32_t tmp;
     ssize_t bytes;
 
     if(!a)
         return PSOARCHIVE_EFATAL;
 
+    if((a->flags & PSO_GSL_DEDUP))
+        return add_fd_dedup(a, fn, fd, len);
+
     /* XXXX: Support extending the file table... */
     if(a->ftab_used == a->ftab_entries - 1)
         return PSOARCHIVE_EFATAL;
@@ -259,32 +327,8 @@ pso_error_t pso_gsl_write_add_fd(pso_gsl_write_t *a, const char *fn, int fd,
         return PSOARCHIVE_EIO;
 
     /* Copy the file data into the buffer... */
-    strncpy((char *)buf, fn, 32);
-    tmp = a->data_pos >> 11;
-
-    if((a->flags & PSO_GSL_BIG_ENDIAN)) {
-        buf[32] = (uint8_t)(tmp >> 24);
-        buf[33] = (uint8_t)(tmp >> 16);
-        buf[34] = (uint8_t)(tmp >> 8);
-        buf[35] = (uint8_t)(tmp);
-        buf[36] = (uint8_t)(len >> 24);
-        buf[37] = (uint8_t)(len >> 16);
-        buf[38] = (uint8_t)(len >> 8);
-        buf[39] = (uint8_t)(len);
-    }
-    else {
-        buf[32] = (uint8_t)(tmp);
-        buf[33] = (uint8_t)(tmp >> 8);
-        buf[34] = (uint8_t)(tmp >> 16);
-        buf[35] = (uint8_t)(tmp >> 24);
-        buf[36] = (uint8_t)(len);
-        buf[37] = (uint8_t)(len >> 8);
-        buf[38] = (uint8_t)(len >> 16);
-        buf[39] = (uint8_t)(len >> 24);
-    }
-
-    buf[40] = buf[41] = buf[42] = buf[43] = 0;
-    buf[44] = buf[45] = buf[46] = buf[47] = 0;
+    pso_gsl_fill_entry(buf, fn, (uint32_t)(a->data_pos >> 11), len,
+                       a->flags);
 
     /* Write out the header... */
     if(write(a->fd, buf, 48) != 48)
@@ -346,3 +390,110 @@ pso_error_t pso_gsl_write_add_file(pso_gsl_write_t *a, const char *afn,
     close(fd);
     return err;
 }
+
+pso_error_t pso_gsl_build_fd(int fd, uint32_t flags,
+                             const pso_build_file_t *files, uint32_t count,
+                             int level, int threads) {
+    struct pso_build_item *items;
+    struct pso_build_out out;
+    uint8_t buf[48];
+    uint64_t pos, data_start;
+    uint32_t i, *offs;
+    pso_error_t rv;
+
+    if(fd < 0)
+        return PSOARCHIVE_EFATAL;
+
+    /* Make sure the user specified an endianness for the file... */
+    if(!(flags & GSL_ENDIANNESS) ||
+       (flags & GSL_ENDIANNESS) == GSL_ENDIANNESS)
+        return PSOARCHIVE_EFATAL;
+
+    /* Read in and compress everything first... */
+    if((rv = pso_build_prepare(files, count, level, threads, &items)))
+        return rv;
+
+    if(!(offs = (uint32_t *)pso_malloc(sizeof(uint32_t) * (count + 1)))) {
+        rv = PSOARCHIVE_EMEM;
+        goto out_items;
+    }
+
+    /* Files with the same contents as an earlier one just share its data. */
+    if((flags & PSO_GSL_DEDUP) && (rv = pso_build_dedup(items, count)))
+        goto out_offs;
+
+    /* Figure out where everything goes. The file table is sized just like
+       pso_gsl_write_set_ftab_size would do it (with room for an empty entry at
+       the end), and each file starts on a 2048 byte boundary. */
+    data_start = (count + 1 < 256 ? 256 : (uint64_t)count + 1) * 48;
+    data_start = (data_start + 0x7FF) & ~(uint64_t)0x7FF;
+    pos = data_start;
+
+    for(i = 0; i < count; ++i) {
+        if(items[i].same != i) {
+            offs[i] = offs[items[i].same];
+            continue;
+        }
+
+        offs[i] = (uint32_t)(pos >> 11);
+        pos = (pos + items[i].len + 0x7FF) & ~(uint64_t)0x7FF;
+
+        if((pos >> 11) > 0xFFFFFFFF) {
+            rv = PSOARCHIVE_ERANGE;
+            goto out_offs;
+        }
+    }
+
+    if((rv = pso_build_out_init(&out, fd)))
+        goto out_offs;
+
+    /* Write the file table... */
+    for(i = 0; i < count; ++i) {
+        pso_gsl_fill_entry(buf, files[i].name, offs[i], items[i].len,
+                           flags);
+
+        if((rv = pso_build_out_write(&out, buf, 48)))
+            goto out_close;
+    }
+
+    /* ... and then all the data. */
+    for(i = 0; i < count; ++i) {
+        if(items[i].same != i)
+            continue;
+
+        if((rv = pso_build_out_zero(&out, ((uint64_t)offs[i] << 11) -
+                                    out.pos)))
+            goto out_close;
+
+        if((rv = pso_build_out_write(&out, items[i].data, items[i].len)))
+            goto out_close;
+    }
+
+    rv = pso_build_out_zero(&out, pos - out.pos);
+
+out_close:
+    if(pso_build_out_finish(&out) && !rv)
+        rv = PSOARCHIVE_EIO;
+out_offs:
+    pso_free(offs);
+out_items:
+    pso_build_cleanup(items, count);
+    return rv;
+}
+
+pso_error_t pso_gsl_build(const char *fn, uint32_t flags,
+                          const pso_build_file_t *files, uint32_t count,
+                          int level, int threads) {
+    pso_error_t rv;
+    int fd;
+
+    if((fd = open(fn, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+        return PSOARCHIVE_EFILE;
+
+    rv = pso_gsl_build_fd(fd, flags, files, count, level, threads);
+
+    if(close(fd) && !rv)
+        rv = PSOARCHIVE_EIO;
+
+    return rv;
+}
@@ -0,0 +1,56 @@
+/*
+    This file is part of libpsoarchive.
+
+    Copyright (C) 2026 Lawrence Sebald
+
+    This library is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 2.1 or
+    version 3 of the License.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "PRS.h"
+
+/* The decoder will not start on a token unless it has at least this many bytes
+   of input available (unless it's been told there's no more coming). The
+   longest a single pass through the decoder can read is a flag byte followed
+   by a run of eight literals, but it doesn't hurt to have a bit of slack. */
+#define PRS_DEC_MAX_TOKEN   16
+
+struct prs_dec_state {
+    size_t dp;
+    unsigned int flags;
+    unsigned int bits;
+    int done;
+};
+
+/* Called as the compressor goes along to say that the first len bytes of the
+   output at buf are finished, and won't be touched again. */
+typedef void (*prs_emit_t)(uint8_t *buf, size_t len, void *udata);
+
+/* Called by the decoder to read the next len bytes of compressed data into
+   buf, when decompressing from somewhere other than memory. Returns nonzero if
+   that couldn't be done. */
+typedef int (*prs_read_t)(uint8_t *buf, size_t len, void *udata);
+
+/* These functions are all for internal use only. */
+ssize_t pso_prs_decode_chunk(struct prs_dec_state *st, const uint8_t *src,
+                             size_t src_len, int final, uint8_t **dst,
+                             size_t *dst_len, int grow);
+int pso_prs_decompress_read(prs_read_t rd, void *udata, size_t src_len,
+                            uint8_t **dst, size_t dst_len, int grow);
+int pso_prs_compress_into(pso_prs_compressor_t *c, int level,
+                          const uint8_t *src, uint8_t *dst, size_t src_len,
+                          size_t dst_len, prs_emit_t emit, void *udata);
@@ -35,10 +35,15 @@
 #include <stddef.h>
 
 #include "psoarchive-error.h"
+#include "psoarchive-alloc.h"
 #include "PRS.h"
+#include "PRS-common.h"
+#include "workers.h"
 
 #define MAX_WINDOW   0x2000
 #define WINDOW_MASK  (MAX_WINDOW - 1)
+#define MAX_MATCH    256
+#define SHORT_WINDOW 256
 #define HASH_SIZE    (1 << 8)
 #define HASH_MASK    (HASH_SIZE - 1)
 #define HASH(c1, c2) (c1 ^ c2)
@@ -50,11 +55,6 @@
     htab->ENT(h) = s; \
 }
 
-#define INIT_ADD_HASH(htab, s, h) { \
-    h = HASH(*(s), *(s + 1)); \
-    ADD_TO_HASH(htab, s, h); \
-}
-
 #define HASH_STR(s) HASH(*(s), *((s) + 1))
 
 struct prs_comp_cxt {
@@ -69,11 +69,40 @@ struct prs_comp_cxt {
     size_t dst_len;
     size_t src_pos;
     size_t dst_pos;
+
+    int max_chain;
+    int nice_len;
+    int lazy;
 };
 
-struct prs_hash_cxt {
-    const uint8_t *hash[HASH_SIZE];
-    const uint8_t *h_prev[MAX_WINDOW];
+struct prs_match {
+    int len;
+    int offset;
+    int near_len;
+    int near_offset;
+};
+
+/* Match finder interface.
+
+   A match finder keeps track of the strings in the window that we've seen so
+   far and is responsible for finding matches for the string at the current
+   position in the input. The longest function follows the contract of the
+   original find_longest_match (returning the length of the longest match and
+   its offset, only adding the current string to the window if lazy is not
+   set), while the matches function fills in both the longest match and the
+   longest one in reach of a short copy (for the optimal parser) and always adds
+   the string to the window. The insert function adds count strings starting at
+   pos to the window, without looking for matches. The slide function is used
+   by the streaming compressor when it moves the data in its buffer shift bytes
+   toward the front (where shift is always a multiple of MAX_WINDOW), and must
+   adjust everything the finder has stored to match. */
+struct prs_match_finder {
+    size_t size;
+    void (*init)(void *mf);
+    int (*longest)(struct prs_comp_cxt *cxt, void *mf, int *pos, int lazy);
+    void (*matches)(struct prs_comp_cxt *cxt, void *mf, struct prs_match *m);
+    void (*insert)(struct prs_comp_cxt *cxt, void *mf, size_t pos, int count);
+    void (*slide)(struct prs_comp_cxt *cxt, void *mf, size_t shift);
 };
 
 /******************************************************************************
@@ -176,10 +205,35 @@ static int write_eof(struct prs_comp_cxt *cxt) {
     return 0;
 }
 
+#ifdef PRS_HASH_CHAINS
+/******************************************************************************
+    Hash chain match finder.
+
+    This is the original match finder. Every string in the window is put into
+    one of 256 hash chains based on its first two bytes, and finding a match
+    involves walking the whole chain for the current string back to the edge of
+    the window. This is simple, and works fine on "normal" data, but on data
+    with long runs of the same byte (or very few distinct bytes), the chains get
+    very long and this gets very slow.
+ ******************************************************************************/
+struct prs_hash_cxt {
+    const uint8_t *hash[HASH_SIZE];
+    const uint8_t *h_prev[MAX_WINDOW];
+};
+
+static void hc_init(void *mf) {
+    memset(mf, 0, sizeof(struct prs_hash_cxt));
+}
+
 static int match_length(struct prs_comp_cxt *cxt, const uint8_t *s2) {
     int len = 0;
     const uint8_t *s1 = cxt->src + cxt->src_pos, *end = cxt->src + cxt->src_len;
 
+    /* There's no point in looking any further than the longest match that we
+       can actually encode. */
+    if(end - s1 > MAX_MATCH)
+        end = s1 + MAX_MATCH;
+
     while(s1 < end && *s1 == *s2) {
         ++len;
         ++s1;
@@ -189,16 +243,18 @@ static int match_length(struct prs_comp_cxt *cxt, const uint8_t *s2) {
     return len;
 }
 
-static int find_longest_match(struct prs_comp_cxt *cxt, struct prs_hash_cxt *hc,
-                              int *pos, int lazy) {
+static int find_longest_match(struct prs_comp_cxt *cxt, void *mf, int *pos,
+                              int lazy) {
+    struct prs_hash_cxt *hc = (struct prs_hash_cxt *)mf;
     uint8_t hash;
     const uint8_t *ent, *ent2;
-    int mlen;
+    int mlen, chain = cxt->max_chain;
     int longest = 0;
     const uint8_t *longest_match = NULL;
     uintptr_t diff;
 
-    if(cxt->src_pos >= cxt->src_len)
+    /* We need at least two bytes to hash, and to make any sort of match. */
+    if(cxt->src_pos + 1 >= cxt->src_len)
         return 0;
 
     /* Figure out where we're looking. */
@@ -234,6 +290,11 @@ static int find_longest_match(struct prs_comp_cxt *cxt, struct prs_hash_cxt *hc,
             }
         }
 
+        /* Don't bother going any further if we've got something good enough,
+           or if we've already looked far enough. */
+        if(longest >= cxt->nice_len || !--chain)
+            break;
+
         /* Follow the chain, making sure not to exceed a difference of 8KiB. */
         if((ent2 = hc->PREV(ent))) {
             diff = (uintptr_t)ent2 - (uintptr_t)cxt->src;
@@ -262,15 +323,600 @@ static int find_longest_match(struct prs_comp_cxt *cxt, struct prs_hash_cxt *hc,
     return longest;
 }
 
-static void add_intermediates(struct prs_comp_cxt *cxt, struct prs_hash_cxt *hc,
-                              int len) {
-    int i;
+static void find_matches(struct prs_comp_cxt *cxt, void *mf,
+                         struct prs_match *m) {
+    struct prs_hash_cxt *hc = (struct prs_hash_cxt *)mf;
+    uint8_t hash;
+    const uint8_t *cur = cxt->src + cxt->src_pos, *ent;
+    int mlen, dist, best, chain = cxt->max_chain;
+
+    m->len = m->near_len = 0;
+
+    /* We need at least two bytes to hash, and to make any sort of match. */
+    if(cxt->src_pos + 1 >= cxt->src_len)
+        return;
+
+    hash = HASH_STR(cur);
+    ent = hc->ENT(hash);
+
+    /* Walk the chain, keeping track of the longest match we've seen and the
+       longest one that a short copy can reach. */
+    while(ent) {
+        dist = (int)(cur - ent);
+
+        if(dist > MAX_WINDOW - 1 || !chain--)
+            break;
+
+        /* The only thing that matters is finding something longer than what
+           we've already got (within reach of a short copy, or at all once
+           we're out of reach), so don't bother with anything that doesn't
+           match at the byte that would make it longer. */
+        best = dist <= SHORT_WINDOW ? m->near_len : m->len;
+
+        if(best) {
+            if(cxt->src_pos + best >= cxt->src_len)
+                break;
+
+            if(ent[best] != cur[best]) {
+                ent = hc->PREV(ent);
+                continue;
+            }
+        }
+
+        mlen = match_length(cxt, ent);
+
+        if(mlen > m->len) {
+            m->len = mlen;
+            m->offset = -dist;
+        }
+
+        if(dist <= SHORT_WINDOW && mlen > m->near_len) {
+            m->near_len = mlen;
+            m->near_offset = -dist;
+        }
+
+        /* Nothing we find from here on out is worth looking for. */
+        if(m->len >= cxt->nice_len &&
+           (dist >= SHORT_WINDOW || m->near_len >= cxt->nice_len))
+            break;
+
+        ent = hc->PREV(ent);
+    }
+
+    ADD_TO_HASH(hc, cur, hash);
+}
+
+static void hc_insert(struct prs_comp_cxt *cxt, void *mf, size_t pos,
+                      int count) {
+    struct prs_hash_cxt *hc = (struct prs_hash_cxt *)mf;
     uint8_t hash;
 
-    for(i = 1; i < len; ++i) {
-        hash = HASH_STR(cxt->src + cxt->src_pos + i);
-        ADD_TO_HASH(hc, cxt->src + cxt->src_pos + i, hash);
+    for(; count > 0 && pos + 1 < cxt->src_len; --count, ++pos) {
+        hash = HASH_STR(cxt->src + pos);
+        ADD_TO_HASH(hc, cxt->src + pos, hash);
+    }
+}
+
+static void hc_slide(struct prs_comp_cxt *cxt, void *mf, size_t shift) {
+    struct prs_hash_cxt *hc = (struct prs_hash_cxt *)mf;
+    const uint8_t *edge = cxt->src + shift;
+    int i;
+
+    /* Since the shift is a multiple of the window size, everything stays in
+       the same slot of h_prev, it just points somewhere else now. Anything
+       that would end up before the start of the buffer is dropped. */
+    for(i = 0; i < HASH_SIZE; ++i) {
+        hc->hash[i] = hc->hash[i] >= edge ? hc->hash[i] - shift : NULL;
+    }
+
+    for(i = 0; i < MAX_WINDOW; ++i) {
+        hc->h_prev[i] = hc->h_prev[i] >= edge ? hc->h_prev[i] - shift : NULL;
+    }
+}
+
+static const struct prs_match_finder hc_finder = {
+    sizeof(struct prs_hash_cxt), &hc_init, &find_longest_match, &find_matches,
+    &hc_insert, &hc_slide
+};
+
+#else /* !PRS_HASH_CHAINS */
+
+/******************************************************************************
+    Binary tree match finder.
+
+    This match finder (which is pretty much the same idea as the one in LZMA)
+    keeps the strings in the window in a set of binary search trees, sorted by
+    the strings themselves. Every time we add a string, it becomes the new root
+    of its tree and we walk down the tree toward where the string would sort,
+    splitting the old tree into the left and right subtrees of the new root as
+    we go. The longest match for the string will always be somewhere along that
+    path, so we find it along the way.
+
+    Unlike the hash chains, the amount of work done for each string is bounded,
+    both by the length of match that's considered good enough and by a limit on
+    how many nodes of the tree we'll visit (both set by the compression level).
+    Positions in the trees are stored plus one, so that zero can mean "nothing
+    here".
+ ******************************************************************************/
+#define BT_HASH_SIZE    (1 << 12)
+#define BT_HASH(s)      ((((s)[0]) << 4) ^ ((s)[1]))
+
+struct prs_bt_cxt {
+    uint32_t head[BT_HASH_SIZE];
+    uint32_t son[MAX_WINDOW * 2];
+
+    size_t next;
+    size_t last_pos;
+    struct prs_match last;
+};
+
+static void bt_init(void *mf) {
+    struct prs_bt_cxt *bt = (struct prs_bt_cxt *)mf;
+
+    memset(bt, 0, sizeof(struct prs_bt_cxt));
+    bt->last_pos = SIZE_MAX;
+}
+
+static int extend_match(const uint8_t *cur, int offset, int len, int max) {
+    while(len < max && cur[len] == cur[len + offset])
+        ++len;
+
+    return len;
+}
+
+static void bt_find(struct prs_comp_cxt *cxt, struct prs_bt_cxt *bt,
+                    size_t pos, struct prs_match *m) {
+    const uint8_t *cur = cxt->src + pos, *pb;
+    uint32_t *ptr0, *ptr1, *pair, cur_match;
+    size_t avail = cxt->src_len - pos, mpos;
+    int len, len0 = 0, len1 = 0, depth = cxt->max_chain, dist, limit;
+    unsigned int h;
+
+    if(m)
+        m->len = m->near_len = 0;
+
+    /* We need at least two bytes to hash, and to make any sort of match. */
+    if(avail < 2)
+        return;
+
+    if(avail > MAX_MATCH)
+        avail = MAX_MATCH;
+
+    /* Don't look any further than we have to. */
+    limit = (int)avail < cxt->nice_len ? (int)avail : cxt->nice_len;
+
+    h = BT_HASH(cur);
+    cur_match = bt->head[h];
+    bt->head[h] = (uint32_t)(pos + 1);
+    bt->next = pos + 1;
+
+    ptr0 = &bt->son[((pos & WINDOW_MASK) << 1) + 1];
+    ptr1 = &bt->son[(pos & WINDOW_MASK) << 1];
+
+    for(;;) {
+        if(!cur_match || !depth--) {
+            *ptr0 = *ptr1 = 0;
+            break;
+        }
+
+        mpos = cur_match - 1;
+        dist = (int)(pos - mpos);
+
+        /* Anything past the edge of the window is useless to us. Chop it off
+           the tree. */
+        if(dist > MAX_WINDOW - 1) {
+            *ptr0 = *ptr1 = 0;
+            break;
+        }
+
+        pair = &bt->son[(mpos & WINDOW_MASK) << 1];
+        pb = cxt->src + mpos;
+
+        /* Everything in this part of the tree matches at least as much as the
+           shorter of the two sides we've come from, so start from there. */
+        len = len0 < len1 ? len0 : len1;
+
+        while(len < limit && pb[len] == cur[len])
+            ++len;
+
+        if(m) {
+            if(len > m->len) {
+                m->len = len;
+                m->offset = -dist;
+            }
+
+            if(dist <= SHORT_WINDOW && len > m->near_len) {
+                m->near_len = len;
+                m->near_offset = -dist;
+            }
+        }
+
+        /* If we matched everything we could, the new string takes over this
+           node's children and the node itself drops out of the tree. */
+        if(len == limit) {
+            *ptr1 = pair[0];
+            *ptr0 = pair[1];
+            break;
+        }
+
+        if(pb[len] < cur[len]) {
+            *ptr1 = cur_match;
+            ptr1 = pair + 1;
+            cur_match = *ptr1;
+            len1 = len;
+        }
+        else {
+            *ptr0 = cur_match;
+            ptr0 = pair;
+            cur_match = *ptr0;
+            len0 = len;
+        }
+    }
+
+    /* If we stopped because we found something that was good enough, see how
+       much further the match actually goes. */
+    if(m && limit < (int)avail) {
+        if(m->len == limit)
+            m->len = extend_match(cur, m->offset, limit, (int)avail);
+
+        if(m->near_len == limit)
+            m->near_len = extend_match(cur, m->near_offset, limit, (int)avail);
+    }
+}
+
+static void bt_matches(struct prs_comp_cxt *cxt, void *mf,
+                       struct prs_match *m) {
+    struct prs_bt_cxt *bt = (struct prs_bt_cxt *)mf;
+
+    /* Adding a string to the tree and searching for it are the same operation,
+       so if we've already seen this one (from a lazy lookahead), just give back
+       what we found then. */
+    if(cxt->src_pos == bt->last_pos) {
+        *m = bt->last;
+        return;
+    }
+
+    bt_find(cxt, bt, cxt->src_pos, m);
+    bt->last_pos = cxt->src_pos;
+    bt->last = *m;
+}
+
+static int bt_longest(struct prs_comp_cxt *cxt, void *mf, int *pos, int lazy) {
+    struct prs_match m;
+
+    (void)lazy;
+    bt_matches(cxt, mf, &m);
+
+    if(m.len)
+        *pos = m.offset;
+
+    return m.len;
+}
+
+static void bt_insert(struct prs_comp_cxt *cxt, void *mf, size_t pos,
+                      int count) {
+    struct prs_bt_cxt *bt = (struct prs_bt_cxt *)mf;
+
+    for(; count > 0; --count, ++pos) {
+        if(pos >= bt->next)
+            bt_find(cxt, bt, pos, NULL);
+    }
+}
+
+static void bt_slide(struct prs_comp_cxt *cxt, void *mf, size_t shift) {
+    struct prs_bt_cxt *bt = (struct prs_bt_cxt *)mf;
+    int i;
+
+    (void)cxt;
+
+    /* Positions are stored plus one, so anything at or below the shift is now
+       before the start of the buffer. Since the shift is a multiple of the
+       window size, the trees themselves don't need to move at all. */
+    for(i = 0; i < BT_HASH_SIZE; ++i) {
+        bt->head[i] = bt->head[i] > shift ? bt->head[i] - (uint32_t)shift : 0;
+    }
+
+    for(i = 0; i < MAX_WINDOW * 2; ++i) {
+        bt->son[i] = bt->son[i] > shift ? bt->son[i] - (uint32_t)shift : 0;
+    }
+
+    bt->next -= shift;
+
+    if(bt->last_pos != SIZE_MAX)
+        bt->last_pos -= shift;
+}
+
+static const struct prs_match_finder bt_finder = {
+    sizeof(struct prs_bt_cxt), &bt_init, &bt_longest, &bt_matches, &bt_insert,
+    &bt_slide
+};
+
+#endif /* PRS_HASH_CHAINS */
+
+/* The binary tree match finder is used by default. Define PRS_HASH_CHAINS when
+   building the library to go back to the old hash chains (which is really only
+   useful for comparing the two, since the hash chains are both slower and have
+   no bound on how much work they'll do for a single string). */
+#ifdef PRS_HASH_CHAINS
+#define DEFAULT_FINDER  hc_finder
+#else
+#define DEFAULT_FINDER  bt_finder
+#endif
+
+static int write_copy(struct prs_comp_cxt *cxt, int offset, int mlen) {
+    int rv;
+    uint8_t tmp;
+
+    if(mlen >= 2 && mlen <= 5 && offset >= -SHORT_WINDOW) {
+        /* Short match. */
+        if((rv = set_bit(cxt, 0)))
+            return rv;
+
+        if((rv = set_bit(cxt, 0)))
+            return rv;
+
+        if((rv = set_bit(cxt, (mlen - 2) & 0x02)))
+            return rv;
+
+        if((rv = set_bit(cxt, (mlen - 2) & 0x01)))
+            return rv;
+
+        return write_literal(cxt, offset & 0xFF);
+    }
+    else if(mlen >= 3 && mlen <= 9) {
+        /* Long match, short length. */
+        if((rv = set_bit(cxt, 0)))
+            return rv;
+
+        if((rv = set_bit(cxt, 1)))
+            return rv;
+
+        tmp = ((offset & 0x1f) << 3) | ((mlen - 2) & 0x07);
+        if((rv = write_literal(cxt, tmp)))
+            return rv;
+
+        tmp = offset >> 5;
+        return write_literal(cxt, tmp);
+    }
+    else if(mlen > 9 && mlen <= MAX_MATCH) {
+        /* Long match, long length. */
+        if((rv = set_bit(cxt, 0)))
+            return rv;
+
+        if((rv = set_bit(cxt, 1)))
+            return rv;
+
+        tmp = ((offset & 0x1f) << 3);
+        if((rv = write_literal(cxt, tmp)))
+            return rv;
+
+        tmp = offset >> 5;
+        if((rv = write_literal(cxt, tmp)))
+            return rv;
+
+        return write_literal(cxt, mlen - 1);
+    }
+
+    /* Anything else can't be represented in the output stream. */
+    return PSOARCHIVE_EINVAL;
+}
+
+/******************************************************************************
+    Optimal parsing.
+
+    The normal compressor greedily takes the longest match it can find (with a
+    single byte of lookahead to see if waiting a byte would be better). That's
+    fast, but it isn't necessarily the smallest output possible, since PRS has
+    several different ways of encoding a copy, each with their own cost:
+        Literal byte:                   9 bits
+        Short copy (2-5 bytes, 256B):  12 bits
+        Long copy (3-9 bytes):         18 bits
+        Long copy (10-256 bytes):      26 bits
+
+    The optimal parser instead looks at every match candidate at every position
+    in a block of input and finds the cheapest path through the block with a
+    bit of dynamic programming (basically a shortest path search). For each
+    position, we keep track of the longest match overall and the longest match
+    within the reach of a short copy, since any shorter copy of the same data
+    can be made from those same offsets.
+ ******************************************************************************/
+#define OPT_BLOCK           0x4000
+
+#define COST_LITERAL        9
+#define COST_SHORT_COPY     12
+#define COST_LONG_COPY      18
+#define COST_LONG_COPY2     26
+
+struct prs_opt_node {
+    uint32_t cost;
+    uint16_t len;
+    int16_t offset;
+};
+
+static int optimal_block(struct prs_comp_cxt *cxt,
+                         const struct prs_match_finder *finder, void *mf,
+                         struct prs_opt_node *nodes, size_t end) {
+    size_t start = cxt->src_pos, n = end - start, i, j;
+    struct prs_match m;
+    uint32_t cost;
+    int len, offset, rv;
+
+    nodes[0].cost = 0;
+    for(i = 1; i <= n; ++i)
+        nodes[i].cost = UINT32_MAX;
+
+    /* Figure out the cheapest way to get to each position in the block. */
+    for(i = 0; i < n; ++i) {
+        cxt->src_pos = start + i;
+        finder->matches(cxt, mf, &m);
+
+        /* We can always get to the next byte with a literal. */
+        if(nodes[i].cost + COST_LITERAL < nodes[i + 1].cost) {
+            nodes[i + 1].cost = nodes[i].cost + COST_LITERAL;
+            nodes[i + 1].len = 1;
+        }
+
+        /* Don't let matches run off the end of the block. */
+        if(m.len > (int)(n - i))
+            m.len = (int)(n - i);
+
+        for(len = 2; len <= m.len; ++len) {
+            if(len <= 5 && len <= m.near_len) {
+                cost = COST_SHORT_COPY;
+                offset = m.near_offset;
+            }
+            else if(len == 2) {
+                /* Two literals beat a long copy of two bytes. */
+                continue;
+            }
+            else {
+                cost = len <= 9 ? COST_LONG_COPY : COST_LONG_COPY2;
+                offset = m.offset;
+            }
+
+            cost += nodes[i].cost;
+
+            if(cost < nodes[i + len].cost) {
+                nodes[i + len].cost = cost;
+                nodes[i + len].len = (uint16_t)len;
+                nodes[i + len].offset = (int16_t)offset;
+            }
+        }
+    }
+
+    /* Walk back from the end of the block, linking each node on the cheapest
+       path to the one after it (reusing the cost field, since we're done with
+       it at this point). */
+    for(j = n; j; j = i) {
+        i = j - nodes[j].len;
+        nodes[i].cost = (uint32_t)j;
+    }
+
+    /* Now, spit out everything along the path. */
+    cxt->src_pos = start;
+
+    for(i = 0; i < n; i = j) {
+        j = nodes[i].cost;
+        len = nodes[j].len;
+
+        if(len == 1) {
+            if((rv = set_bit(cxt, 1)))
+                return rv;
+
+            if((rv = copy_literal(cxt)))
+                return rv;
+        }
+        else {
+            if((rv = write_copy(cxt, nodes[j].offset, len)))
+                return rv;
+
+            cxt->src_pos += len;
+        }
+    }
+
+    return PSOARCHIVE_OK;
+}
+
+static int optimal_parse(struct prs_comp_cxt *cxt,
+                         const struct prs_match_finder *finder, void *mf,
+                         struct prs_opt_node *nodes, size_t end) {
+    size_t block_end;
+    int rv;
+
+    while(cxt->src_pos < end) {
+        block_end = cxt->src_pos + OPT_BLOCK;
+        if(block_end > end)
+            block_end = end;
+
+        if((rv = optimal_block(cxt, finder, mf, nodes, block_end)))
+            return rv;
+    }
+
+    return PSOARCHIVE_OK;
+}
+
+static int greedy_parse(struct prs_comp_cxt *cxt,
+                        const struct prs_match_finder *finder, void *mf,
+                        size_t end) {
+    int rv, mlen, mlen2;
+    int offset, offset2;
+
+    if(!cxt->src_pos) {
+        /* Add the first two "strings" to the window. */
+        finder->insert(cxt, mf, 0, 2);
+
+        /* Copy the first two bytes as literals... */
+        if((rv = set_bit(cxt, 1)))
+            return rv;
+
+        if((rv = copy_literal(cxt)))
+            return rv;
+
+        if((rv = set_bit(cxt, 1)))
+            return rv;
+
+        if((rv = copy_literal(cxt)))
+            return rv;
+    }
+
+    /* Process each byte, up until the end of what we've been asked to do. Note
+       that the last match might go past that point. That's fine, so long as
+       there is data there, of course. */
+    while(cxt->src_pos < end) {
+        /* Is there a match? */
+        if((mlen = finder->longest(cxt, mf, &offset, 0))) {
+            /* If we're allowed to, see if waiting a byte gets us a better
+               match. */
+            if(cxt->lazy) {
+                cxt->src_pos++;
+                mlen2 = finder->longest(cxt, mf, &offset2, 1);
+                cxt->src_pos--;
+
+                /* Did the "lazy match" produce something more compressed? */
+                if(mlen2 > mlen) {
+                    /* Check if it is a good idea to switch from a short match
+                       to a long one, if we would do that. */
+                    if(mlen >= 2 && mlen <= 5 && offset2 < offset) {
+                        if(offset >= -256 && offset2 < -256) {
+                            if(mlen2 - mlen < 3) {
+                                goto blergh;
+                            }
+                        }
+                    }
+
+                    if((rv = set_bit(cxt, 1)))
+                        return rv;
+
+                    if((rv = copy_literal(cxt)))
+                        return rv;
+
+                    continue;
+                }
+            }
+
+blergh:
+            /* Can we actually encode the match we found? */
+            if(mlen >= 3 || (mlen == 2 && offset >= -SHORT_WINDOW)) {
+                if((rv = write_copy(cxt, offset, mlen)))
+                    return rv;
+
+                finder->insert(cxt, mf, cxt->src_pos + 1, mlen - 1);
+                cxt->src_pos += mlen;
+                continue;
+            }
+        }
+
+        /* If we get here, we didn't find a suitable match, so just write the
+           byte as a literal in the output. */
+        if((rv = set_bit(cxt, 1)))
+            return rv;
+
+        /* Copy the byte over. */
+        if((rv = copy_literal(cxt)))
+            return rv;
     }
+
+    return PSOARCHIVE_OK;
 }
 
 /******************************************************************************
@@ -291,13 +937,13 @@ int pso_prs_archive(const uint8_t *src, uint8_t **dst, size_t src_len) {
     uint8_t *db;
 
     /* Allocate our "compressed" buffer. */
-    if(!(db = (uint8_t *)malloc(dl)))
+    if(!(db = (uint8_t *)pso_malloc(dl)))
         return PSOARCHIVE_EMEM;
 
     /* Call on the function for archiving into a preallocated buffer to do the
        real work. */
     if((rv = pso_prs_archive2(src, db, src_len, dl)) < 0) {
-        free(db);
+        pso_free(db);
         return rv;
     }
 
@@ -355,197 +1001,789 @@ int pso_prs_archive2(const uint8_t *src, uint8_t *dst, size_t src_len,
     function, and will usually produce output that is significantly smaller.
  ******************************************************************************/
 int pso_prs_compress(const uint8_t *src, uint8_t **dst, size_t src_len) {
-    struct prs_comp_cxt cxt;
-    struct prs_hash_cxt *hcxt;
-    int rv, mlen, mlen2;
-    uint8_t tmp;
-    int offset, offset2;
+    return pso_prs_compress_ex(src, dst, src_len, PSO_PRS_LEVEL_DEFAULT);
+}
 
-    /* Check the input to make sure we've got valid source/destination pointers
-       and something to do. */
-    if(!src || !dst)
-        return PSOARCHIVE_EFAULT;
+/******************************************************************************
+    Compression levels.
+
+    Much like zlib, each compression level trades off speed for compression
+    ratio by limiting how hard the match finder looks for matches. The values
+    for each level are as follows:
+        max_chain: The maximum number of strings in the window to look at for
+                   each match (hash chain entries or binary tree nodes).
+        nice_len:  Stop looking for anything better once we've found a match
+                   at least this long.
+        lazy:      Check if waiting a byte would get us a longer match before
+                   taking the match we found.
+
+    Level 0 doesn't compress at all (it's the same as pso_prs_archive), and
+    level 9 uses the optimal parser. The default level is level 8, which is the
+    default greedy/lazy parse that pso_prs_compress uses. Its output is not
+    byte-for-byte what pso_prs_compress made before the binary tree match
+    finder went in, since that doesn't always pick the same matches.
+ ******************************************************************************/
+struct prs_level {
+    int max_chain;
+    int nice_len;
+    int lazy;
+};
 
-    if(!src_len)
-        return PSOARCHIVE_EINVAL;
+static const struct prs_level levels[10] = {
+    {    0,   0, 0 },        /* 0: No compression */
+    {    4,   8, 0 },        /* 1: Fastest */
+    {    8,  16, 0 },
+    {   16,  32, 0 },
+    {   16,  32, 1 },
+    {   32,  64, 1 },
+    {   64, 128, 1 },
+    {  128, 256, 1 },
+    {  256, 256, 1 },        /* 8: Default */
+    { 1024, 256, 1 }         /* 9: Optimal */
+};
 
-    /* Meh. Don't feel like dealing with it here, since it's not compressible
-       at all anyway. */
-    if(src_len <= 3)
-        return pso_prs_archive(src, dst, src_len);
+#define DEFAULT_LEVEL   8
 
-    /* Allocate the hash context. */
-    if(!(hcxt = (struct prs_hash_cxt *)malloc(sizeof(struct prs_hash_cxt))))
-        return PSOARCHIVE_EMEM;
+/******************************************************************************
+    Reusable compression contexts.
+
+    Compressing anything needs the match finder's tables (and for the optimal
+    level, the parser's nodes), which are a good bit bigger than most of what
+    we ever compress. A compressor holds onto those between calls, so that
+    compressing a bunch of small things doesn't mean allocating and freeing
+    them every single time. The one-shot functions just set up a compressor,
+    use it once, and throw it away.
+ ******************************************************************************/
+struct pso_prs_compressor {
+    const struct prs_match_finder *finder;
+    void *mf;
+    struct prs_opt_node *nodes;
+    int level;
+};
+
+/* How much input to compress between calls to the emit function. This needs to
+   be a multiple of OPT_BLOCK so that the optimal parser's blocks line up the
+   same way no matter what. */
+#define EMIT_BLOCK      OPT_BLOCK
+
+pso_prs_compressor_t *pso_prs_compressor_init(int level, pso_error_t *err) {
+    pso_prs_compressor_t *rv;
+    pso_error_t erv = PSOARCHIVE_EMEM;
+
+    if(level < PSO_PRS_LEVEL_DEFAULT || level > PSO_PRS_LEVEL_OPTIMAL) {
+        erv = PSOARCHIVE_EINVAL;
+        goto ret_err;
+    }
+
+    if(level == PSO_PRS_LEVEL_DEFAULT)
+        level = DEFAULT_LEVEL;
+
+    if(!(rv = (pso_prs_compressor_t *)pso_malloc(sizeof(pso_prs_compressor_t))))
+        goto ret_err;
+
+    memset(rv, 0, sizeof(pso_prs_compressor_t));
+    rv->finder = &DEFAULT_FINDER;
+    rv->level = level;
+
+    if(level != PSO_PRS_LEVEL_NONE && !(rv->mf = pso_malloc(rv->finder->size)))
+        goto ret_cxt;
+
+    if(level == PSO_PRS_LEVEL_OPTIMAL) {
+        rv->nodes = (struct prs_opt_node *)
+            pso_malloc(sizeof(struct prs_opt_node) * (OPT_BLOCK + 1));
+
+        if(!rv->nodes)
+            goto ret_cxt;
+    }
+
+    if(err)
+        *err = PSOARCHIVE_OK;
+
+    return rv;
+
+ret_cxt:
+    pso_free(rv->mf);
+    pso_free(rv);
+ret_err:
+    if(err)
+        *err = erv;
+
+    return NULL;
+}
+
+pso_error_t pso_prs_compressor_end(pso_prs_compressor_t *c) {
+    if(!c)
+        return PSOARCHIVE_EFAULT;
+
+    pso_free(c->nodes);
+    pso_free(c->mf);
+    pso_free(c);
+
+    return PSOARCHIVE_OK;
+}
+
+static int run_compressor(pso_prs_compressor_t *c, const uint8_t *src,
+                          uint8_t *dst, size_t src_len, size_t dst_len,
+                          prs_emit_t emit, void *udata) {
+    struct prs_comp_cxt cxt;
+    size_t end;
+    int rv;
+
+    /* Meh. Don't feel like dealing with it here, since it's not compressible
+       at all anyway. */
+    if(src_len <= 3 || c->level == PSO_PRS_LEVEL_NONE) {
+        if((rv = pso_prs_archive2(src, dst, src_len, dst_len)) < 0)
+            return rv;
+
+        if(emit)
+            emit(dst, (size_t)rv, udata);
+
+        return rv;
+    }
 
     /* Clear the contexts and fill in what we need to do our job. */
     memset(&cxt, 0, sizeof(cxt));
-    memset(hcxt, 0, sizeof(struct prs_hash_cxt));
+    c->finder->init(c->mf);
     cxt.src = src;
     cxt.src_len = src_len;
-    cxt.dst_len = pso_prs_max_compressed_size(src_len);
+    cxt.dst = dst;
+    cxt.dst_len = dst_len;
+    cxt.flag_ptr = cxt.dst;
+    cxt.max_chain = levels[c->level].max_chain;
+    cxt.nice_len = levels[c->level].nice_len;
+    cxt.lazy = levels[c->level].lazy;
+
+    /* Compress the data a block at a time. After each block, everything before
+       the current flag byte is done, so let the caller have at it. */
+    while(cxt.src_pos < src_len) {
+        end = cxt.src_pos + EMIT_BLOCK;
+        if(end > src_len)
+            end = src_len;
+
+        if(c->nodes)
+            rv = optimal_parse(&cxt, c->finder, c->mf, c->nodes, end);
+        else
+            rv = greedy_parse(&cxt, c->finder, c->mf, end);
+
+        if(rv)
+            return rv;
+
+        if(emit)
+            emit(dst, (size_t)(cxt.flag_ptr - dst), udata);
+    }
+
+    if((rv = write_eof(&cxt)))
+        return rv;
+
+    if(emit)
+        emit(dst, cxt.dst_pos, udata);
+
+    return (int)cxt.dst_pos;
+}
+
+int pso_prs_compress_into(pso_prs_compressor_t *c, int level,
+                          const uint8_t *src, uint8_t *dst, size_t src_len,
+                          size_t dst_len, prs_emit_t emit, void *udata) {
+    pso_error_t err;
+    int rv;
+
+    if(c)
+        return run_compressor(c, src, dst, src_len, dst_len, emit, udata);
+
+    if(!(c = pso_prs_compressor_init(level, &err)))
+        return err;
+
+    rv = run_compressor(c, src, dst, src_len, dst_len, emit, udata);
+    pso_prs_compressor_end(c);
+
+    return rv;
+}
+
+int pso_prs_compressor_compress(pso_prs_compressor_t *c, const uint8_t *src,
+                                uint8_t *dst, size_t src_len,
+                                size_t dst_len) {
+    if(!c || !src || !dst)
+        return PSOARCHIVE_EFAULT;
+
+    if(!src_len)
+        return PSOARCHIVE_EINVAL;
+
+    return run_compressor(c, src, dst, src_len, dst_len, NULL, NULL);
+}
+
+int pso_prs_compress2(const uint8_t *src, uint8_t *dst, size_t src_len,
+                      size_t dst_len) {
+    if(!src || !dst)
+        return PSOARCHIVE_EFAULT;
+
+    if(!src_len)
+        return PSOARCHIVE_EINVAL;
+
+    return pso_prs_compress_into(NULL, PSO_PRS_LEVEL_DEFAULT, src, dst,
+                                 src_len, dst_len, NULL, NULL);
+}
+
+int pso_prs_compress_ex(const uint8_t *src, uint8_t **dst, size_t src_len,
+                        int level) {
+    size_t dl;
+    uint8_t *db, *tmp;
+    int rv;
+
+    /* Check the input to make sure we've got valid source/destination pointers
+       and something to do. */
+    if(!src || !dst)
+        return PSOARCHIVE_EFAULT;
+
+    if(!src_len)
+        return PSOARCHIVE_EINVAL;
+
+    if(level < PSO_PRS_LEVEL_DEFAULT || level > PSO_PRS_LEVEL_OPTIMAL)
+        return PSOARCHIVE_EINVAL;
 
     /* Allocate our "compressed" buffer. */
-    if(!(cxt.dst = (uint8_t *)malloc(cxt.dst_len))) {
-        free(hcxt);
+    dl = pso_prs_max_compressed_size(src_len);
+    if(!(db = (uint8_t *)pso_malloc(dl)))
         return PSOARCHIVE_EMEM;
+
+    if((rv = pso_prs_compress_into(NULL, level, src, db, src_len, dl, NULL,
+                                   NULL)) < 0) {
+        pso_free(db);
+        return rv;
     }
 
-    cxt.flag_ptr = cxt.dst;
+    /* Resize the output (if realloc fails to resize it, then just use the
+       unshortened buffer). */
+    if((tmp = (uint8_t *)pso_realloc(db, rv)))
+        db = tmp;
 
-    /* Add the first two "strings" to the hash table. */
-    INIT_ADD_HASH(hcxt, src, tmp);
-    INIT_ADD_HASH(hcxt, src + 1, tmp);
+    *dst = db;
+    return rv;
+}
 
-    /* Copy the first two bytes as literals... */
-    if((rv = set_bit(&cxt, 1)))
-        goto out;
+/******************************************************************************
+    Parallel PRS Compression
+
+    PRS doesn't have any sort of blocks in it, but there's nothing stopping us
+    from splitting the input up into big segments and compressing each of them
+    separately, so long as each segment's match finder is primed with the 8KiB
+    of input just before it (so that matches can still reach back across the
+    edge) and no match runs past the end of a segment. Each segment ends up as
+    a run of complete tokens, which can be stitched together into one stream.
+
+    The catch is that the flag bits for each token are packed into flag bytes
+    scattered through the output, so the segments can't simply be pasted one
+    after another. Instead, each one gets walked a token at a time and
+    re-packed into the final output, which is quick since it doesn't have to
+    find any matches.
+ ******************************************************************************/
 
-    if((rv = copy_literal(&cxt)))
-        goto out;
+/* Don't bother splitting things up into anything smaller than this. */
+#define MT_MIN_SEGMENT  0x40000
 
-    if((rv = set_bit(&cxt, 1)))
-        goto out;
+struct mt_segment {
+    size_t start;
+    size_t end;
+    uint8_t *buf;
+    size_t len;
+    int rv;
+};
 
-    if((rv = copy_literal(&cxt)))
-        goto out;
+struct mt_job {
+    const uint8_t *src;
+    int level;
+    struct mt_segment *segs;
+};
 
-    /* Process each byte. */
-    while(cxt.src_pos < cxt.src_len - 1) {
-        /* Is there a match? */
-        if((mlen = find_longest_match(&cxt, hcxt, &offset, 0))) {
-            cxt.src_pos++;
-            mlen2 = find_longest_match(&cxt, hcxt, &offset2, 1);
-            cxt.src_pos--;
-
-            /* Did the "lazy match" produce something more compressed? */
-            if(mlen2 > mlen) {
-                /* Check if it is a good idea to switch from a short match to a
-                   long one, if we would do that. */
-                if(mlen >= 2 && mlen <= 5 && offset2 < offset) {
-                    if(offset >= -256 && offset2 < -256) {
-                        if(mlen2 - mlen < 3) {
-                            goto blergh;
-                        }
-                    }
-                }
+static int compress_segment(pso_prs_compressor_t *c, const uint8_t *src,
+                            struct mt_segment *seg) {
+    struct prs_comp_cxt cxt;
+    size_t prime;
+    int rv;
 
-                if((rv = set_bit(&cxt, 1)))
-                    goto out;
+    seg->len = pso_prs_max_compressed_size(seg->end - seg->start);
+    if(!(seg->buf = (uint8_t *)pso_malloc(seg->len)))
+        return PSOARCHIVE_EMEM;
 
-                if((rv = copy_literal(&cxt)))
-                    goto out;
+    /* Cutting off the input at the end of the segment keeps any matches from
+       going past it. */
+    memset(&cxt, 0, sizeof(cxt));
+    c->finder->init(c->mf);
+    cxt.src = src;
+    cxt.src_len = seg->end;
+    cxt.src_pos = seg->start;
+    cxt.dst = seg->buf;
+    cxt.dst_len = seg->len;
+    cxt.flag_ptr = cxt.dst;
+    cxt.max_chain = levels[c->level].max_chain;
+    cxt.nice_len = levels[c->level].nice_len;
+    cxt.lazy = levels[c->level].lazy;
 
-                continue;
-            }
+    /* Put the window before the segment into the match finder. */
+    prime = seg->start < MAX_WINDOW ? seg->start : MAX_WINDOW;
+    if(prime)
+        c->finder->insert(&cxt, c->mf, seg->start - prime, (int)prime);
 
-blergh:
-            /* What kind of match did we find? */
-            if(mlen >= 2 && mlen <= 5 && offset >= -256) {
-                /* Short match. */
-                if((rv = set_bit(&cxt, 0)))
-                    goto out;
+    if(c->nodes)
+        rv = optimal_parse(&cxt, c->finder, c->mf, c->nodes, seg->end);
+    else
+        rv = greedy_parse(&cxt, c->finder, c->mf, seg->end);
 
-                if((rv = set_bit(&cxt, 0)))
-                    goto out;
+    if(rv)
+        return rv;
 
-                if((rv = set_bit(&cxt, (mlen - 2) & 0x02)))
-                    goto out;
+    write_final_flags(&cxt);
+    seg->len = cxt.dst_pos;
 
-                if((rv = set_bit(&cxt, (mlen - 2) & 0x01)))
-                    goto out;
+    return PSOARCHIVE_OK;
+}
 
-                if((rv = write_literal(&cxt, offset & 0xFF)))
-                    goto out;
+static int mt_task(void *udata, size_t idx) {
+    struct mt_job *job = (struct mt_job *)udata;
+    pso_prs_compressor_t *c;
+    pso_error_t err;
 
-                add_intermediates(&cxt, hcxt, mlen);
-                cxt.src_pos += mlen;
-                continue;
-            }
-            else if(mlen >= 3 && mlen <= 9) {
-                /* Long match, short length. */
-                if((rv = set_bit(&cxt, 0)))
-                    goto out;
+    if(!(c = pso_prs_compressor_init(job->level, &err)))
+        return (job->segs[idx].rv = err);
+
+    job->segs[idx].rv = compress_segment(c, job->src, &job->segs[idx]);
+    pso_prs_compressor_end(c);
 
-                if((rv = set_bit(&cxt, 1)))
-                    goto out;
+    return job->segs[idx].rv;
+}
 
-                tmp = ((offset & 0x1f) << 3) | ((mlen - 2) & 0x07);
-                if((rv = write_literal(&cxt, tmp)))
-                    goto out;
+/* Grab the next flag bit from a segment, reading in a new flag byte if we've
+   run out. */
+#define SEG_FLAG(b) do { \
+        if(!bits) { \
+            if(sp >= len) \
+                return PSOARCHIVE_EFATAL; \
+            flags = seg[sp++]; \
+            bits = 8; \
+        } \
+        b = flags & 1; \
+        flags >>= 1; \
+        --bits; \
+    } while(0)
+
+static int append_segment(struct prs_comp_cxt *cxt, const uint8_t *seg,
+                          size_t len) {
+    size_t sp = 0, n;
+    unsigned int flags = 0, bits = 0, b1, b2;
+    int rv;
 
-                tmp = offset >> 5;
-                if((rv = write_literal(&cxt, tmp)))
-                    goto out;
+    /* Every token has at least one byte after its flag bits, so the segment
+       always ends with the last byte of its last token. */
+    while(sp < len) {
+        SEG_FLAG(b1);
 
-                add_intermediates(&cxt, hcxt, mlen);
-                cxt.src_pos += mlen;
-                continue;
-            }
-            else if(mlen > 9) {
-                /* Long match, long length. */
-                if(mlen > 256)
-                    mlen = 256;
+        if(b1) {
+            /* Literal byte. */
+            if((rv = set_bit(cxt, 1)))
+                return rv;
 
-                if((rv = set_bit(&cxt, 0)))
-                    goto out;
+            n = 1;
+        }
+        else {
+            SEG_FLAG(b1);
 
-                if((rv = set_bit(&cxt, 1)))
-                    goto out;
+            if((rv = set_bit(cxt, 0)) || (rv = set_bit(cxt, b1)))
+                return rv;
 
-                tmp = ((offset & 0x1f) << 3);
-                if((rv = write_literal(&cxt, tmp)))
-                    goto out;
+            if(b1) {
+                /* Long copy, with a size byte if the size bits are zero. */
+                if(sp >= len)
+                    return PSOARCHIVE_EFATAL;
 
-                tmp = offset >> 5;
-                if((rv = write_literal(&cxt, tmp)))
-                    goto out;
+                n = (seg[sp] & 0x07) ? 2 : 3;
+            }
+            else {
+                /* Short copy. */
+                SEG_FLAG(b1);
+                SEG_FLAG(b2);
 
-                if((rv = write_literal(&cxt, mlen - 1)))
-                    goto out;
+                if((rv = set_bit(cxt, b1)) || (rv = set_bit(cxt, b2)))
+                    return rv;
 
-                add_intermediates(&cxt, hcxt, mlen);
-                cxt.src_pos += mlen;
-                continue;
+                n = 1;
             }
         }
 
-        /* If we get here, we didn't find a suitable match, so just write the
-           byte as a literal in the output. */
-        if((rv = set_bit(&cxt, 1)))
-            goto out;
+        if(sp + n > len)
+            return PSOARCHIVE_EFATAL;
 
-        /* Copy the byte over. */
-        if((rv = copy_literal(&cxt)))
-            goto out;
+        while(n--) {
+            if((rv = write_literal(cxt, seg[sp++])))
+                return rv;
+        }
     }
 
-    /* If we still have a left over byte at the end, put it in as a literal. */
-    if(cxt.src_pos < cxt.src_len) {
-        /* Set the bit in the flag since we're just putting a literal in the
-           output. */
-        if((rv = set_bit(&cxt, 1)))
-            goto out;
+    return PSOARCHIVE_OK;
+}
 
-        /* Copy the byte over. */
-        if((rv = copy_literal(&cxt)))
-            goto out;
+#undef SEG_FLAG
+
+int pso_prs_compress_mt(const uint8_t *src, uint8_t **dst, size_t src_len,
+                        int level, int threads) {
+    struct prs_comp_cxt cxt;
+    struct mt_segment *segs;
+    struct mt_job job;
+    size_t nsegs, seg_len, i;
+    uint8_t *tmp;
+    int rv = PSOARCHIVE_OK;
+
+    if(!src || !dst)
+        return PSOARCHIVE_EFAULT;
+
+    if(!src_len)
+        return PSOARCHIVE_EINVAL;
+
+    if(level < PSO_PRS_LEVEL_DEFAULT || level > PSO_PRS_LEVEL_OPTIMAL)
+        return PSOARCHIVE_EINVAL;
+
+    if(level == PSO_PRS_LEVEL_DEFAULT)
+        level = DEFAULT_LEVEL;
+
+    if(threads <= 0)
+        threads = pso_default_threads();
+
+    /* Split the input into a couple of segments per thread (so one slow segment
+       doesn't hold everything else up too much), so long as they're not too
+       small. The optimal parser's segments are kept to whole blocks, so that
+       the result is the same as if it weren't split up within each segment. */
+    nsegs = (size_t)threads * 2;
+    seg_len = (src_len + nsegs - 1) / nsegs;
+
+    if(seg_len < MT_MIN_SEGMENT)
+        seg_len = MT_MIN_SEGMENT;
+
+    seg_len = (seg_len + OPT_BLOCK - 1) & ~((size_t)OPT_BLOCK - 1);
+    nsegs = (src_len + seg_len - 1) / seg_len;
+
+    /* If there's no point in splitting it up, don't. */
+    if(threads == 1 || nsegs <= 1 || level == PSO_PRS_LEVEL_NONE)
+        return pso_prs_compress_ex(src, dst, src_len, level);
+
+    if(!(segs = (struct mt_segment *)
+         pso_malloc(sizeof(struct mt_segment) * nsegs)))
+        return PSOARCHIVE_EMEM;
+
+    for(i = 0; i < nsegs; ++i) {
+        segs[i].start = i * seg_len;
+        segs[i].end = i == nsegs - 1 ? src_len : (i + 1) * seg_len;
+        segs[i].buf = NULL;
+        segs[i].len = 0;
+        segs[i].rv = PSOARCHIVE_OK;
     }
 
-    if((rv = write_eof(&cxt)))
+    job.src = src;
+    job.level = level;
+    job.segs = segs;
+    if((rv = pso_run_parallel(nsegs, threads, &mt_task, &job)))
+        goto out;
+
+    /* Stitch everything together into the final output. */
+    memset(&cxt, 0, sizeof(cxt));
+    cxt.dst_len = pso_prs_max_compressed_size(src_len);
+
+    if(!(cxt.dst = (uint8_t *)pso_malloc(cxt.dst_len))) {
+        rv = PSOARCHIVE_EMEM;
         goto out;
+    }
 
-    free(hcxt);
+    cxt.flag_ptr = cxt.dst;
+
+    for(i = 0; i < nsegs && !rv; ++i) {
+        rv = append_segment(&cxt, segs[i].buf, segs[i].len);
+    }
+
+    if(!rv)
+        rv = write_eof(&cxt);
+
+    if(rv) {
+        pso_free(cxt.dst);
+        goto out;
+    }
 
     /* Resize the output (if realloc fails to resize it, then just use the
        unshortened buffer). */
-    if(!(*dst = realloc(cxt.dst, cxt.dst_pos)))
-        *dst = cxt.dst;
+    if((tmp = (uint8_t *)pso_realloc(cxt.dst, cxt.dst_pos)))
+        cxt.dst = tmp;
 
-    return (int)cxt.dst_pos;
+    *dst = cxt.dst;
+    rv = (int)cxt.dst_pos;
 
 out:
-    free(cxt.dst);
-    free(hcxt);
+    for(i = 0; i < nsegs; ++i) {
+        pso_free(segs[i].buf);
+    }
+
+    pso_free(segs);
     return rv;
 }
+
+/******************************************************************************
+    Streaming PRS Compression
+
+    The streaming compressor takes its input a piece at a time and hands the
+    compressed output off to a sink function as it goes, so that the whole of
+    neither the input nor the output ever needs to be in memory at once.
+
+    Input is collected in a fixed-size buffer. Once the buffer fills up, we
+    compress everything in it except for a bit of lookahead at the end (so that
+    the match finder always has a full match length of data to look at), and
+    then slide the data toward the front of the buffer, keeping the last 8KiB
+    (or a bit more) of it around as the window. The slide is always by a
+    multiple of the window size, which keeps the match finders' bookkeeping
+    simple. Output is held onto until its flag byte is complete, then passed
+    along to the sink.
+ ******************************************************************************/
+#define STREAM_BUF_SIZE     (MAX_WINDOW * 5)
+#define STREAM_LOOKAHEAD    (MAX_MATCH * 2)
+
+/* Output that's been written but not flushed yet (a flag byte and whatever's
+   after it) has to fit in front of whatever we compress next. */
+#define STREAM_DST_SLACK    32
+
+struct pso_prs_cstream {
+    struct prs_comp_cxt cxt;
+    const struct prs_match_finder *finder;
+    void *mf;
+    struct prs_opt_node *nodes;
+    uint8_t *buf;
+
+    int level;
+    int finished;
+    pso_error_t err;
+
+    pso_prs_sink_t sink;
+    void *udata;
+    size_t total;
+};
+
+static int cstream_flush(pso_prs_cstream_t *s, int final) {
+    struct prs_comp_cxt *cxt = &s->cxt;
+    size_t len;
+    int rv;
+
+    /* Everything before the current flag byte is done. Once the end of the
+       stream has been written, the flag byte is done too. */
+    len = final ? cxt->dst_pos : (size_t)(cxt->flag_ptr - cxt->dst);
+
+    if(len) {
+        if((rv = s->sink(cxt->dst, len, s->udata)) < 0)
+            return rv;
+
+        s->total += len;
+    }
+
+    memmove(cxt->dst, cxt->dst + len, cxt->dst_pos - len);
+    cxt->dst_pos -= len;
+    cxt->flag_ptr -= len;
+
+    return PSOARCHIVE_OK;
+}
+
+static int cstream_compress(pso_prs_cstream_t *s, int final) {
+    struct prs_comp_cxt *cxt = &s->cxt;
+    size_t end;
+    int rv;
+
+    /* Figure out how far we can go. Unless this is the end of the input, we
+       have to leave enough room for the match finder to look ahead of any
+       string that will be put into the window. */
+    if(final)
+        end = cxt->src_len;
+    else if(cxt->src_len > STREAM_LOOKAHEAD)
+        end = cxt->src_len - STREAM_LOOKAHEAD;
+    else
+        return PSOARCHIVE_OK;
+
+    /* Same as pso_prs_compress_ex, don't bother compressing really tiny
+       inputs. We'll only see those at the start of the stream. */
+    if(s->level == PSO_PRS_LEVEL_NONE || (final && cxt->src_len <= 3)) {
+        while(cxt->src_pos < end) {
+            if((rv = set_bit(cxt, 1)))
+                return rv;
+
+            if((rv = copy_literal(cxt)))
+                return rv;
+        }
+    }
+    else if(s->level == PSO_PRS_LEVEL_OPTIMAL) {
+        /* Only do full blocks until we hit the end of the input. */
+        if(!final && cxt->src_pos < end)
+            end -= (end - cxt->src_pos) % OPT_BLOCK;
+
+        if((rv = optimal_parse(cxt, s->finder, s->mf, s->nodes, end)))
+            return rv;
+    }
+    else if(cxt->src_pos < end) {
+        if((rv = greedy_parse(cxt, s->finder, s->mf, end)))
+            return rv;
+    }
+
+    if(final && (rv = write_eof(cxt)))
+        return rv;
+
+    return cstream_flush(s, final);
+}
+
+static void cstream_slide(pso_prs_cstream_t *s) {
+    struct prs_comp_cxt *cxt = &s->cxt;
+    size_t shift;
+
+    /* Keep at least a full window's worth of data before where we are. */
+    if(cxt->src_pos <= MAX_WINDOW)
+        return;
+
+    shift = (cxt->src_pos - MAX_WINDOW) & ~((size_t)WINDOW_MASK);
+
+    if(!shift)
+        return;
+
+    s->finder->slide(cxt, s->mf, shift);
+    memmove(s->buf, s->buf + shift, cxt->src_len - shift);
+    cxt->src_len -= shift;
+    cxt->src_pos -= shift;
+}
+
+pso_prs_cstream_t *pso_prs_cstream_init(int level, pso_prs_sink_t sink,
+                                        void *udata, pso_error_t *err) {
+    pso_prs_cstream_t *rv;
+    pso_error_t erv = PSOARCHIVE_EMEM;
+
+    if(!sink) {
+        erv = PSOARCHIVE_EFAULT;
+        goto ret_err;
+    }
+
+    if(level < PSO_PRS_LEVEL_DEFAULT || level > PSO_PRS_LEVEL_OPTIMAL) {
+        erv = PSOARCHIVE_EINVAL;
+        goto ret_err;
+    }
+
+    if(level == PSO_PRS_LEVEL_DEFAULT)
+        level = DEFAULT_LEVEL;
+
+    if(!(rv = (pso_prs_cstream_t *)pso_malloc(sizeof(pso_prs_cstream_t))))
+        goto ret_err;
+
+    memset(rv, 0, sizeof(pso_prs_cstream_t));
+    rv->finder = &DEFAULT_FINDER;
+    rv->level = level;
+    rv->sink = sink;
+    rv->udata = udata;
+
+    if(!(rv->buf = (uint8_t *)pso_malloc(STREAM_BUF_SIZE)))
+        goto ret_stream;
+
+    if(!(rv->mf = pso_malloc(rv->finder->size)))
+        goto ret_stream;
+
+    rv->cxt.dst_len = pso_prs_max_compressed_size(STREAM_BUF_SIZE) +
+        STREAM_DST_SLACK;
+
+    if(!(rv->cxt.dst = (uint8_t *)pso_malloc(rv->cxt.dst_len)))
+        goto ret_stream;
+
+    if(level == PSO_PRS_LEVEL_OPTIMAL) {
+        rv->nodes = (struct prs_opt_node *)
+            pso_malloc(sizeof(struct prs_opt_node) * (OPT_BLOCK + 1));
+
+        if(!rv->nodes)
+            goto ret_stream;
+    }
+
+    rv->finder->init(rv->mf);
+    rv->cxt.src = rv->buf;
+    rv->cxt.flag_ptr = rv->cxt.dst;
+    rv->cxt.max_chain = levels[level].max_chain;
+    rv->cxt.nice_len = levels[level].nice_len;
+    rv->cxt.lazy = levels[level].lazy;
+
+    if(err)
+        *err = PSOARCHIVE_OK;
+
+    return rv;
+
+ret_stream:
+    pso_free(rv->nodes);
+    pso_free(rv->cxt.dst);
+    pso_free(rv->mf);
+    pso_free(rv->buf);
+    pso_free(rv);
+ret_err:
+    if(err)
+        *err = erv;
+
+    return NULL;
+}
+
+pso_error_t pso_prs_cstream_feed(pso_prs_cstream_t *s, const uint8_t *src,
+                                 size_t len) {
+    size_t n;
+    int rv;
+
+    if(!s || (!src && len))
+        return PSOARCHIVE_EFAULT;
+
+    if(s->err)
+        return s->err;
+
+    if(s->finished)
+        return PSOARCHIVE_EINVAL;
+
+    while(len) {
+        /* Fill up the buffer as much as we can. */
+        n = STREAM_BUF_SIZE - s->cxt.src_len;
+        if(n > len)
+            n = len;
+
+        memcpy(s->buf + s->cxt.src_len, src, n);
+        s->cxt.src_len += n;
+        src += n;
+        len -= n;
+
+        /* If it's full, compress what we can and make room for more. */
+        if(s->cxt.src_len == STREAM_BUF_SIZE) {
+            if((rv = cstream_compress(s, 0)))
+                return (s->err = rv);
+
+            cstream_slide(s);
+        }
+    }
+
+    return PSOARCHIVE_OK;
+}
+
+ssize_t pso_prs_cstream_finish(pso_prs_cstream_t *s) {
+    int rv;
+
+    if(!s)
+        return PSOARCHIVE_EFAULT;
+
+    if(s->err)
+        return s->err;
+
+    if(!s->finished) {
+        if((rv = cstream_compress(s, 1)))
+            return (s->err = rv);
+
+        s->finished = 1;
+    }
+
+    return (ssize_t)s->total;
+}
+
+pso_error_t pso_prs_cstream_end(pso_prs_cstream_t *s) {
+    if(!s)
+        return PSOARCHIVE_EFAULT;
+
+    pso_free(s->nodes);
+    pso_free(s->cxt.dst);
+    pso_free(s->mf);
+    pso_free(s->buf);
+    pso_free(s);
+
+    return PSOARCHIVE_OK;
+}
@@ -21,8 +21,11 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <stdlib.h>
+#include <string.h>
 
-#include "psoarchive-error.h"
+#include "psoarchive-alloc.h"
+#include "PRS.h"
+#include "PRS-common.h"
 
 struct prs_dec_cxt {
     uint8_t flags;
@@ -30,7 +33,6 @@ struct prs_dec_cxt {
     int bit_pos;
     const uint8_t *src;
     uint8_t *dst;
-    void *udata;
 
     size_t src_len;
     size_t dst_len;
@@ -49,7 +51,9 @@ struct prs_dec_cxt {
 
     This function does the real work of decompressing whatever you throw at it.
     It uses a bunch of callbacks in the context provided to read the compressed
-    data and do whatever is needed with it.
+    data and do whatever is needed with it. These days, this is only used to
+    figure out the decompressed size of data without actually storing it. See
+    fast_decompress and the streaming functions below for everything else.
  ******************************************************************************/
 static int do_decompress(struct prs_dec_cxt *cxt) {
     int flag, size;
@@ -155,23 +159,6 @@ static int fetch_bit(struct prs_dec_cxt *cxt) {
     return rv;
 }
 
-static int copy_byte(struct prs_dec_cxt *cxt) {
-    /* Make sure we still have data left in the input buffer. */
-    if(cxt->src_pos >= cxt->src_len)
-        return PSOARCHIVE_EBADMSG;
-
-    /* Make sure we have space left in the destination buffer. */
-    if(cxt->dst_pos >= cxt->dst_len)
-        return PSOARCHIVE_ENOSPC;
-
-    /* Copy the byte and increment all the counters/pointers. */
-    *(cxt->dst + cxt->dst_pos) = *cxt->src++;
-    ++cxt->src_pos;
-    ++cxt->dst_pos;
-
-    return PSOARCHIVE_OK;
-}
-
 static int fetch_byte(struct prs_dec_cxt *cxt) {
     uint8_t rv;
 
@@ -202,24 +189,6 @@ static int fetch_short(struct prs_dec_cxt *cxt) {
     return (int)rv;
 }
 
-static int offset_copy(struct prs_dec_cxt *cxt, int offset) {
-    int tmp = (int)cxt->dst_pos + offset;
-
-    /* Make sure the offset is valid. */
-    if(tmp < 0)
-        return PSOARCHIVE_EBADMSG;
-
-    /* Make sure we have space left in the destination buffer. */
-    if(cxt->dst_pos >= cxt->dst_len)
-        return PSOARCHIVE_ENOSPC;
-
-    /* Copy the byte and increment all the counters/pointers. */
-    *(cxt->dst + cxt->dst_pos) = *(cxt->dst + offset);
-    ++cxt->dst_pos;
-
-    return PSOARCHIVE_OK;
-}
-
 static int nocopy_byte(struct prs_dec_cxt *cxt) {
     /* Make sure we still have data left in the input buffer. */
     if(cxt->src_pos >= cxt->src_len)
@@ -246,152 +215,576 @@ static int offset_nocopy(struct prs_dec_cxt *cxt, int offset) {
     return PSOARCHIVE_OK;
 }
 
-static int file_bit(struct prs_dec_cxt *cxt) {
+/******************************************************************************
+    Fast in-memory PRS Decompression
+
+    When all of the compressed data is already sitting in memory, there's no
+    need to go through the callbacks above for every single bit and byte. This
+    version of the decompressor handles the flags a byte at a time (using a
+    table to find runs of literal bytes so they can be copied all at once),
+    checks the bounds of the input and output once per token rather than once
+    per byte, and copies matches in 8-byte chunks when they don't overlap
+    themselves too closely.
+
+    If grow is non-zero, the output buffer will be reallocated (doubling in
+    size each time) as needed and *dst will be updated to point at the new
+    buffer. Otherwise, running out of space in the output buffer is an error,
+    and nothing in the buffer past the end of the output is ever written.
+    Either way, *dst is always left pointing at a buffer the caller owns, even
+    when an error is returned.
+
+    The compressed data doesn't all have to be there at once, either. When
+    final is zero, pso_prs_decode_chunk stops short of any token that might run
+    past the end of the input and returns how much of it was used, so the rest
+    can be handed back in (with more after it) on the next call. This is what
+    lets the PRSD code decrypt data just ahead of the decoder, rather than all
+    up front.
+ ******************************************************************************/
+
+/* Number of consecutive one bits at the bottom of each possible flag byte.
+   These are runs of literal bytes in the compressed data. */
+static const uint8_t literal_run[256] = {
+    0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 4,
+    0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 5,
+    0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 4,
+    0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 6,
+    0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 4,
+    0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 5,
+    0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 4,
+    0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 7,
+    0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 4,
+    0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 5,
+    0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 4,
+    0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 6,
+    0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 4,
+    0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 5,
+    0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 4,
+    0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 8
+};
+
+/* Grab the next flag bit, reading in a new flag byte if we've run out. */
+#define NEXT_FLAG(b) do { \
+        if(!bits) { \
+            if(sp >= src_len) \
+                return PSOARCHIVE_EBADMSG; \
+            flags = src[sp++]; \
+            bits = 8; \
+        } \
+        b = flags & 1; \
+        flags >>= 1; \
+        --bits; \
+    } while(0)
+
+static int make_space(uint8_t **dst, size_t *dst_len, size_t need, int grow) {
+    size_t len = *dst_len;
+    uint8_t *tmp;
+
+    if(!grow)
+        return PSOARCHIVE_ENOSPC;
+
+    while(len < need)
+        len *= 2;
+
+    if(!(tmp = (uint8_t *)pso_realloc(*dst, len)))
+        return PSOARCHIVE_EMEM;
+
+    *dst = tmp;
+    *dst_len = len;
+    return PSOARCHIVE_OK;
+}
+
+static void match_copy(uint8_t *d, size_t dist, size_t size) {
+    const uint8_t *m = d - dist;
+
+    /* If the match doesn't overlap itself at all, this is easy. */
+    if(dist >= size) {
+        memcpy(d, m, size);
+        return;
+    }
+
+    /* A distance of one is just a run of the same byte. */
+    if(dist == 1) {
+        memset(d, *m, size);
+        return;
+    }
+
+    /* As long as the source is at least 8 bytes back, each 8-byte chunk can be
+       copied in one go, since it only reads bytes that are already there. */
+    if(dist >= 8) {
+        while(size >= 8) {
+            memcpy(d, m, 8);
+            d += 8;
+            m += 8;
+            size -= 8;
+        }
+    }
+
+    while(size--) {
+        *d++ = *m++;
+    }
+}
+
+ssize_t pso_prs_decode_chunk(struct prs_dec_state *st, const uint8_t *src,
+                             size_t src_len, int final, uint8_t **dst,
+                             size_t *dst_len, int grow) {
+    size_t sp = 0, dp = st->dp, size, dist, run, stop;
+    unsigned int flags = st->flags, bits = st->bits, b1, b2;
+    uint16_t tmp;
     int rv;
 
-    /* Did we finish with a full byte last time we were in here? */
-    if(!cxt->bit_pos) {
-        /* Make sure we won't fall off the end of the file by reading the byte
-           from it. */
-        if(cxt->src_pos >= cxt->src_len)
-            return PSOARCHIVE_EBADMSG;
+    if(st->done)
+        return 0;
+
+    /* If there's more input to come, stop before any token that might run off
+       the end of what we have now. */
+    if(final)
+        stop = SIZE_MAX;
+    else if(src_len >= PRS_DEC_MAX_TOKEN)
+        stop = src_len - PRS_DEC_MAX_TOKEN;
+    else
+        return 0;
+
+    while(sp <= stop) {
+        NEXT_FLAG(b1);
+
+        /* Flag bit = 1 -> Simple byte copy from src to dst. Rather than doing
+           these one at a time, copy however many are in a row in the current
+           flag byte all at once. */
+        if(b1) {
+            run = literal_run[flags] + 1;
+
+            if(sp + run > src_len)
+                return PSOARCHIVE_EBADMSG;
+
+            if(dp + run > *dst_len &&
+               (rv = make_space(dst, dst_len, dp + run, grow)))
+                return rv;
+
+            /* If there's room to spare, always copy 8 bytes, since that's a
+               lot cheaper than copying a variable number of them. This can
+               write past the end of the output, so only do it in a buffer
+               that we allocated (the caller's own buffer must not be touched
+               past the end of the decompressed data). */
+            if(grow && sp + 8 <= src_len && dp + 8 <= *dst_len)
+                memcpy(*dst + dp, src + sp, 8);
+            else
+                memcpy(*dst + dp, src + sp, run);
+
+            sp += run;
+            dp += run;
+            flags >>= run - 1;
+            bits -= run - 1;
+            continue;
+        }
+
+        NEXT_FLAG(b1);
+
+        /* Flag bit = 1 -> Either long copy or end of file. */
+        if(b1) {
+            if(sp + 2 > src_len)
+                return PSOARCHIVE_EBADMSG;
+
+            tmp = src[sp] | (src[sp + 1] << 8);
+            sp += 2;
+
+            /* Two zero bytes implies that this is the end of the file. Return
+               the length of the file. */
+            if(!tmp) {
+                st->dp = dp;
+                st->done = 1;
+                return (ssize_t)sp;
+            }
+
+            /* Do we need to read a size byte, or is it encoded in what we
+               already got? */
+            if(!(size = tmp & 0x0007)) {
+                if(sp >= src_len)
+                    return PSOARCHIVE_EBADMSG;
+
+                size = src[sp++] + 1;
+            }
+            else {
+                size += 2;
+            }
+
+            dist = 0x2000 - (tmp >> 3);
+        }
+        /* Flag bit = 0 -> short copy. */
+        else {
+            NEXT_FLAG(b1);
+            NEXT_FLAG(b2);
+            size = ((b1 << 1) | b2) + 2;
 
-        /* Read the next byte from the file. */
-        if((rv = fgetc((FILE *)cxt->udata)) == EOF) {
-            if(ferror((FILE *)cxt->udata))
-                return PSOARCHIVE_EIO;
+            if(sp >= src_len)
+                return PSOARCHIVE_EBADMSG;
+
+            dist = 0x100 - src[sp++];
+        }
+
+        /* Make sure the match doesn't reach back before the start of the
+           output and that there's room for it. */
+        if(dist > dp)
             return PSOARCHIVE_EBADMSG;
+
+        if(dp + size > *dst_len &&
+           (rv = make_space(dst, dst_len, dp + size, grow)))
+            return rv;
+
+        /* Most matches are short, so handle those with a couple of fixed-size
+           copies when we can. Anything past the end of the match just gets
+           overwritten later (or trimmed off), which again is only alright in
+           our own buffer. */
+        if(grow && size <= 16 && dist >= 8 && dp + 16 <= *dst_len) {
+            memcpy(*dst + dp, *dst + dp - dist, 8);
+            memcpy(*dst + dp + 8, *dst + dp - dist + 8, 8);
+        }
+        else {
+            match_copy(*dst + dp, dist, size);
         }
 
-        cxt->flags = (uint8_t)rv;
-        ++cxt->src_pos;
-        cxt->bit_pos = 8;
+        dp += size;
     }
 
-    /* Fetch the bit and shift it off the end of the byte. */
-    rv = cxt->flags & 1;
-    cxt->flags >>= 1;
-    --cxt->bit_pos;
+    st->dp = dp;
+    st->flags = flags;
+    st->bits = bits;
+    return (ssize_t)sp;
+}
 
-    return rv;
+static int fast_decompress(const uint8_t *src, size_t src_len, uint8_t **dst,
+                           size_t dst_len, int grow) {
+    struct prs_dec_state st = { 0, 0, 0, 0 };
+    ssize_t rv;
+
+    if((rv = pso_prs_decode_chunk(&st, src, src_len, 1, dst, &dst_len,
+                                  grow)) < 0)
+        return (int)rv;
+
+    return (int)st.dp;
 }
 
-static int copy_fbyte(struct prs_dec_cxt *cxt) {
-    int b;
-    void *tmp;
+/* Decompress src_len bytes of data from the reader function a chunk at a time,
+   so that nothing but the output ever needs to be held in memory. The output
+   buffer works just like it does in pso_prs_decode_chunk. */
+int pso_prs_decompress_read(prs_read_t rd, void *udata, size_t src_len,
+                            uint8_t **dst, size_t dst_len, int grow) {
+    uint8_t buf[4096 + PRS_DEC_MAX_TOKEN];
+    struct prs_dec_state st = { 0, 0, 0, 0 };
+    size_t have = 0, len;
+    ssize_t rv;
+
+    while(!st.done) {
+        /* Grab the next chunk of the data, right after whatever was left over
+           from the last one. */
+        len = src_len > 4096 ? 4096 : src_len;
+
+        if(len && rd(buf + have, len, udata))
+            return PSOARCHIVE_EIO;
 
-    /* Make sure we still have data left in the input file. */
-    if(cxt->src_pos >= cxt->src_len)
-        return PSOARCHIVE_EBADMSG;
+        src_len -= len;
+        have += len;
 
-    /* Make sure we have space left in the destination buffer. */
-    if(cxt->dst_pos >= cxt->dst_len) {
-        if(!(tmp = realloc(cxt->dst, cxt->dst_len * 2)))
-            return PSOARCHIVE_EMEM;
+        /* Decompress as much of it as we can. */
+        if((rv = pso_prs_decode_chunk(&st, buf, have, !src_len, dst, &dst_len,
+                                      grow)) < 0)
+            return (int)rv;
 
-        cxt->dst = (uint8_t *)tmp;
-        cxt->dst_len *= 2;
+        have -= (size_t)rv;
+        memmove(buf, buf + rv, have);
     }
 
-    /* Read the next byte from the file. */
-    if((b = fgetc((FILE *)cxt->udata)) == EOF) {
-        if(ferror((FILE *)cxt->udata))
-            return PSOARCHIVE_EIO;
-        return PSOARCHIVE_EBADMSG;
+    return (int)st.dp;
+}
+
+#undef NEXT_FLAG
+
+/******************************************************************************
+    Streaming PRS Decompression
+
+    These functions allow PRS-compressed data to be decompressed a piece at a
+    time, as it becomes available (from a socket or a pipe, for instance). The
+    stream keeps the last 8KiB of output around internally (as that's as far
+    back as PRS can ever look), along with whatever has been decompressed but
+    not yet drained by the caller.
+
+    Each token in the compressed data is decoded all at once, or not at all. If
+    the input runs out partway through a token, the few bytes of it that we do
+    have are stashed away until the next call to feed the stream.
+ ******************************************************************************/
+#define STREAM_HISTORY      0x2000
+#define STREAM_RING_SIZE    0x4000
+#define STREAM_RING_MASK    (STREAM_RING_SIZE - 1)
+#define STREAM_MAX_MATCH    256
+
+/* The longest a single token can be is 5 bytes (two flag bytes and a long copy
+   with a size byte). */
+#define STREAM_MAX_TOKEN    5
+
+/* Return values from stream_token(). */
+#define STREAM_MORE         0
+#define STREAM_TOKEN        1
+#define STREAM_END          2
+
+struct pso_prs_dstream {
+    uint8_t ring[STREAM_RING_SIZE];
+    uint8_t carry[STREAM_MAX_TOKEN + 1];
+
+    unsigned int flags;
+    unsigned int bits;
+    size_t carry_len;
+
+    uint64_t out_pos;
+    uint64_t drain_pos;
+
+    int done;
+    pso_error_t err;
+};
+
+/* Grab the next flag bit, bailing out if the token isn't all there yet. */
+#define STREAM_FLAG(b) do { \
+        if(!bits) { \
+            if(p >= avail) \
+                return STREAM_MORE; \
+            flags = in[p++]; \
+            bits = 8; \
+        } \
+        b = flags & 1; \
+        flags >>= 1; \
+        --bits; \
+    } while(0)
+
+static int stream_token(pso_prs_dstream_t *s, const uint8_t *in, size_t avail,
+                        size_t *used) {
+    unsigned int flags = s->flags, bits = s->bits, b1, b2;
+    size_t p = 0, size, dist;
+    uint16_t tmp;
+
+    STREAM_FLAG(b1);
+
+    /* Flag bit = 1 -> Simple byte copy from src to dst. */
+    if(b1) {
+        if(p >= avail)
+            return STREAM_MORE;
+
+        s->ring[s->out_pos++ & STREAM_RING_MASK] = in[p++];
+        goto out;
     }
 
-    /* Copy the byte and increment all the counters/pointers. */
-    *(cxt->dst + cxt->dst_pos) = (uint8_t)b;
-    ++cxt->src_pos;
-    ++cxt->dst_pos;
+    STREAM_FLAG(b1);
 
-    return PSOARCHIVE_OK;
-}
+    /* Flag bit = 1 -> Either long copy or end of file. */
+    if(b1) {
+        if(p + 2 > avail)
+            return STREAM_MORE;
 
-static int file_byte(struct prs_dec_cxt *cxt) {
-    int rv;
+        tmp = in[p] | (in[p + 1] << 8);
+        p += 2;
 
-    /* Make sure we still have data left in the input file. */
-    if(cxt->src_pos >= cxt->src_len)
-        return PSOARCHIVE_EBADMSG;
+        /* Two zero bytes implies that this is the end of the file. */
+        if(!tmp) {
+            s->flags = flags;
+            s->bits = bits;
+            *used = p;
+            return STREAM_END;
+        }
 
-    /* Read the next byte from the file. */
-    if((rv = fgetc((FILE *)cxt->udata)) == EOF) {
-        if(ferror((FILE *)cxt->udata))
-            return PSOARCHIVE_EIO;
+        if(!(size = tmp & 0x0007)) {
+            if(p >= avail)
+                return STREAM_MORE;
+
+            size = in[p++] + 1;
+        }
+        else {
+            size += 2;
+        }
+
+        dist = 0x2000 - (tmp >> 3);
+    }
+    /* Flag bit = 0 -> short copy. */
+    else {
+        STREAM_FLAG(b1);
+        STREAM_FLAG(b2);
+        size = ((b1 << 1) | b2) + 2;
+
+        if(p >= avail)
+            return STREAM_MORE;
+
+        dist = 0x100 - in[p++];
+    }
+
+    /* Make sure the match doesn't reach back before the start of the output.
+       Since the token is complete, there's no point in keeping it around. */
+    if(dist > s->out_pos) {
+        *used = p;
         return PSOARCHIVE_EBADMSG;
     }
 
-    ++cxt->src_pos;
+    while(size--) {
+        s->ring[s->out_pos & STREAM_RING_MASK] =
+            s->ring[(s->out_pos - dist) & STREAM_RING_MASK];
+        ++s->out_pos;
+    }
 
-    return (int)rv;
+out:
+    s->flags = flags;
+    s->bits = bits;
+    *used = p;
+    return STREAM_TOKEN;
 }
 
-static int file_short(struct prs_dec_cxt *cxt) {
-    uint16_t rv;
-    uint8_t b[2];
+#undef STREAM_FLAG
 
-    /* Make sure we still have data left in the input file. */
-    if(cxt->src_pos + 1 >= cxt->src_len)
-        return PSOARCHIVE_EBADMSG;
+/* Is there enough room in the ring to decode another token without clobbering
+   either the history or anything that hasn't been drained yet? */
+static int stream_has_room(pso_prs_dstream_t *s) {
+    return s->out_pos - s->drain_pos <=
+        STREAM_RING_SIZE - STREAM_HISTORY - STREAM_MAX_MATCH;
+}
 
-    /* Read the next two bytes from the file. */
-    if(fread(b, 1, 2, (FILE *)cxt->udata) != 2)
-        return PSOARCHIVE_EIO;
+pso_prs_dstream_t *pso_prs_dstream_init(pso_error_t *err) {
+    pso_prs_dstream_t *rv;
 
-    /* Combine the bytes into the 16-bit value we're looking for. */
-    rv = b[0] | (b[1] << 8);
-    cxt->src_pos += 2;
+    if(!(rv = (pso_prs_dstream_t *)pso_malloc(sizeof(pso_prs_dstream_t)))) {
+        if(err)
+            *err = PSOARCHIVE_EMEM;
+        return NULL;
+    }
 
-    return (int)rv;
+    rv->flags = rv->bits = 0;
+    rv->carry_len = 0;
+    rv->out_pos = rv->drain_pos = 0;
+    rv->done = 0;
+    rv->err = PSOARCHIVE_OK;
+
+    if(err)
+        *err = PSOARCHIVE_OK;
+
+    return rv;
 }
 
-static int offset_copy_alloc(struct prs_dec_cxt *cxt, int offset) {
-    int tmp = (int)cxt->dst_pos + offset;
-    void *tmp2;
+ssize_t pso_prs_dstream_feed(pso_prs_dstream_t *s, const uint8_t *src,
+                             size_t len) {
+    size_t consumed = 0, used, n;
+    int rv;
 
-    /* Make sure the offset is valid. */
-    if(tmp < 0)
-        return PSOARCHIVE_EBADMSG;
+    if(!s || (!src && len))
+        return PSOARCHIVE_EFAULT;
+
+    if(s->err)
+        return s->err;
+
+    /* If we've hit the end of the stream, don't take anything else. */
+    if(s->done)
+        return 0;
+
+    /* Finish off any partial token from last time first. Fill in the carry
+       buffer with as much as could possibly be needed and try again. */
+    if(s->carry_len) {
+        if(!stream_has_room(s))
+            return 0;
 
-    /* Make sure we have space left in the destination buffer. */
-    if(cxt->dst_pos >= cxt->dst_len) {
-        if(!(tmp2 = realloc(cxt->dst, cxt->dst_len * 2)))
-            return PSOARCHIVE_EMEM;
+        n = STREAM_MAX_TOKEN + 1 - s->carry_len;
+        if(n > len)
+            n = len;
 
-        cxt->dst = (uint8_t *)tmp2;
-        cxt->dst_len *= 2;
+        memcpy(s->carry + s->carry_len, src, n);
+        rv = stream_token(s, s->carry, s->carry_len + n, &used);
+
+        if(rv == STREAM_MORE) {
+            /* Still not enough. This can only happen if we used up all of the
+               input we were given, so hang on to it all. */
+            s->carry_len += n;
+            return (ssize_t)n;
+        }
+
+        /* Whatever we needed from the carry buffer beyond what was already in
+           there came from the new input. */
+        consumed = used - s->carry_len;
+        s->carry_len = 0;
+
+        if(rv < 0)
+            return (ssize_t)(s->err = rv);
+        else if(rv == STREAM_END) {
+            s->done = 1;
+            return (ssize_t)consumed;
+        }
     }
 
-    /* Copy the byte and increment all the counters/pointers. */
-    *(cxt->dst + cxt->dst_pos) = *(cxt->dst + cxt->dst_pos + offset);
-    ++cxt->dst_pos;
+    /* Now, decode straight out of the input for as long as we can. */
+    while(consumed < len && stream_has_room(s)) {
+        rv = stream_token(s, src + consumed, len - consumed, &used);
 
-    return PSOARCHIVE_OK;
+        if(rv == STREAM_MORE) {
+            /* Stash the partial token for next time. */
+            s->carry_len = len - consumed;
+            memcpy(s->carry, src + consumed, s->carry_len);
+            return (ssize_t)len;
+        }
+
+        consumed += used;
+
+        if(rv < 0)
+            return (ssize_t)(s->err = rv);
+        else if(rv == STREAM_END) {
+            s->done = 1;
+            break;
+        }
+    }
+
+    return (ssize_t)consumed;
 }
 
-static int copy_abyte(struct prs_dec_cxt *cxt) {
-    void *tmp;
+ssize_t pso_prs_dstream_drain(pso_prs_dstream_t *s, uint8_t *dst,
+                              size_t len) {
+    size_t avail, off, n;
 
-    /* Make sure we still have data left in the input file. */
-    if(cxt->src_pos >= cxt->src_len)
-        return PSOARCHIVE_EBADMSG;
+    if(!s || (!dst && len))
+        return PSOARCHIVE_EFAULT;
 
-    /* Make sure we have space left in the destination buffer. */
-    if(cxt->dst_pos >= cxt->dst_len) {
-        if(!(tmp = realloc(cxt->dst, cxt->dst_len * 2)))
-            return PSOARCHIVE_EMEM;
+    /* Figure out how much we can give back, and where it is in the ring. */
+    avail = (size_t)(s->out_pos - s->drain_pos);
+    if(len > avail)
+        len = avail;
 
-        cxt->dst = (uint8_t *)tmp;
-        cxt->dst_len *= 2;
+    off = (size_t)(s->drain_pos & STREAM_RING_MASK);
+    n = STREAM_RING_SIZE - off;
+
+    /* Copy it out, taking care of wrapping around the end of the ring. */
+    if(n >= len) {
+        memcpy(dst, s->ring + off, len);
+    }
+    else {
+        memcpy(dst, s->ring + off, n);
+        memcpy(dst + n, s->ring, len - n);
     }
 
-    /* Copy the byte and increment all the counters/pointers. */
-    *(cxt->dst + cxt->dst_pos) = *cxt->src++;
-    ++cxt->src_pos;
-    ++cxt->dst_pos;
+    s->drain_pos += len;
+    return (ssize_t)len;
+}
 
-    return PSOARCHIVE_OK;
+int pso_prs_dstream_finished(pso_prs_dstream_t *s) {
+    if(!s)
+        return PSOARCHIVE_EFAULT;
+
+    return s->done && s->out_pos == s->drain_pos;
+}
+
+pso_error_t pso_prs_dstream_end(pso_prs_dstream_t *s) {
+    pso_error_t rv;
+
+    if(!s)
+        return PSOARCHIVE_EFAULT;
+
+    /* If we never saw the end of the stream, then let the caller know. */
+    if(s->err)
+        rv = s->err;
+    else if(!s->done)
+        rv = PSOARCHIVE_EBADMSG;
+    else
+        rv = PSOARCHIVE_OK;
+
+    pso_free(s);
+    return rv;
 }
 
 /******************************************************************************
@@ -432,9 +825,7 @@ static int copy_abyte(struct prs_dec_cxt *cxt) {
     return errors related to memory allocation.
  ******************************************************************************/
 int pso_prs_decompress_buf(const uint8_t *src, uint8_t **dst, size_t src_len) {
-    struct prs_dec_cxt cxt =
-        { 0, 0, src, NULL, NULL, src_len, src_len * 2, 0, 0, &copy_abyte,
-          &offset_copy_alloc, &fetch_bit, &fetch_byte, &fetch_short };
+    uint8_t *buf;
     int rv;
 
     if(!src || !dst)
@@ -445,34 +836,31 @@ int pso_prs_decompress_buf(const uint8_t *src, uint8_t **dst, size_t src_len) {
 
     /* The minimum length of a PRS compressed file (if you were to "compress" a
        zero-byte file) is 3 bytes. If we don't have that, then bail out now. */
-    if(cxt.src_len < 3)
+    if(src_len < 3)
         return PSOARCHIVE_EBADMSG;
 
     /* Allocate some space for the output. Start with two times the length of
        the input (we will resize this later, as needed). */
-    if(!(cxt.dst = (uint8_t *)malloc(cxt.dst_len)))
+    if(!(buf = (uint8_t *)pso_malloc(src_len * 2)))
         return PSOARCHIVE_EMEM;
 
     /* Do the decompression. */
-    if((rv = do_decompress(&cxt)) < 0) {
-        free(cxt.dst);
+    if((rv = fast_decompress(src, src_len, &buf, src_len * 2, 1)) < 0) {
+        pso_free(buf);
         return rv;
     }
 
     /* Resize the output (if realloc fails to resize it, then just use the
-       unshortened buffer). */
-    if(!(*dst = realloc(cxt.dst, rv)))
-        *dst = cxt.dst;
+       unshortened buffer). Don't bother if the output is empty, since realloc
+       may well free the buffer in that case. */
+    if(!rv || !(*dst = pso_realloc(buf, rv)))
+        *dst = buf;
 
     return rv;
 }
 
 int pso_prs_decompress_buf2(const uint8_t *src, uint8_t *dst, size_t src_len,
                             size_t dst_len) {
-    struct prs_dec_cxt cxt =
-        { 0, 0, src, dst, NULL, src_len, dst_len, 0, 0, &copy_byte,
-          &offset_copy, &fetch_bit, &fetch_byte, &fetch_short };
-
     if(!src || !dst)
         return PSOARCHIVE_EFAULT;
 
@@ -481,15 +869,15 @@ int pso_prs_decompress_buf2(const uint8_t *src, uint8_t *dst, size_t src_len,
 
     /* The minimum length of a PRS compressed file (if you were to "compress" a
        zero-byte file) is 3 bytes. If we don't have that, then bail out now. */
-    if(cxt.src_len < 3)
+    if(src_len < 3)
         return PSOARCHIVE_EBADMSG;
 
-    return do_decompress(&cxt);
+    return fast_decompress(src, src_len, &dst, dst_len, 0);
 }
 
 int pso_prs_decompress_size(const uint8_t *src, size_t src_len) {
     struct prs_dec_cxt cxt =
-        { 0, 0, src, NULL, NULL, src_len, SIZE_MAX, 0, 0, &nocopy_byte,
+        { 0, 0, src, NULL, src_len, SIZE_MAX, 0, 0, &nocopy_byte,
           &offset_nocopy, &fetch_bit, &fetch_byte, &fetch_short };
 
     if(!src)
@@ -507,11 +895,13 @@ int pso_prs_decompress_size(const uint8_t *src, size_t src_len) {
 }
 
 int pso_prs_decompress_file(const char *fn, uint8_t **dst) {
-    struct prs_dec_cxt cxt =
-        { 0, 0, NULL, NULL, NULL, 0, 0, 0, 0,
-          &copy_fbyte, &offset_copy_alloc, &file_bit, &file_byte, &file_short };
+    pso_prs_dstream_t *s;
+    pso_error_t err;
+    uint8_t buf[4096];
+    uint8_t *out = NULL, *tmp;
+    size_t in_len, in_pos, out_len = 0, out_alloc;
+    ssize_t rv;
     long len;
-    int rv;
     FILE *fp;
 
     if(!fn || !dst)
@@ -520,54 +910,82 @@ int pso_prs_decompress_file(const char *fn, uint8_t **dst) {
     if(!(fp = fopen(fn, "rb")))
         return PSOARCHIVE_EFILE;
 
-    cxt.udata = fp;
-
     /* Figure out the length of the file. */
-    if(fseek(fp, 0, SEEK_END)) {
-        fclose(fp);
-        return PSOARCHIVE_EIO;
-    }
-
-    if((len = ftell(fp)) < 0) {
-        fclose(fp);
-        return PSOARCHIVE_EIO;
-    }
-
-    if(fseek(fp, 0, SEEK_SET)) {
+    if(fseek(fp, 0, SEEK_END) || (len = ftell(fp)) < 0 ||
+       fseek(fp, 0, SEEK_SET)) {
         fclose(fp);
         return PSOARCHIVE_EIO;
     }
 
-    cxt.src_len = (size_t)len;
-    cxt.dst_len = cxt.src_len * 2;
-
     /* The minimum length of a PRS compressed file (if you were to "compress" a
        zero-byte file) is 3 bytes. If we don't have that, then bail out now. */
-    if(cxt.src_len < 3) {
+    if(len < 3) {
         fclose(fp);
         return PSOARCHIVE_EBADMSG;
     }
 
+    if(!(s = pso_prs_dstream_init(&err))) {
+        fclose(fp);
+        return err;
+    }
+
     /* Allocate some space for the output. Start with two times the length of
        the input (we will resize this later, as needed). */
-    if(!(cxt.dst = (uint8_t *)malloc(cxt.dst_len))) {
-        fclose(fp);
-        return PSOARCHIVE_EMEM;
+    out_alloc = (size_t)len * 2;
+    if(!(out = (uint8_t *)pso_malloc(out_alloc))) {
+        rv = PSOARCHIVE_EMEM;
+        goto out_err;
     }
 
-    /* Do the decompression. */
-    if((rv = do_decompress(&cxt)) < 0) {
-        free(cxt.dst);
-        fclose(fp);
-        return rv;
+    /* Read the file in a chunk at a time, and push it through the stream. */
+    while(!pso_prs_dstream_finished(s)) {
+        if(!(in_len = fread(buf, 1, sizeof(buf), fp))) {
+            rv = ferror(fp) ? PSOARCHIVE_EIO : PSOARCHIVE_EBADMSG;
+            goto out_err;
+        }
+
+        in_pos = 0;
+        do {
+            if((rv = pso_prs_dstream_feed(s, buf + in_pos,
+                                          in_len - in_pos)) < 0)
+                goto out_err;
+
+            in_pos += rv;
+
+            /* Pull out everything that the stream has ready for us. */
+            for(;;) {
+                if(out_len == out_alloc) {
+                    if(!(tmp = (uint8_t *)pso_realloc(out, out_alloc * 2))) {
+                        rv = PSOARCHIVE_EMEM;
+                        goto out_err;
+                    }
+
+                    out = tmp;
+                    out_alloc *= 2;
+                }
+
+                if(!(rv = pso_prs_dstream_drain(s, out + out_len,
+                                                out_alloc - out_len)))
+                    break;
+
+                out_len += rv;
+            }
+        } while(in_pos < in_len && !pso_prs_dstream_finished(s));
     }
 
     fclose(fp);
+    pso_prs_dstream_end(s);
 
     /* Resize the output (if realloc fails to resize it, then just use the
        unshortened buffer). */
-    if(!(*dst = realloc(cxt.dst, rv)))
-        *dst = cxt.dst;
+    if(!out_len || !(*dst = pso_realloc(out, out_len)))
+        *dst = out;
 
-    return rv;
+    return (int)out_len;
+
+out_err:
+    pso_free(out);
+    pso_prs_dstream_end(s);
+    fclose(fp);
+    return (int)rv;
 }
@@ -17,6 +17,7 @@
     License along with this library. If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <stddef.h>
 #include <stdint.h>
 
 struct prsd_crypt_cxt {
@@ -28,3 +29,6 @@ struct prsd_crypt_cxt {
 /* These functions are all for internal use only. */
 void pso_prsd_crypt_init(struct prsd_crypt_cxt *cxt, uint32_t key);
 void pso_prsd_crypt(struct prsd_crypt_cxt *cxt, void *d, uint32_t len, int end);
+int pso_prsd_decompress_read(int (*rd)(uint8_t *, size_t, void *), void *udata,
+                             size_t src_len, uint8_t **dst, size_t dst_len,
+                             int grow, int endian);
@@ -32,46 +32,52 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "psoarchive-alloc.h"
 #include "PRSD-common.h"
+#include "PRS-common.h"
 #include "PRSD.h"
 #include "PRS.h"
 
-size_t pso_prsd_max_compressed_size(size_t len) {
-    return pso_prsd_max_compressed_size(len) + 8;
-}
-
-int pso_prsd_archive(const uint8_t *src, uint8_t **dst, size_t src_len,
-                     uint32_t key, int endian) {
-    size_t dl;
-    uint8_t *db;
-    int rv;
+struct prsd_enc {
     struct prsd_crypt_cxt ccxt;
+    size_t done;
+    int endian;
+};
+
+/* Encrypt compressed output as soon as the compressor is done with it. Only
+   whole words get encrypted here, the last few bytes are taken care of by
+   encrypt_tail once the compressor has finished. */
+static void encrypt_out(uint8_t *buf, size_t len, void *udata) {
+    struct prsd_enc *e = (struct prsd_enc *)udata;
+
+    len &= ~((size_t)3);
+
+    if(len > e->done) {
+        pso_prsd_crypt(&e->ccxt, buf + e->done, (uint32_t)(len - e->done),
+                       e->endian);
+        e->done = len;
+    }
+}
 
-    if(!src || !dst)
-        return PSOARCHIVE_EFAULT;
-
-    if(!src_len)
-        return PSOARCHIVE_EINVAL;
-
-    if(endian < PSO_PRSD_BIG_ENDIAN || endian > PSO_PRSD_LITTLE_ENDIAN)
-        return PSOARCHIVE_EINVAL;
+/* Encrypt whatever is left of the output. The encryption always works on
+   whole words, so do the last partial word in a temporary buffer, rather than
+   scribbling past the end of the output. */
+static void encrypt_tail(struct prsd_enc *e, uint8_t *buf, size_t len) {
+    uint8_t tmp[4] = { 0, 0, 0, 0 };
+    size_t n;
 
-    /* Figure out the length of our "compressed" buffer and allocate it. */
-    dl = pso_prsd_max_compressed_size(src_len);
-    if(!(db = malloc((dl + 3) & 0xFFFFFFFC)))
-        return PSOARCHIVE_EMEM;
+    encrypt_out(buf, len, e);
 
-    /* Compress the data into the destination buffer (offset for the header). */
-    if((rv = pso_prs_archive2(src, db + 8, src_len, dl - 8)) < 0) {
-        free(db);
-        return rv;
+    if((n = len - e->done)) {
+        memcpy(tmp, buf + e->done, n);
+        pso_prsd_crypt(&e->ccxt, tmp, (uint32_t)n, e->endian);
+        memcpy(buf + e->done, tmp, n);
+        e->done = len;
     }
+}
 
-    /* Encrypt the "compressed" data. */
-    pso_prsd_crypt_init(&ccxt, key);
-    pso_prsd_crypt(&ccxt, db + 8, dl - 8, endian);
-
-    /* Fill in the header. */
+static void write_header(uint8_t *db, size_t src_len, uint32_t key,
+                         int endian) {
     if(endian == PSO_PRSD_LITTLE_ENDIAN) {
         db[0] = (uint8_t)src_len;
         db[1] = (uint8_t)(src_len >> 8);
@@ -92,17 +98,71 @@ int pso_prsd_archive(const uint8_t *src, uint8_t **dst, size_t src_len,
         db[6] = (uint8_t)(key >> 8);
         db[7] = (uint8_t)key;
     }
+}
+
+/* Compress the data right after where the header goes, encrypting it as we go
+   along, and then fill in the header. */
+static int compress_encrypt(pso_prs_compressor_t *c, const uint8_t *src,
+                            uint8_t *dst, size_t src_len, size_t dst_len,
+                            uint32_t key, int endian) {
+    struct prsd_enc enc;
+    int rv;
+
+    if(!src_len)
+        return PSOARCHIVE_EINVAL;
+
+    if(endian < PSO_PRSD_BIG_ENDIAN || endian > PSO_PRSD_LITTLE_ENDIAN)
+        return PSOARCHIVE_EINVAL;
+
+    if(dst_len < 8)
+        return PSOARCHIVE_ENOSPC;
+
+    pso_prsd_crypt_init(&enc.ccxt, key);
+    enc.done = 0;
+    enc.endian = endian;
+
+    if((rv = pso_prs_compress_into(c, PSO_PRS_LEVEL_DEFAULT, src, dst + 8,
+                                   src_len, dst_len - 8, &encrypt_out,
+                                   &enc)) < 0)
+        return rv;
+
+    encrypt_tail(&enc, dst + 8, (size_t)rv);
+    write_header(dst, src_len, key, endian);
 
-    /* We're done, return the length of the full buffer. */
-    *dst = db;
     return rv + 8;
 }
 
-int pso_prsd_compress(const uint8_t *src, uint8_t **dst, size_t src_len,
-                      uint32_t key, int endian) {
-    uint8_t *db, *db2;
+size_t pso_prsd_max_compressed_size(size_t len) {
+    return pso_prs_max_compressed_size(len) + 8;
+}
+
+int pso_prsd_archive(const uint8_t *src, uint8_t **dst, size_t src_len,
+                     uint32_t key, int endian) {
+    size_t dl;
+    uint8_t *db;
+    int rv;
+
+    if(!src || !dst)
+        return PSOARCHIVE_EFAULT;
+
+    /* Figure out the length of our "compressed" buffer and allocate it. */
+    dl = pso_prsd_max_compressed_size(src_len);
+    if(!(db = (uint8_t *)pso_malloc(dl)))
+        return PSOARCHIVE_EMEM;
+
+    if((rv = pso_prsd_archive2(src, db, src_len, dl, key, endian)) < 0) {
+        pso_free(db);
+        return rv;
+    }
+
+    *dst = db;
+    return rv;
+}
+
+int pso_prsd_archive2(const uint8_t *src, uint8_t *dst, size_t src_len,
+                      size_t dst_len, uint32_t key, int endian) {
+    struct prsd_enc enc;
     int rv;
-    struct prsd_crypt_cxt ccxt;
 
     if(!src || !dst)
         return PSOARCHIVE_EFAULT;
@@ -113,49 +173,69 @@ int pso_prsd_compress(const uint8_t *src, uint8_t **dst, size_t src_len,
     if(endian < PSO_PRSD_BIG_ENDIAN || endian > PSO_PRSD_LITTLE_ENDIAN)
         return PSOARCHIVE_EINVAL;
 
-    /* Ugly... But it'll work...
-       Compress the data into a temporary destination buffer. */
-    if((rv = pso_prs_compress(src, &db, src_len)) < 0)
+    if(dst_len < pso_prsd_max_compressed_size(src_len))
+        return PSOARCHIVE_ENOSPC;
+
+    /* Archive the data into the destination buffer (offset for the header). */
+    if((rv = pso_prs_archive2(src, dst + 8, src_len, dst_len - 8)) < 0)
         return rv;
 
-    /* Now that we know the full length, allocate space for the whole thing,
-       copy the compressed data over to the new buffer, and clean up the other
-       one. */
-    if(!(db2 = (uint8_t *)malloc((rv + 3) & 0xFFFFFFFC))) {
-        free(db);
-        return PSOARCHIVE_EMEM;
-    }
+    /* Encrypt the "compressed" data. */
+    pso_prsd_crypt_init(&enc.ccxt, key);
+    enc.done = 0;
+    enc.endian = endian;
+    encrypt_tail(&enc, dst + 8, (size_t)rv);
 
-    memcpy(db2 + 8, db, rv);
-    free(db);
+    /* Fill in the header. */
+    write_header(dst, src_len, key, endian);
 
-    /* Encrypt the compressed data. */
-    pso_prsd_crypt_init(&ccxt, key);
-    pso_prsd_crypt(&ccxt, db2 + 8, rv, endian);
+    /* We're done, return the length of the full buffer. */
+    return rv + 8;
+}
 
-    /* Fill in the header. */
-    if(endian == PSO_PRSD_LITTLE_ENDIAN) {
-        db2[0] = (uint8_t)src_len;
-        db2[1] = (uint8_t)(src_len >> 8);
-        db2[2] = (uint8_t)(src_len >> 16);
-        db2[3] = (uint8_t)(src_len >> 24);
-        db2[4] = (uint8_t)key;
-        db2[5] = (uint8_t)(key >> 8);
-        db2[6] = (uint8_t)(key >> 16);
-        db2[7] = (uint8_t)(key >> 24);
-    }
-    else {
-        db2[0] = (uint8_t)(src_len >> 24);
-        db2[1] = (uint8_t)(src_len >> 16);
-        db2[2] = (uint8_t)(src_len >> 8);
-        db2[3] = (uint8_t)src_len;
-        db2[4] = (uint8_t)(key >> 24);
-        db2[5] = (uint8_t)(key >> 16);
-        db2[6] = (uint8_t)(key >> 8);
-        db2[7] = (uint8_t)key;
+int pso_prsd_compress(const uint8_t *src, uint8_t **dst, size_t src_len,
+                      uint32_t key, int endian) {
+    size_t dl;
+    uint8_t *db, *tmp;
+    int rv;
+
+    if(!src || !dst)
+        return PSOARCHIVE_EFAULT;
+
+    /* Allocate space for the header and the largest the compressed data could
+       possibly be. */
+    dl = pso_prsd_max_compressed_size(src_len);
+    if(!(db = (uint8_t *)pso_malloc(dl)))
+        return PSOARCHIVE_EMEM;
+
+    if((rv = compress_encrypt(NULL, src, db, src_len, dl, key, endian)) < 0) {
+        pso_free(db);
+        return rv;
     }
 
+    /* Shrink the buffer down to size (if realloc fails to resize it, then just
+       use the unshortened buffer). */
+    if((tmp = (uint8_t *)pso_realloc(db, rv)))
+        db = tmp;
+
     /* We're done, return the length of the full buffer. */
-    *dst = db2;
-    return rv + 8;
+    *dst = db;
+    return rv;
+}
+
+int pso_prsd_compress2(const uint8_t *src, uint8_t *dst, size_t src_len,
+                       size_t dst_len, uint32_t key, int endian) {
+    if(!src || !dst)
+        return PSOARCHIVE_EFAULT;
+
+    return compress_encrypt(NULL, src, dst, src_len, dst_len, key, endian);
+}
+
+int pso_prsd_compressor_compress(pso_prs_compressor_t *c, const uint8_t *src,
+                                 uint8_t *dst, size_t src_len, size_t dst_len,
+                                 uint32_t key, int endian) {
+    if(!c || !src || !dst)
+        return PSOARCHIVE_EFAULT;
+
+    return compress_encrypt(c, src, dst, src_len, dst_len, key, endian);
 }
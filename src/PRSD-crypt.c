@@ -41,6 +41,8 @@
     non-installed header file).
  ******************************************************************************/
 
+#include <string.h>
+
 #include "PRSD-common.h"
 #include "PRSD.h"
 
@@ -49,15 +51,31 @@
                  ((x >>  8) & 0xFF00) | \
                  ((x & 0xFF00) <<  8) | \
                  ((x & 0x00FF) << 24))
-#define BE32() x
+#define BE32(x) x
+#define HOST_ENDIAN PSO_PRSD_BIG_ENDIAN
 #else
 #define LE32(x) x
 #define BE32(x) (((x >> 24) & 0x00FF) | \
                  ((x >>  8) & 0xFF00) | \
                  ((x & 0xFF00) <<  8) | \
                  ((x & 0x00FF) << 24))
+#define HOST_ENDIAN PSO_PRSD_LITTLE_ENDIAN
+#endif
+
+/* Which SIMD implementations can we even try to build? */
+#if (defined(__GNUC__) || defined(__clang__)) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define CRYPT_X86
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define CRYPT_NEON
+#include <arm_neon.h>
 #endif
 
+/* The stream is made up of 55 usable words, which are regenerated all at once
+   each time we run out. */
+#define STREAM_WORDS    55
+
 static void mix_stream(struct prsd_crypt_cxt *cxt) {
     int i;
     uint32_t *ptr;
@@ -102,26 +120,254 @@ static inline uint32_t crypt_dword(struct prsd_crypt_cxt *cxt, uint32_t data) {
     return data ^ cxt->stream[cxt->pos++];
 }
 
-void pso_prsd_crypt(struct prsd_crypt_cxt *cxt, void *d, uint32_t len,
-                    int endian) {
-    uint32_t *data = (uint32_t *)d;
+static void crypt_words(struct prsd_crypt_cxt *cxt, uint8_t *data,
+                        uint32_t count, int endian) {
     uint32_t tmp;
 
-    /* Round the size of the buffer to the next 4-byte boundary. */
-    len = (len + 3) & 0xFFFFFFFC;
+    /* The data isn't necessarily aligned, so go through memcpy to be safe. */
+    for(; count; --count, data += 4) {
+        memcpy(&tmp, data, 4);
 
-    if(endian == PSO_PRSD_LITTLE_ENDIAN) {
-        while(len > 0) {
-            tmp = crypt_dword(cxt, LE32((*data)));
-            *data++ = LE32(tmp);
-            len -= 4;
+        if(endian == PSO_PRSD_LITTLE_ENDIAN) {
+            tmp = crypt_dword(cxt, LE32(tmp));
+            tmp = LE32(tmp);
         }
-    }
-    else {
-        while(len > 0) {
-            tmp = crypt_dword(cxt, BE32((*data)));
-            *data++ = BE32(tmp);
-            len -= 4;
+        else {
+            tmp = crypt_dword(cxt, BE32(tmp));
+            tmp = BE32(tmp);
         }
+
+        memcpy(data, &tmp, 4);
+    }
+}
+
+/******************************************************************************
+    Bulk encryption/decryption
+
+    Once we're lined up at the start of a fresh block of the stream, there's no
+    need to go word by word. Each block of 55 words gets generated all at once
+    (with the two loops in mix_stream done a vector at a time), and then the
+    whole block gets XORed into the data. Rather than byte-swapping each word
+    of the data for the "wrong" endianness, the keystream gets byte-swapped
+    instead, since that works out the same.
+
+    The second loop in mix_stream depends on values that it has already
+    updated, but never any less than 24 words back, so it can be done in order
+    with vectors of up to 24 words without any trouble.
+
+    Which implementation gets used is decided at runtime, based on what the CPU
+    supports. The portable version is always available as a fallback.
+ ******************************************************************************/
+struct crypt_impl {
+    void (*mix)(uint32_t *s);
+    void (*xor_block)(uint8_t *d, const uint8_t *k, size_t len);
+};
+
+static void mix_c(uint32_t *s) {
+    int i;
+
+    for(i = 1; i < 25; ++i) {
+        s[i] -= s[i + 31];
+    }
+
+    for(i = 25; i < 56; ++i) {
+        s[i] -= s[i - 24];
+    }
+}
+
+static void xor_c(uint8_t *d, const uint8_t *k, size_t len) {
+    uint32_t a, b;
+
+    for(; len >= 4; len -= 4, d += 4, k += 4) {
+        memcpy(&a, d, 4);
+        memcpy(&b, k, 4);
+        a ^= b;
+        memcpy(d, &a, 4);
+    }
+
+    while(len--) {
+        *d++ ^= *k++;
+    }
+}
+
+static const struct crypt_impl impl_c = { &mix_c, &xor_c };
+
+#ifdef CRYPT_X86
+__attribute__((target("sse2")))
+static void mix_sse2(uint32_t *s) {
+    int i;
+    __m128i a, b;
+
+    for(i = 1; i < 25; i += 4) {
+        a = _mm_loadu_si128((const __m128i *)(s + i));
+        b = _mm_loadu_si128((const __m128i *)(s + i + 31));
+        _mm_storeu_si128((__m128i *)(s + i), _mm_sub_epi32(a, b));
+    }
+
+    for(i = 25; i + 4 <= 56; i += 4) {
+        a = _mm_loadu_si128((const __m128i *)(s + i));
+        b = _mm_loadu_si128((const __m128i *)(s + i - 24));
+        _mm_storeu_si128((__m128i *)(s + i), _mm_sub_epi32(a, b));
+    }
+
+    for(; i < 56; ++i) {
+        s[i] -= s[i - 24];
+    }
+}
+
+__attribute__((target("sse2")))
+static void xor_sse2(uint8_t *d, const uint8_t *k, size_t len) {
+    __m128i a, b;
+
+    for(; len >= 16; len -= 16, d += 16, k += 16) {
+        a = _mm_loadu_si128((const __m128i *)d);
+        b = _mm_loadu_si128((const __m128i *)k);
+        _mm_storeu_si128((__m128i *)d, _mm_xor_si128(a, b));
+    }
+
+    xor_c(d, k, len);
+}
+
+__attribute__((target("avx2")))
+static void mix_avx2(uint32_t *s) {
+    int i;
+    __m256i a, b;
+
+    for(i = 1; i < 25; i += 8) {
+        a = _mm256_loadu_si256((const __m256i *)(s + i));
+        b = _mm256_loadu_si256((const __m256i *)(s + i + 31));
+        _mm256_storeu_si256((__m256i *)(s + i), _mm256_sub_epi32(a, b));
     }
+
+    for(i = 25; i + 8 <= 56; i += 8) {
+        a = _mm256_loadu_si256((const __m256i *)(s + i));
+        b = _mm256_loadu_si256((const __m256i *)(s + i - 24));
+        _mm256_storeu_si256((__m256i *)(s + i), _mm256_sub_epi32(a, b));
+    }
+
+    for(; i < 56; ++i) {
+        s[i] -= s[i - 24];
+    }
+}
+
+__attribute__((target("avx2")))
+static void xor_avx2(uint8_t *d, const uint8_t *k, size_t len) {
+    __m256i a, b;
+
+    for(; len >= 32; len -= 32, d += 32, k += 32) {
+        a = _mm256_loadu_si256((const __m256i *)d);
+        b = _mm256_loadu_si256((const __m256i *)k);
+        _mm256_storeu_si256((__m256i *)d, _mm256_xor_si256(a, b));
+    }
+
+    xor_sse2(d, k, len);
+}
+
+static const struct crypt_impl impl_sse2 = { &mix_sse2, &xor_sse2 };
+static const struct crypt_impl impl_avx2 = { &mix_avx2, &xor_avx2 };
+#endif /* CRYPT_X86 */
+
+#ifdef CRYPT_NEON
+static void mix_neon(uint32_t *s) {
+    int i;
+
+    for(i = 1; i < 25; i += 4) {
+        vst1q_u32(s + i, vsubq_u32(vld1q_u32(s + i), vld1q_u32(s + i + 31)));
+    }
+
+    for(i = 25; i + 4 <= 56; i += 4) {
+        vst1q_u32(s + i, vsubq_u32(vld1q_u32(s + i), vld1q_u32(s + i - 24)));
+    }
+
+    for(; i < 56; ++i) {
+        s[i] -= s[i - 24];
+    }
+}
+
+static void xor_neon(uint8_t *d, const uint8_t *k, size_t len) {
+    for(; len >= 16; len -= 16, d += 16, k += 16) {
+        vst1q_u8(d, veorq_u8(vld1q_u8(d), vld1q_u8(k)));
+    }
+
+    xor_c(d, k, len);
+}
+
+static const struct crypt_impl impl_neon = { &mix_neon, &xor_neon };
+#endif /* CRYPT_NEON */
+
+static const struct crypt_impl *pick_impl(void) {
+    static const struct crypt_impl *impl = NULL;
+
+    /* It doesn't matter if two threads race on this, they'll both come up with
+       the same answer anyway. */
+    if(impl)
+        return impl;
+
+#if defined(CRYPT_X86)
+    __builtin_cpu_init();
+
+    if(__builtin_cpu_supports("avx2"))
+        impl = &impl_avx2;
+    else if(__builtin_cpu_supports("sse2"))
+        impl = &impl_sse2;
+    else
+        impl = &impl_c;
+#elif defined(CRYPT_NEON)
+    impl = &impl_neon;
+#else
+    impl = &impl_c;
+#endif
+
+    return impl;
+}
+
+void pso_prsd_crypt(struct prsd_crypt_cxt *cxt, void *d, uint32_t len,
+                    int endian) {
+    const struct crypt_impl *impl;
+    uint8_t *data = (uint8_t *)d;
+    uint32_t words, n, key[STREAM_WORDS];
+    const uint8_t *ks;
+    int i;
+
+    /* Round the size of the buffer to the next 4-byte boundary. */
+    words = ((len + 3) & 0xFFFFFFFC) >> 2;
+
+    /* Finish off whatever is left of the current block of the stream one word
+       at a time... */
+    n = 56 - cxt->pos;
+    if(n > words)
+        n = words;
+
+    crypt_words(cxt, data, n, endian);
+    data += n << 2;
+    words -= n;
+
+    /* ...then do as many whole blocks as we can in bulk... */
+    if(words >= STREAM_WORDS) {
+        impl = pick_impl();
+
+        do {
+            impl->mix(cxt->stream);
+
+            if(endian == HOST_ENDIAN) {
+                ks = (const uint8_t *)(cxt->stream + 1);
+            }
+            else {
+                for(i = 0; i < STREAM_WORDS; ++i) {
+                    n = cxt->stream[i + 1];
+                    key[i] = ((n >> 24) & 0x00FF) | ((n >> 8) & 0xFF00) |
+                        ((n & 0xFF00) << 8) | ((n & 0x00FF) << 24);
+                }
+
+                ks = (const uint8_t *)key;
+            }
+
+            impl->xor_block(data, ks, STREAM_WORDS << 2);
+            data += STREAM_WORDS << 2;
+            words -= STREAM_WORDS;
+        } while(words >= STREAM_WORDS);
+    }
+
+    /* ...and then whatever is left over goes one word at a time again. */
+    crypt_words(cxt, data, words, endian);
 }
@@ -27,24 +27,98 @@
 
     The code in this file ties together PRS decompression with the decryption
     code in PRSD-crypt.c to decode a whole PRSD file.
+
+    Rather than decrypting a whole copy of the compressed data and then
+    decompressing that, the data is decrypted a small block at a time into a
+    buffer on the stack, just ahead of the PRS decoder. That way the compressed
+    data only gets read through once, and the only thing that needs allocating
+    is the output buffer.
  ******************************************************************************/
 
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 
+#include "psoarchive-alloc.h"
 #include "PRSD-common.h"
+#include "PRS-common.h"
 #include "PRSD.h"
 #include "PRS.h"
 
+/* How much data gets decrypted at once. This must be a multiple of 4. */
+#define CHUNK_SIZE      4096
+
+/* The longest possible PRS token can expand to 256 bytes of output from just
+   over 3 bytes of input, so nothing valid can ever expand by more than this. */
+#define MAX_RATIO       80
+
+/* Decrypt and decompress the data that comes after the header, either from the
+   memory buffer src (if rd is NULL) or from the reader function rd. The output
+   buffer works just like it does in the PRS decoder. */
+static int decrypt_decompress(const uint8_t *src, prs_read_t rd, void *udata,
+                              size_t src_len, uint32_t key, int endian,
+                              uint8_t **dst, size_t dst_len, int grow) {
+    uint8_t buf[CHUNK_SIZE + PRS_DEC_MAX_TOKEN + 4];
+    struct prsd_crypt_cxt ccxt;
+    struct prs_dec_state st = { 0, 0, 0, 0 };
+    size_t have = 0, len;
+    ssize_t rv;
+
+    pso_prsd_crypt_init(&ccxt, key);
+
+    while(!st.done) {
+        /* Grab the next chunk of the data and decrypt it, right after whatever
+           was left over from the last one. */
+        len = src_len > CHUNK_SIZE ? CHUNK_SIZE : src_len;
+
+        if(rd) {
+            if(len && rd(buf + have, len, udata))
+                return PSOARCHIVE_EIO;
+        }
+        else {
+            memcpy(buf + have, src, len);
+            src += len;
+        }
+
+        pso_prsd_crypt(&ccxt, buf + have, (uint32_t)len, endian);
+        src_len -= len;
+        have += len;
+
+        /* Decompress as much of it as we can. */
+        if((rv = pso_prs_decode_chunk(&st, buf, have, !src_len, dst, &dst_len,
+                                      grow)) < 0)
+            return (int)rv;
+
+        have -= (size_t)rv;
+        memmove(buf, buf + rv, have);
+    }
+
+    return (int)st.dp;
+}
+
+static int read_file(uint8_t *buf, size_t len, void *udata) {
+    return fread(buf, 1, len, (FILE *)udata) != len;
+}
+
+/* Figure out how much space to start out with for the output. The header tells
+   us how big it should be, but don't trust it with anything that's clearly
+   impossible. */
+static size_t initial_size(uint32_t unc_len, size_t src_len) {
+    if(!unc_len)
+        return 1;
+    else if(unc_len / MAX_RATIO > src_len)
+        return src_len * 2;
+
+    return unc_len;
+}
+
 int pso_prsd_decompress_file(const char *fn, uint8_t **dst, int endian) {
     long len;
     int rv;
     FILE *fp;
     uint8_t buf[8];
     uint32_t key, unc_len;
-    uint8_t *cmp_buf;
-    struct prsd_crypt_cxt ccxt;
+    size_t out_len;
 
     if(!fn || !dst)
         return PSOARCHIVE_EFAULT;
@@ -114,40 +188,28 @@ int pso_prsd_decompress_file(const char *fn, uint8_t **dst, int endian) {
 
     len -= 8;
 
-    /* Allocate space for the compressed/encrypted data. */
-    if(!(cmp_buf = (uint8_t *)malloc((len + 3) & 0xFFFFFFFC))) {
+    /* Allocate space for the output. */
+    out_len = initial_size(unc_len, (size_t)len);
+    if(!(*dst = (uint8_t *)pso_malloc(out_len))) {
         fclose(fp);
         return PSOARCHIVE_EMEM;
     }
 
-    /* Read in the data from the file. */
-    if(fread(cmp_buf, 1, len, fp) != len) {
-        free(cmp_buf);
-        fclose(fp);
-        return PSOARCHIVE_EIO;
-    }
-
-    /* We're done with the file, close it. */
+    /* Decrypt and decompress the data as we read it in from the file. */
+    rv = decrypt_decompress(NULL, &read_file, fp, (size_t)len, key, endian,
+                            dst, out_len, 1);
     fclose(fp);
 
-    /* Decrypt the file data. */
-    pso_prsd_crypt_init(&ccxt, key);
-    pso_prsd_crypt(&ccxt, cmp_buf, len, endian);
-
-    /* Now that we have the data decrypted, decompress it. */
-    if((rv = pso_prs_decompress_buf(cmp_buf, dst, len)) < 0) {
-        free(cmp_buf);
+    if(rv < 0) {
+        pso_free(*dst);
         *dst = NULL;
         return rv;
     }
 
-    /* Clean up the compressed buffer, we don't need it anymore. */
-    free(cmp_buf);
-
     /* Does the uncompressed size match what we're expecting from the file
        header? */
     if(rv != (int)unc_len) {
-        free(*dst);
+        pso_free(*dst);
         *dst = NULL;
         return PSOARCHIVE_EFATAL;
     }
@@ -159,8 +221,7 @@ int pso_prsd_decompress_file(const char *fn, uint8_t **dst, int endian) {
 int pso_prsd_decompress_buf(const uint8_t *src, uint8_t **dst, size_t src_len,
                             int endian) {
     uint32_t key, unc_len;
-    uint8_t *cmp_buf;
-    struct prsd_crypt_cxt ccxt;
+    size_t out_len;
     int rv;
 
     /* Verify the input parameters. */
@@ -202,31 +263,23 @@ int pso_prsd_decompress_buf(const uint8_t *src, uint8_t **dst, size_t src_len,
 
     src_len -= 8;
 
-    /* Allocate space for the compressed/encrypted data. */
-    if(!(cmp_buf = (uint8_t *)malloc((src_len + 3) & 0xFFFFFFFC)))
+    /* Allocate space for the output. */
+    out_len = initial_size(unc_len, src_len);
+    if(!(*dst = (uint8_t *)pso_malloc(out_len)))
         return PSOARCHIVE_EMEM;
 
-    /* Copy the data from the source buffer into our temporary one. */
-    memcpy(cmp_buf, src + 8, src_len);
-
-    /* Decrypt the file data. */
-    pso_prsd_crypt_init(&ccxt, key);
-    pso_prsd_crypt(&ccxt, cmp_buf, src_len, endian);
-
-    /* Now that we have the data decrypted, decompress it. */
-    if((rv = pso_prs_decompress_buf(cmp_buf, dst, src_len)) < 0) {
-        free(cmp_buf);
+    /* Decrypt and decompress the data. */
+    if((rv = decrypt_decompress(src + 8, NULL, NULL, src_len, key, endian,
+                                dst, out_len, 1)) < 0) {
+        pso_free(*dst);
         *dst = NULL;
         return rv;
     }
 
-    /* Clean up the temporary buffer, we don't need it anymore. */
-    free(cmp_buf);
-
     /* Does the uncompressed size match what we're expecting from the file
        header? */
     if(rv != (int)unc_len) {
-        free(*dst);
+        pso_free(*dst);
         *dst = NULL;
         return PSOARCHIVE_EFATAL;
     }
@@ -238,8 +291,6 @@ int pso_prsd_decompress_buf(const uint8_t *src, uint8_t **dst, size_t src_len,
 int pso_prsd_decompress_buf2(const uint8_t *src, uint8_t *dst, size_t src_len,
                              size_t dst_len, int endian) {
     uint32_t key, unc_len;
-    uint8_t *cmp_buf;
-    struct prsd_crypt_cxt ccxt;
     int rv;
 
     /* Verify the input parameters. */
@@ -285,32 +336,84 @@ int pso_prsd_decompress_buf2(const uint8_t *src, uint8_t *dst, size_t src_len,
     if(dst_len < unc_len)
         return PSOARCHIVE_ENOSPC;
 
-    /* Allocate space for the compressed/encrypted data. */
-    if(!(cmp_buf = (uint8_t *)malloc((src_len + 3) & 0xFFFFFFFC)))
-        return PSOARCHIVE_EMEM;
+    /* Decrypt and decompress the data. */
+    if((rv = decrypt_decompress(src + 8, NULL, NULL, src_len, key, endian,
+                                &dst, dst_len, 0)) < 0)
+        return rv;
+
+    /* Does the uncompressed size match what we're expecting from the file
+       header? */
+    if(rv != (int)unc_len)
+        return PSOARCHIVE_EFATAL;
 
-    /* Copy the data from the source buffer into our temporary one. */
-    memcpy(cmp_buf, src + 8, src_len);
+    /* We're done, return the size of the uncompressed data. */
+    return rv;
+}
 
-    /* Decrypt the file data. */
-    pso_prsd_crypt_init(&ccxt, key);
-    pso_prsd_crypt(&ccxt, cmp_buf, src_len, endian);
+/* Decompress src_len bytes of PRSD data (header and all) from the reader
+   function. If grow is non-zero, a new buffer is allocated for the output and
+   stored in *dst. Otherwise, the output goes in the dst_len bytes at *dst. */
+int pso_prsd_decompress_read(prs_read_t rd, void *udata, size_t src_len,
+                             uint8_t **dst, size_t dst_len, int grow,
+                             int endian) {
+    uint8_t hdr[8];
+    uint32_t key, unc_len;
+    int rv;
+
+    if(!rd || !dst)
+        return PSOARCHIVE_EFAULT;
+
+    if(src_len < 11)
+        return PSOARCHIVE_EBADMSG;
+
+    if(rd(hdr, 8, udata))
+        return PSOARCHIVE_EIO;
 
-    /* Now that we have the data decrypted, decompress it. */
-    if((rv = pso_prs_decompress_buf2(cmp_buf, dst, src_len, dst_len)) < 0) {
-        free(cmp_buf);
+    /* The header tells us how big the output is, and (if we don't know it)
+       which way around everything is. */
+    if((rv = pso_prsd_decompress_size(hdr, src_len, endian)) < 0)
         return rv;
+
+    unc_len = (uint32_t)rv;
+
+    if(endian == PSO_PRSD_AUTO_ENDIAN) {
+        endian = (hdr[0] | (hdr[1] << 8) | (hdr[2] << 16) |
+                  ((uint32_t)hdr[3] << 24)) == unc_len ?
+            PSO_PRSD_LITTLE_ENDIAN : PSO_PRSD_BIG_ENDIAN;
+    }
+
+    if(endian == PSO_PRSD_BIG_ENDIAN)
+        key = hdr[7] | (hdr[6] << 8) | (hdr[5] << 16) |
+            ((uint32_t)hdr[4] << 24);
+    else
+        key = hdr[4] | (hdr[5] << 8) | (hdr[6] << 16) |
+            ((uint32_t)hdr[7] << 24);
+
+    src_len -= 8;
+
+    if(grow) {
+        dst_len = initial_size(unc_len, src_len);
+        if(!(*dst = (uint8_t *)pso_malloc(dst_len)))
+            return PSOARCHIVE_EMEM;
+    }
+    else if(dst_len < unc_len) {
+        return PSOARCHIVE_ENOSPC;
     }
 
-    /* Clean up the temporary buffer, we don't need it anymore. */
-    free(cmp_buf);
+    /* Decrypt and decompress the data as we read it in. */
+    rv = decrypt_decompress(NULL, rd, udata, src_len, key, endian, dst,
+                            dst_len, grow);
 
     /* Does the uncompressed size match what we're expecting from the file
        header? */
-    if(rv != (int)unc_len)
-        return PSOARCHIVE_EFATAL;
+    if(rv >= 0 && rv != (int)unc_len)
+        rv = PSOARCHIVE_EFATAL;
+
+    if(rv < 0 && grow) {
+        pso_free(*dst);
+        *dst = NULL;
+    }
 
-    /* We're done, return the size of the uncompressed data. */
     return rv;
 }
 
@@ -331,13 +434,15 @@ int pso_prsd_decompress_size(const uint8_t *src, size_t src_len, int endian) {
     if(endian == PSO_PRSD_AUTO_ENDIAN) {
         /* Assume little endian first, because it's probably the right idea. */
         endian = PSO_PRSD_LITTLE_ENDIAN;
-        tmp = src[0] | (src[1] << 8) | (src[2] << 16) | (src[3] << 24);
+        tmp = src[0] | (src[1] << 8) | (src[2] << 16) |
+            ((uint32_t)src[3] << 24);
 
         /* If we've got something that looks suspiciously large, see if guessing
            big endian would make it even more suspiciously large. */
         if(tmp > 10 * src_len) {
             tmp2 = tmp / src_len;
-            tmp = src[3] | (src[2] << 8) | (src[1] << 16) | (src[0] << 24);
+            tmp = src[3] | (src[2] << 8) | (src[1] << 16) |
+                ((uint32_t)src[0] << 24);
 
             if(tmp < tmp2 * src_len)
                 endian = PSO_PRSD_BIG_ENDIAN;
@@ -345,7 +450,9 @@ int pso_prsd_decompress_size(const uint8_t *src, size_t src_len, int endian) {
     }
 
     if(endian == PSO_PRSD_BIG_ENDIAN)
-        return (int)(src[3] | (src[2] << 8) | (src[1] << 16) | (src[0] << 24));
+        return (int)(src[3] | (src[2] << 8) | (src[1] << 16) |
+                     ((uint32_t)src[0] << 24));
     else
-        return (int)(src[0] | (src[1] << 8) | (src[2] << 16) | (src[3] << 24));
+        return (int)(src[0] | (src[1] << 8) | (src[2] << 16) |
+                     ((uint32_t)src[3] << 24));
 }
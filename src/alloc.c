@@ -0,0 +1,76 @@
+/*
+    This file is part of libpsoarchive.
+
+    Copyright (C) 2026 Lawrence Sebald
+
+    This library is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 2.1 or
+    version 3 of the License.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+
+#include "psoarchive-alloc.h"
+
+static void *default_malloc(size_t size, void *udata) {
+    (void)udata;
+    return malloc(size);
+}
+
+static void *default_realloc(void *ptr, size_t size, void *udata) {
+    (void)udata;
+    return realloc(ptr, size);
+}
+
+static void default_free(void *ptr, void *udata) {
+    (void)udata;
+    free(ptr);
+}
+
+static pso_allocator_t allocator = {
+    &default_malloc, &default_realloc, &default_free, NULL
+};
+
+pso_error_t pso_set_allocator(const pso_allocator_t *a) {
+    if(!a) {
+        allocator.malloc_fn = &default_malloc;
+        allocator.realloc_fn = &default_realloc;
+        allocator.free_fn = &default_free;
+        allocator.udata = NULL;
+        return PSOARCHIVE_OK;
+    }
+
+    if(!a->malloc_fn || !a->realloc_fn || !a->free_fn)
+        return PSOARCHIVE_EINVAL;
+
+    allocator = *a;
+    return PSOARCHIVE_OK;
+}
+
+void pso_get_allocator(pso_allocator_t *a) {
+    if(a)
+        *a = allocator;
+}
+
+void *pso_malloc(size_t size) {
+    return allocator.malloc_fn(size, allocator.udata);
+}
+
+void *pso_realloc(void *ptr, size_t size) {
+    return allocator.realloc_fn(ptr, size, allocator.udata);
+}
+
+void pso_free(void *ptr) {
+    /* Like free, freeing NULL does nothing (so the hooks never see it). */
+    if(ptr)
+        allocator.free_fn(ptr, allocator.udata);
+}
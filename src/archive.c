@@ -0,0 +1,831 @@
+/*
+    This file is part of libpsoarchive.
+
+    Copyright (C) 2026 Lawrence Sebald
+
+    This library is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 2.1 or
+    version 3 of the License.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <fcntl.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#else
+#include <io.h>
+#endif
+
+#include "psoarchive-alloc.h"
+#include "psoarchive.h"
+#include "AFS-common.h"
+#include "GSL-common.h"
+#include "PRSD-common.h"
+#include "PRS-common.h"
+#include "PRSD.h"
+#include "extract.h"
+#include "update.h"
+
+/* What each type of archive needs to provide. Each of these takes the
+   format's own read handle. */
+struct archive_ops {
+    int type;
+
+    pso_error_t (*close)(void *arc);
+    uint32_t (*count)(void *arc);
+    uint32_t (*lookup)(void *arc, const char *fn);
+    pso_error_t (*name)(void *arc, uint32_t hnd, char *fn, size_t len);
+    ssize_t (*size)(void *arc, uint32_t hnd);
+    ssize_t (*read)(void *arc, uint32_t hnd, uint8_t *buf, size_t len);
+    ssize_t (*read_at)(void *arc, uint32_t hnd, uint8_t *buf, size_t len,
+                       uint32_t offset);
+    const uint8_t *(*data)(void *arc, uint32_t hnd, size_t *len);
+};
+
+struct pso_archive {
+    const struct archive_ops *ops;
+    void *arc;
+};
+
+/* Glue between the generic archive code and the AFS reader. */
+static pso_error_t afs_close(void *a) {
+    return pso_afs_read_close((pso_afs_read_t *)a);
+}
+
+static uint32_t afs_count(void *a) {
+    return pso_afs_file_count((pso_afs_read_t *)a);
+}
+
+static uint32_t afs_lookup(void *a, const char *fn) {
+    return pso_afs_file_lookup((pso_afs_read_t *)a, fn);
+}
+
+static pso_error_t afs_name(void *a, uint32_t hnd, char *fn, size_t len) {
+    return pso_afs_file_name((pso_afs_read_t *)a, hnd, fn, len);
+}
+
+static ssize_t afs_size(void *a, uint32_t hnd) {
+    return pso_afs_file_size((pso_afs_read_t *)a, hnd);
+}
+
+static ssize_t afs_read(void *a, uint32_t hnd, uint8_t *buf, size_t len) {
+    return pso_afs_file_read((pso_afs_read_t *)a, hnd, buf, len);
+}
+
+static ssize_t afs_read_at(void *a, uint32_t hnd, uint8_t *buf, size_t len,
+                           uint32_t offset) {
+    return pso_afs_file_read_at((pso_afs_read_t *)a, hnd, buf, len, offset);
+}
+
+static const uint8_t *afs_data(void *a, uint32_t hnd, size_t *len) {
+    return pso_afs_file_data((pso_afs_read_t *)a, hnd, len);
+}
+
+static const struct archive_ops afs_ops = {
+    PSO_ARCHIVE_AFS,
+    &afs_close,
+    &afs_count,
+    &afs_lookup,
+    &afs_name,
+    &afs_size,
+    &afs_read,
+    &afs_read_at,
+    &afs_data
+};
+
+/* Always ask for the filename table, since lookups don't work without it (and
+   it is simply ignored if the archive doesn't have one). */
+static void *afs_open(int fd, uint32_t len, uint32_t flags, pso_error_t *err) {
+    uint32_t afs_flags = PSO_AFS_FN_TABLE;
+
+    if((flags & PSO_ARCHIVE_MMAP))
+        afs_flags |= PSO_AFS_MMAP;
+
+    if((flags & PSO_ARCHIVE_NAME_INDEX))
+        afs_flags |= PSO_AFS_NAME_INDEX;
+
+    return pso_afs_read_open_fd(fd, len, afs_flags, err);
+}
+
+/* Glue between the generic archive code and the GSL reader. */
+static pso_error_t gsl_close(void *a) {
+    return pso_gsl_read_close((pso_gsl_read_t *)a);
+}
+
+static uint32_t gsl_count(void *a) {
+    return pso_gsl_file_count((pso_gsl_read_t *)a);
+}
+
+static uint32_t gsl_lookup(void *a, const char *fn) {
+    return pso_gsl_file_lookup((pso_gsl_read_t *)a, fn);
+}
+
+static pso_error_t gsl_name(void *a, uint32_t hnd, char *fn, size_t len) {
+    return pso_gsl_file_name((pso_gsl_read_t *)a, hnd, fn, len);
+}
+
+static ssize_t gsl_size(void *a, uint32_t hnd) {
+    return pso_gsl_file_size((pso_gsl_read_t *)a, hnd);
+}
+
+static ssize_t gsl_read(void *a, uint32_t hnd, uint8_t *buf, size_t len) {
+    return pso_gsl_file_read((pso_gsl_read_t *)a, hnd, buf, len);
+}
+
+static ssize_t gsl_read_at(void *a, uint32_t hnd, uint8_t *buf, size_t len,
+                           uint32_t offset) {
+    return pso_gsl_file_read_at((pso_gsl_read_t *)a, hnd, buf, len, offset);
+}
+
+static const struct archive_ops gsl_ops = {
+    PSO_ARCHIVE_GSL,
+    &gsl_close,
+    &gsl_count,
+    &gsl_lookup,
+    &gsl_name,
+    &gsl_size,
+    &gsl_read,
+    &gsl_read_at,
+    NULL
+};
+
+/* Figure out which way around the first entry of a GSL file table makes sense.
+   Returns the PSO_GSL_*_ENDIAN flag for it, or 0 if neither does. Big endian
+   wins if both work, just like in pso_gsl_read_open_fd(). */
+static uint32_t gsl_guess(const uint8_t *buf, uint32_t total) {
+    uint32_t offset, size;
+    int i;
+
+    /* The file table ends with an empty name, so there must be at least one
+       character in the first one. PSO doesn't use anything but plain ASCII in
+       filenames, so anything else is a pretty good sign this isn't a GSL. */
+    if(buf[0] == 0)
+        return 0;
+
+    for(i = 0; i < 32 && buf[i]; ++i) {
+        if(buf[i] < 0x20 || buf[i] > 0x7E)
+            return 0;
+    }
+
+    offset = (buf[35]) | (buf[34] << 8) | (buf[33] << 16) |
+        ((uint32_t)buf[32] << 24);
+    size = (buf[39]) | (buf[38] << 8) | (buf[37] << 16) |
+        ((uint32_t)buf[36] << 24);
+
+    if(offset <= total / 2048 && size <= total - offset * 2048)
+        return PSO_GSL_BIG_ENDIAN;
+
+    offset = ((uint32_t)buf[35] << 24) | (buf[34] << 16) | (buf[33] << 8) |
+        (buf[32]);
+    size = ((uint32_t)buf[39] << 24) | (buf[38] << 16) | (buf[37] << 8) |
+        (buf[36]);
+
+    if(offset <= total / 2048 && size <= total - offset * 2048)
+        return PSO_GSL_LITTLE_ENDIAN;
+
+    return 0;
+}
+
+int pso_archive_detect(const uint8_t *buf, size_t len, uint32_t total) {
+    if(!buf)
+        return PSO_ARCHIVE_UNKNOWN;
+
+    if(len >= 8 && !memcmp(buf, "AFS", 4))
+        return PSO_ARCHIVE_AFS;
+
+    if(len >= 48 && gsl_guess(buf, total))
+        return PSO_ARCHIVE_GSL;
+
+    return PSO_ARCHIVE_UNKNOWN;
+}
+
+pso_archive_t *pso_archive_open_fd(int fd, uint32_t len, uint32_t flags,
+                                   pso_error_t *err) {
+    pso_archive_t *rv;
+    pso_error_t erv = PSOARCHIVE_EFATAL;
+    uint8_t buf[48];
+    uint32_t gsl_flags;
+
+    /* Allocate our archive handle... */
+    if(!(rv = (pso_archive_t *)pso_malloc(sizeof(pso_archive_t)))) {
+        erv = PSOARCHIVE_EMEM;
+        goto ret_err;
+    }
+
+    /* Read in enough of the file to tell what it is... */
+    if(len < 8 || pso_update_read_at(fd, buf, len < 48 ? len : 48, 0)) {
+        erv = PSOARCHIVE_NOARCHIVE;
+        goto ret_handle;
+    }
+
+    /* ... and open it with the right reader. */
+    switch(pso_archive_detect(buf, len < 48 ? len : 48, len)) {
+        case PSO_ARCHIVE_AFS:
+            rv->ops = &afs_ops;
+            rv->arc = afs_open(fd, len, flags, &erv);
+            break;
+
+        case PSO_ARCHIVE_GSL:
+            /* Tell the reader which way around the archive is, so it doesn't
+               have to work it out again. */
+            gsl_flags = gsl_guess(buf, len);
+
+            if((flags & PSO_ARCHIVE_NAME_INDEX))
+                gsl_flags |= PSO_GSL_NAME_INDEX;
+
+            rv->ops = &gsl_ops;
+            rv->arc = pso_gsl_read_open_fd(fd, len, gsl_flags, &erv);
+            break;
+
+        default:
+            erv = PSOARCHIVE_NOARCHIVE;
+            goto ret_handle;
+    }
+
+    if(!rv->arc)
+        goto ret_handle;
+
+    if(err)
+        *err = PSOARCHIVE_OK;
+
+    return rv;
+
+ret_handle:
+    pso_free(rv);
+ret_err:
+    if(err)
+        *err = erv;
+
+    return NULL;
+}
+
+pso_archive_t *pso_archive_open(const char *fn, uint32_t flags,
+                                pso_error_t *err) {
+    int fd;
+    off_t total;
+    pso_error_t erv = PSOARCHIVE_EFATAL;
+    pso_archive_t *rv;
+
+    /* Open the file... */
+    if((fd = open(fn, O_RDONLY)) < 0) {
+        erv = PSOARCHIVE_EFILE;
+        goto ret_err;
+    }
+
+    /* Figure out how long the file is. */
+    if((total = lseek(fd, 0, SEEK_END)) == (off_t)-1) {
+        erv = PSOARCHIVE_EIO;
+        goto ret_file;
+    }
+
+    if(lseek(fd, 0, SEEK_SET)) {
+        erv = PSOARCHIVE_EIO;
+        goto ret_file;
+    }
+
+    if((rv = pso_archive_open_fd(fd, (uint32_t)total, flags, err)))
+        return rv;
+
+    /* If we get here, the pso_archive_open_fd() function encountered an error.
+       Clean up the file descriptor and return NULL. The error code is already
+       set in err, if applicable. */
+    close(fd);
+    return NULL;
+
+ret_file:
+    close(fd);
+ret_err:
+    if(err)
+        *err = erv;
+
+    return NULL;
+}
+
+pso_error_t pso_archive_close(pso_archive_t *a) {
+    pso_error_t rv;
+
+    if(!a)
+        return PSOARCHIVE_EFATAL;
+
+    rv = a->ops->close(a->arc);
+    pso_free(a);
+
+    return rv;
+}
+
+int pso_archive_type(pso_archive_t *a) {
+    if(!a)
+        return PSO_ARCHIVE_UNKNOWN;
+
+    return a->ops->type;
+}
+
+uint32_t pso_archive_file_count(pso_archive_t *a) {
+    if(!a)
+        return 0;
+
+    return a->ops->count(a->arc);
+}
+
+uint32_t pso_archive_file_lookup(pso_archive_t *a, const char *fn) {
+    if(!a)
+        return PSOARCHIVE_HND_INVALID;
+
+    return a->ops->lookup(a->arc, fn);
+}
+
+pso_error_t pso_archive_file_name(pso_archive_t *a, uint32_t hnd, char *fn,
+                                  size_t len) {
+    if(!a)
+        return PSOARCHIVE_EFATAL;
+
+    return a->ops->name(a->arc, hnd, fn, len);
+}
+
+ssize_t pso_archive_file_size(pso_archive_t *a, uint32_t hnd) {
+    if(!a)
+        return PSOARCHIVE_EFATAL;
+
+    return a->ops->size(a->arc, hnd);
+}
+
+ssize_t pso_archive_file_read(pso_archive_t *a, uint32_t hnd, uint8_t *buf,
+                              size_t len) {
+    if(!a)
+        return PSOARCHIVE_EFATAL;
+
+    return a->ops->read(a->arc, hnd, buf, len);
+}
+
+const uint8_t *pso_archive_file_data(pso_archive_t *a, uint32_t hnd,
+                                     size_t *len) {
+    if(!a || !a->ops->data)
+        return NULL;
+
+    return a->ops->data(a->arc, hnd, len);
+}
+
+/* How much of a file gets looked at to guess if it's compressed. */
+#define SNIFF_LEN       4096
+
+/* PRS streams are sometimes padded out a bit at the end. */
+#define SNIFF_SLACK     3
+
+/* Run the first len bytes of what might be a PRS stream (total bytes long)
+   through the decoder to see if it makes any sense. If the end of the stream
+   turns up, it has to be right at the end of the file, and if expect isn't
+   negative, the output has to be that long. Returns non-zero if it looks like
+   PRS data. */
+static int prs_trial(const uint8_t *buf, size_t len, size_t total,
+                     ssize_t expect) {
+    pso_prs_dstream_t *s;
+    uint8_t out[4096];
+    size_t pos = 0, out_len = 0;
+    ssize_t rv;
+    int ok = 0;
+
+    if(!(s = pso_prs_dstream_init(NULL)))
+        return 0;
+
+    while(pos < len && !pso_prs_dstream_finished(s)) {
+        if((rv = pso_prs_dstream_feed(s, buf + pos, len - pos)) < 0)
+            goto out;
+
+        pos += rv;
+
+        while((rv = pso_prs_dstream_drain(s, out, sizeof(out))) > 0)
+            out_len += rv;
+
+        if(rv < 0)
+            goto out;
+    }
+
+    if(pso_prs_dstream_finished(s))
+        ok = total - pos <= SNIFF_SLACK &&
+            (expect < 0 || out_len == (size_t)expect);
+    else
+        ok = len < total && (expect < 0 || out_len <= (size_t)expect);
+
+out:
+    pso_prs_dstream_end(s);
+    return ok;
+}
+
+/* Does the start of a file look like PRSD data? The header has to give a size
+   that the file could actually hold, and the data after it has to decrypt to
+   something that decodes as PRS. */
+static int prsd_trial(uint8_t *buf, size_t len, size_t total) {
+    struct prsd_crypt_cxt ccxt;
+    uint32_t key, unc_len;
+    int rv, endian;
+
+    if((rv = pso_prsd_decompress_size(buf, total, PSO_PRSD_AUTO_ENDIAN)) < 0)
+        return 0;
+
+    unc_len = (uint32_t)rv;
+
+    if(total > pso_prsd_max_compressed_size(unc_len))
+        return 0;
+
+    if((buf[0] | (buf[1] << 8) | (buf[2] << 16) |
+        ((uint32_t)buf[3] << 24)) == unc_len) {
+        endian = PSO_PRSD_LITTLE_ENDIAN;
+        key = buf[4] | (buf[5] << 8) | (buf[6] << 16) |
+            ((uint32_t)buf[7] << 24);
+    }
+    else {
+        endian = PSO_PRSD_BIG_ENDIAN;
+        key = buf[7] | (buf[6] << 8) | (buf[5] << 16) |
+            ((uint32_t)buf[4] << 24);
+    }
+
+    pso_prsd_crypt_init(&ccxt, key);
+    pso_prsd_crypt(&ccxt, buf + 8, (uint32_t)(len - 8), endian);
+
+    return prs_trial(buf + 8, len - 8, total - 8, (ssize_t)unc_len);
+}
+
+/* Guess how a file is stored from what's in it, for files whose names don't
+   say (like the ones in AFS archives without a filename table). */
+static int sniff_format(pso_archive_t *a, uint32_t hnd, size_t size) {
+    uint8_t buf[SNIFF_LEN + 8];
+    const uint8_t *data = NULL;
+    size_t len = size > sizeof(buf) ? sizeof(buf) : size, dlen;
+
+    if(a->ops->data && (data = a->ops->data(a->arc, hnd, &dlen)))
+        memcpy(buf, data, len);
+    else if(a->ops->read_at(a->arc, hnd, buf, len, 0) != (ssize_t)len)
+        return PSOARCHIVE_EIO;
+
+    /* The PRSD check is the pickier of the two (the header has to agree with
+       the data), so do it first. It decrypts the buffer in place, so it has to
+       be filled in again for the PRS check. */
+    if(size >= 11 && prsd_trial(buf, len, size))
+        return PSO_EXTRACT_PRSD;
+
+    if(data)
+        memcpy(buf, data, len);
+    else if(a->ops->read_at(a->arc, hnd, buf, len, 0) != (ssize_t)len)
+        return PSOARCHIVE_EIO;
+
+    if(prs_trial(buf, len, size, -1))
+        return PSO_EXTRACT_PRS;
+
+    return PSO_EXTRACT_RAW;
+}
+
+/* Figure out how a file is stored. If that had to be guessed from the data
+   (rather than from the name), *sniffed is set to 1. */
+static int file_format(pso_archive_t *a, uint32_t hnd, int *sniffed) {
+    char name[64];
+    pso_error_t rv;
+    ssize_t size;
+    int fmt;
+
+    *sniffed = 0;
+
+    memset(name, 0, sizeof(name));
+    if((rv = a->ops->name(a->arc, hnd, name, sizeof(name) - 1)))
+        return rv;
+
+    /* Empty files can't be compressed, whatever they're called. */
+    if((size = a->ops->size(a->arc, hnd)) <= 0)
+        return size < 0 ? (int)size : PSO_EXTRACT_RAW;
+
+    /* Go by the name if it says anything, and look at the data if not. */
+    if((fmt = pso_extract_guess_format(name)) != PSO_EXTRACT_RAW)
+        return fmt;
+
+    *sniffed = 1;
+    return sniff_format(a, hnd, (size_t)size);
+}
+
+int pso_archive_file_format(pso_archive_t *a, uint32_t hnd) {
+    int sniffed;
+
+    if(!a)
+        return PSOARCHIVE_EFATAL;
+
+    return file_format(a, hnd, &sniffed);
+}
+
+/* Did decompressing a file fail because it wasn't really compressed? Only a
+   few KiB of a file get looked at to guess that it is, so plain files can
+   sometimes look compressed at first. */
+static int not_compressed(ssize_t err) {
+    return err == PSOARCHIVE_EBADMSG || err == PSOARCHIVE_EFATAL;
+}
+
+/* Read a file in the archive from front to back, for the decompressors. */
+struct member_src {
+    pso_archive_t *a;
+    uint32_t hnd;
+    uint32_t pos;
+};
+
+static int member_read(uint8_t *buf, size_t len, void *udata) {
+    struct member_src *m = (struct member_src *)udata;
+
+    if(m->a->ops->read_at(m->a->arc, m->hnd, buf, len, m->pos) !=
+       (ssize_t)len)
+        return -1;
+
+    m->pos += (uint32_t)len;
+    return 0;
+}
+
+/* Figure out how big a PRS file will be by decompressing it without keeping
+   more than a little bit of the output around at a time. */
+static ssize_t prs_stream_size(struct member_src *m, size_t len) {
+    pso_prs_dstream_t *s;
+    pso_error_t err;
+    uint8_t in[4096], out[4096];
+    size_t in_len, in_pos, total = 0;
+    ssize_t rv;
+
+    if(!(s = pso_prs_dstream_init(&err)))
+        return err;
+
+    while(!pso_prs_dstream_finished(s)) {
+        if(!len) {
+            rv = PSOARCHIVE_EBADMSG;
+            goto out;
+        }
+
+        in_len = len > sizeof(in) ? sizeof(in) : len;
+        if(member_read(in, in_len, m)) {
+            rv = PSOARCHIVE_EIO;
+            goto out;
+        }
+
+        len -= in_len;
+        in_pos = 0;
+
+        do {
+            if((rv = pso_prs_dstream_feed(s, in + in_pos,
+                                          in_len - in_pos)) < 0)
+                goto out;
+
+            in_pos += rv;
+
+            while((rv = pso_prs_dstream_drain(s, out, sizeof(out))) > 0)
+                total += rv;
+
+            if(rv < 0)
+                goto out;
+        } while(in_pos < in_len && !pso_prs_dstream_finished(s));
+    }
+
+    rv = (ssize_t)total;
+
+out:
+    pso_prs_dstream_end(s);
+    return rv;
+}
+
+ssize_t pso_archive_file_decompressed_size(pso_archive_t *a, uint32_t hnd) {
+    ssize_t rv;
+    int fmt, sniffed;
+
+    if(!a)
+        return PSOARCHIVE_EFATAL;
+
+    if((fmt = file_format(a, hnd, &sniffed)) < 0)
+        return fmt;
+
+    rv = pso_archive_file_decompressed_size_as(a, hnd, fmt);
+
+    if(sniffed && not_compressed(rv))
+        rv = a->ops->size(a->arc, hnd);
+
+    return rv;
+}
+
+ssize_t pso_archive_file_decompressed_size_as(pso_archive_t *a, uint32_t hnd,
+                                              int fmt) {
+    struct member_src m = { a, hnd, 0 };
+    const uint8_t *data = NULL;
+    uint8_t hdr[8];
+    ssize_t size;
+    size_t len;
+
+    if(!a)
+        return PSOARCHIVE_EFATAL;
+
+    if(fmt < PSO_EXTRACT_RAW || fmt > PSO_EXTRACT_PRSD)
+        return PSOARCHIVE_EINVAL;
+
+    if((size = a->ops->size(a->arc, hnd)) < 0 || fmt == PSO_EXTRACT_RAW)
+        return size;
+
+    if(a->ops->data)
+        data = a->ops->data(a->arc, hnd, &len);
+
+    if(fmt == PSO_EXTRACT_PRS) {
+        if(data)
+            return pso_prs_decompress_size(data, len);
+
+        return prs_stream_size(&m, (size_t)size);
+    }
+
+    /* PRSD files have the size right in the header. */
+    if(!data) {
+        if(size < 8 || member_read(hdr, 8, &m))
+            return PSOARCHIVE_EBADMSG;
+
+        data = hdr;
+    }
+
+    return pso_prsd_decompress_size(data, (size_t)size, PSO_PRSD_AUTO_ENDIAN);
+}
+
+/* Read a file that is stored as fmt, decompressing it if it is compressed. If
+   grow is non-zero, a new buffer is allocated for the output and stored in
+   *dst. Otherwise, the output goes in the dst_len bytes at *dst. */
+static ssize_t read_file(pso_archive_t *a, uint32_t hnd, int fmt,
+                         uint8_t **dst, size_t dst_len, int grow) {
+    struct member_src m = { a, hnd, 0 };
+    const uint8_t *data = NULL;
+    uint8_t *tmp;
+    ssize_t size, rv;
+    size_t len;
+
+    if(fmt < PSO_EXTRACT_RAW || fmt > PSO_EXTRACT_PRSD)
+        return PSOARCHIVE_EINVAL;
+
+    if((size = a->ops->size(a->arc, hnd)) < 0)
+        return size;
+
+    /* Files that aren't compressed are just read in as-is. */
+    if(fmt == PSO_EXTRACT_RAW) {
+        if(grow && !(*dst = (uint8_t *)pso_malloc(size ? size : 1)))
+            return PSOARCHIVE_EMEM;
+        else if(!grow && dst_len < (size_t)size)
+            return PSOARCHIVE_ENOSPC;
+
+        if(size && a->ops->read(a->arc, hnd, *dst, size) != size) {
+            rv = PSOARCHIVE_EIO;
+            goto out_err;
+        }
+
+        return size;
+    }
+
+    /* If the archive is mapped, decompress straight out of the map.
+       Otherwise, the compressed data is read in a bit at a time just ahead of
+       the decompressor. Either way, the only thing that ever holds the whole
+       file is the output buffer. */
+    if(a->ops->data)
+        data = a->ops->data(a->arc, hnd, &len);
+
+    if(fmt == PSO_EXTRACT_PRSD) {
+        if(data && grow)
+            return pso_prsd_decompress_buf(data, dst, len,
+                                           PSO_PRSD_AUTO_ENDIAN);
+        else if(data)
+            return pso_prsd_decompress_buf2(data, *dst, len, dst_len,
+                                            PSO_PRSD_AUTO_ENDIAN);
+
+        return pso_prsd_decompress_read(&member_read, &m, (size_t)size, dst,
+                                        dst_len, grow, PSO_PRSD_AUTO_ENDIAN);
+    }
+
+    if(data && grow) {
+        return pso_prs_decompress_buf(data, dst, len);
+    }
+    else if(data) {
+        /* pso_prs_decompress_buf2 won't take an empty buffer at all, so work
+           out whether the output would fit in it the long way. */
+        if(!dst_len) {
+            rv = pso_prs_decompress_size(data, len);
+            return rv > 0 ? PSOARCHIVE_ENOSPC : rv;
+        }
+
+        return pso_prs_decompress_buf2(data, *dst, len, dst_len);
+    }
+
+    /* Start out with two times the length of the input, just like
+       pso_prs_decompress_buf does. */
+    if(grow) {
+        dst_len = (size_t)size * 2;
+        if(!(*dst = (uint8_t *)pso_malloc(dst_len)))
+            return PSOARCHIVE_EMEM;
+    }
+
+    if((rv = pso_prs_decompress_read(&member_read, &m, (size_t)size, dst,
+                                     dst_len, grow)) < 0)
+        goto out_err;
+
+    /* Shrink the output down to size (if realloc fails to resize it, then
+       just use the unshortened buffer). */
+    if(grow && rv && (tmp = (uint8_t *)pso_realloc(*dst, rv)))
+        *dst = tmp;
+
+    return rv;
+
+out_err:
+    if(grow) {
+        pso_free(*dst);
+        *dst = NULL;
+    }
+
+    return rv;
+}
+
+/* Read a file, decompressing it if it looks compressed. If the format had to be
+   guessed from the data and it doesn't decompress, read it in as-is instead. */
+static ssize_t read_guessed(pso_archive_t *a, uint32_t hnd, uint8_t **dst,
+                            size_t dst_len, int grow) {
+    ssize_t rv;
+    int fmt, sniffed;
+
+    if((fmt = file_format(a, hnd, &sniffed)) < 0)
+        return fmt;
+
+    rv = read_file(a, hnd, fmt, dst, dst_len, grow);
+
+    if(sniffed && not_compressed(rv))
+        rv = read_file(a, hnd, PSO_EXTRACT_RAW, dst, dst_len, grow);
+
+    return rv;
+}
+
+ssize_t pso_archive_file_read_decompressed(pso_archive_t *a, uint32_t hnd,
+                                           uint8_t *buf, size_t len) {
+    if(!a || !buf)
+        return PSOARCHIVE_EFAULT;
+
+    return read_guessed(a, hnd, &buf, len, 0);
+}
+
+ssize_t pso_archive_file_read_decompressed_as(pso_archive_t *a, uint32_t hnd,
+                                              int fmt, uint8_t *buf,
+                                              size_t len) {
+    if(!a || !buf)
+        return PSOARCHIVE_EFAULT;
+
+    return read_file(a, hnd, fmt, &buf, len, 0);
+}
+
+ssize_t pso_archive_file_decompress(pso_archive_t *a, uint32_t hnd,
+                                    uint8_t **dst) {
+    if(!a || !dst)
+        return PSOARCHIVE_EFAULT;
+
+    return read_guessed(a, hnd, dst, 0, 1);
+}
+
+ssize_t pso_archive_file_decompress_as(pso_archive_t *a, uint32_t hnd,
+                                       int fmt, uint8_t **dst) {
+    if(!a || !dst)
+        return PSOARCHIVE_EFAULT;
+
+    return read_file(a, hnd, fmt, dst, 0, 1);
+}
+
+/* The extraction code takes the same functions as the archive does. */
+static void ex_src(pso_archive_t *a, struct pso_extract_src *src) {
+    src->arc = a->arc;
+    src->count = a->ops->count(a->arc);
+    src->size = a->ops->size;
+    src->name = a->ops->name;
+    src->read = a->ops->read;
+    src->data = a->ops->data;
+}
+
+pso_error_t pso_archive_extract_all(pso_archive_t *a, uint32_t flags,
+                                    int threads, pso_extract_cb_t cb,
+                                    void *udata) {
+    struct pso_extract_src src;
+
+    if(!a || !cb)
+        return PSOARCHIVE_EFAULT;
+
+    ex_src(a, &src);
+    return pso_extract_run(&src, flags, threads, cb, udata);
+}
+
+pso_error_t pso_archive_extract_dir(pso_archive_t *a, const char *dir,
+                                    uint32_t flags, int threads) {
+    struct pso_extract_src src;
+
+    if(!a || !dir)
+        return PSOARCHIVE_EFAULT;
+
+    ex_src(a, &src);
+    return pso_extract_dir(&src, dir, flags, threads);
+}
@@ -0,0 +1,419 @@
+/*
+    This file is part of libpsoarchive.
+
+    Copyright (C) 2026 Lawrence Sebald
+
+    This library is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 2.1 or
+    version 3 of the License.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/******************************************************************************
+    Whole Archive Building
+
+    These are the parts of building an archive that don't depend on what kind
+    of archive it is: getting the data for every file ready (reading it in and
+    compressing it, in parallel), and writing the result out sequentially
+    through a large buffer. The AFS and GSL writers handle the layout.
+ ******************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#else
+#include <io.h>
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#include "psoarchive-alloc.h"
+#include "PRS.h"
+#include "PRSD.h"
+#include "build.h"
+#include "dedup.h"
+#include "workers.h"
+
+/* Size of the output buffer. Anything at least this big skips the buffer and
+   is written out directly. */
+#define OUT_BUF_SIZE    0x40000
+
+struct build_job {
+    const pso_build_file_t *files;
+    struct pso_build_item *items;
+    int level;
+    time_t now;
+};
+
+static int read_file(const char *fn, uint8_t **buf, uint32_t *len,
+                     time_t *ts) {
+    struct stat st;
+    uint8_t *rv;
+    size_t left, pos = 0;
+    ssize_t r;
+    int fd;
+
+    if((fd = open(fn, O_RDONLY | O_BINARY)) < 0)
+        return PSOARCHIVE_EFILE;
+
+    if(fstat(fd, &st) < 0) {
+        close(fd);
+        return PSOARCHIVE_EFILE;
+    }
+
+    if((uint64_t)st.st_size > 0xFFFFFFFF) {
+        close(fd);
+        return PSOARCHIVE_ERANGE;
+    }
+
+    left = (size_t)st.st_size;
+    if(!(rv = (uint8_t *)pso_malloc(left ? left : 1))) {
+        close(fd);
+        return PSOARCHIVE_EMEM;
+    }
+
+    while(left) {
+        if((r = read(fd, rv + pos, left)) <= 0) {
+            pso_free(rv);
+            close(fd);
+            return PSOARCHIVE_EIO;
+        }
+
+        pos += (size_t)r;
+        left -= (size_t)r;
+    }
+
+    close(fd);
+
+    *buf = rv;
+    *len = (uint32_t)pos;
+
+    if(!*ts)
+        *ts = st.st_mtime;
+
+    return PSOARCHIVE_OK;
+}
+
+static int compress_item(struct pso_build_item *it, int type, uint32_t key,
+                         int level) {
+    pso_prs_compressor_t *c;
+    pso_error_t err;
+    uint8_t *dst, *tmp;
+    size_t dlen;
+    int rv;
+
+    dlen = type == PSO_BUILD_PRS ? pso_prs_max_compressed_size(it->len) :
+        pso_prsd_max_compressed_size(it->len);
+
+    if(!(c = pso_prs_compressor_init(level, &err)))
+        return err;
+
+    if(!(dst = (uint8_t *)pso_malloc(dlen))) {
+        pso_prs_compressor_end(c);
+        return PSOARCHIVE_EMEM;
+    }
+
+    if(type == PSO_BUILD_PRS)
+        rv = pso_prs_compressor_compress(c, it->data, dst, it->len, dlen);
+    else
+        rv = pso_prsd_compressor_compress(c, it->data, dst, it->len, dlen, key,
+                                          type == PSO_BUILD_PRSD_BE ?
+                                          PSO_PRSD_BIG_ENDIAN :
+                                          PSO_PRSD_LITTLE_ENDIAN);
+
+    pso_prs_compressor_end(c);
+
+    if(rv < 0) {
+        pso_free(dst);
+        return rv;
+    }
+
+    /* Give back whatever we didn't use. */
+    if((tmp = (uint8_t *)pso_realloc(dst, rv ? (size_t)rv : 1)))
+        dst = tmp;
+
+    pso_free(it->buf);
+    it->buf = dst;
+    it->data = dst;
+    it->len = (uint32_t)rv;
+
+    return PSOARCHIVE_OK;
+}
+
+static int build_task(void *udata, size_t idx) {
+    struct build_job *job = (struct build_job *)udata;
+    const pso_build_file_t *f = &job->files[idx];
+    struct pso_build_item *it = &job->items[idx];
+    int rv;
+
+    if(!f->name)
+        return PSOARCHIVE_EFAULT;
+
+    it->ts = f->ts;
+    it->same = (uint32_t)idx;
+
+    if(f->data) {
+        it->data = f->data;
+        it->len = f->len;
+
+        if(!it->ts)
+            it->ts = job->now;
+    }
+    else if(f->path) {
+        if((rv = read_file(f->path, &it->buf, &it->len, &it->ts)))
+            return rv;
+
+        it->data = it->buf;
+    }
+    else {
+        return PSOARCHIVE_EFAULT;
+    }
+
+    /* Empty files can't be compressed, so they're always stored empty. */
+    switch(f->compress) {
+        case PSO_BUILD_RAW:
+            return PSOARCHIVE_OK;
+
+        case PSO_BUILD_PRS:
+        case PSO_BUILD_PRSD_LE:
+        case PSO_BUILD_PRSD_BE:
+            if(!it->len)
+                return PSOARCHIVE_OK;
+
+            return compress_item(it, f->compress, f->key, job->level);
+
+        default:
+            return PSOARCHIVE_EINVAL;
+    }
+}
+
+pso_error_t pso_build_prepare(const pso_build_file_t *files, uint32_t count,
+                              int level, int threads,
+                              struct pso_build_item **rv) {
+    struct build_job job;
+    struct pso_build_item *items;
+    int err;
+
+    if(!files && count)
+        return PSOARCHIVE_EFAULT;
+
+    if(!(items = (struct pso_build_item *)
+         pso_malloc(sizeof(struct pso_build_item) * (count ? count : 1))))
+        return PSOARCHIVE_EMEM;
+
+    memset(items, 0, sizeof(struct pso_build_item) * count);
+
+    job.files = files;
+    job.items = items;
+    job.level = level;
+    job.now = time(NULL);
+
+    if((err = pso_run_parallel(count, threads, &build_task, &job))) {
+        pso_build_cleanup(items, count);
+        return (pso_error_t)err;
+    }
+
+    *rv = items;
+    return PSOARCHIVE_OK;
+}
+
+void pso_build_cleanup(struct pso_build_item *items, uint32_t count) {
+    uint32_t i;
+
+    if(!items)
+        return;
+
+    for(i = 0; i < count; ++i) {
+        pso_free(items[i].buf);
+    }
+
+    pso_free(items);
+}
+
+pso_error_t pso_build_dedup(struct pso_build_item *items, uint32_t count) {
+    struct pso_dedup d;
+    uint64_t hash, where;
+    uint32_t i, iter;
+    pso_error_t rv = PSOARCHIVE_OK;
+
+    pso_dedup_init(&d);
+
+    for(i = 0; i < count; ++i) {
+        if(!items[i].len)
+            continue;
+
+        hash = pso_dedup_hash(items[i].data, items[i].len);
+        iter = 0;
+
+        while(pso_dedup_next(&d, hash, items[i].len, &iter, &where)) {
+            if(!memcmp(items[where].data, items[i].data, items[i].len)) {
+                items[i].same = (uint32_t)where;
+                break;
+            }
+        }
+
+        if(items[i].same == i && (rv = pso_dedup_add(&d, hash, items[i].len,
+                                                     i)))
+            break;
+    }
+
+    pso_dedup_free(&d);
+    return rv;
+}
+
+static pso_error_t write_all(int fd, const uint8_t *data, size_t len) {
+    ssize_t w;
+
+    while(len) {
+        if((w = write(fd, data, len)) <= 0)
+            return PSOARCHIVE_EIO;
+
+        data += w;
+        len -= (size_t)w;
+    }
+
+    return PSOARCHIVE_OK;
+}
+
+/* Make room for at least len more bytes in the buffer, either by writing out
+   what's there or (for memory-only output) by growing it. */
+static pso_error_t make_room(struct pso_build_out *o, size_t len) {
+    uint8_t *tmp;
+    size_t sz;
+    pso_error_t rv;
+
+    if(len <= o->size - o->used)
+        return PSOARCHIVE_OK;
+
+    if(o->fd >= 0) {
+        rv = write_all(o->fd, o->buf, o->used);
+        o->used = 0;
+        return rv;
+    }
+
+    sz = o->size * 2;
+    if(sz - o->used < len)
+        sz = o->used + len;
+
+    if(sz < o->used || !(tmp = (uint8_t *)pso_realloc(o->buf, sz)))
+        return PSOARCHIVE_EMEM;
+
+    o->buf = tmp;
+    o->size = sz;
+
+    return PSOARCHIVE_OK;
+}
+
+pso_error_t pso_build_out_init(struct pso_build_out *o, int fd) {
+    if(!(o->buf = (uint8_t *)pso_malloc(OUT_BUF_SIZE)))
+        return PSOARCHIVE_EMEM;
+
+    o->fd = fd;
+    o->size = OUT_BUF_SIZE;
+    o->used = 0;
+    o->pos = 0;
+
+    return PSOARCHIVE_OK;
+}
+
+pso_error_t pso_build_out_init_mem(struct pso_build_out *o) {
+    return pso_build_out_init(o, -1);
+}
+
+pso_error_t pso_build_out_write(struct pso_build_out *o, const void *data,
+                                size_t len) {
+    pso_error_t rv;
+
+    /* Big writes go straight out, anything else goes through the buffer. */
+    if(o->fd >= 0 && len >= o->size) {
+        if((rv = make_room(o, o->size)) ||
+           (rv = write_all(o->fd, (const uint8_t *)data, len)))
+            return rv;
+    }
+    else {
+        if((rv = make_room(o, len)))
+            return rv;
+
+        memcpy(o->buf + o->used, data, len);
+        o->used += len;
+    }
+
+    o->pos += len;
+    return PSOARCHIVE_OK;
+}
+
+pso_error_t pso_build_out_zero(struct pso_build_out *o, uint64_t len) {
+    size_t n;
+    pso_error_t rv;
+
+    while(len) {
+        n = len > o->size ? o->size : (size_t)len;
+
+        if((rv = make_room(o, n)))
+            return rv;
+
+        if(n > o->size - o->used)
+            n = o->size - o->used;
+
+        memset(o->buf + o->used, 0, n);
+        o->used += n;
+        o->pos += n;
+        len -= n;
+    }
+
+    return PSOARCHIVE_OK;
+}
+
+pso_error_t pso_build_out_copy_fd(struct pso_build_out *o, int fd,
+                                  uint64_t len) {
+    size_t n;
+    ssize_t r;
+    pso_error_t rv;
+
+    /* Read straight into the buffer, as much at a time as will fit. */
+    while(len) {
+        n = len > o->size ? o->size : (size_t)len;
+
+        if((rv = make_room(o, n)))
+            return rv;
+
+        if(n > o->size - o->used)
+            n = o->size - o->used;
+
+        if((r = read(fd, o->buf + o->used, n)) <= 0)
+            return PSOARCHIVE_EIO;
+
+        o->used += (size_t)r;
+        o->pos += (uint64_t)r;
+        len -= (uint64_t)r;
+    }
+
+    return PSOARCHIVE_OK;
+}
+
+pso_error_t pso_build_out_finish(struct pso_build_out *o) {
+    pso_error_t rv = PSOARCHIVE_OK;
+
+    if(o->fd >= 0)
+        rv = write_all(o->fd, o->buf, o->used);
+
+    pso_free(o->buf);
+    o->buf = NULL;
+    o->used = 0;
+
+    return rv;
+}
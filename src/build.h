@@ -0,0 +1,68 @@
+/*
+    This file is part of libpsoarchive.
+
+    Copyright (C) 2026 Lawrence Sebald
+
+    This library is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 2.1 or
+    version 3 of the License.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PSOARCHIVE__BUILD_INT_H
+#define PSOARCHIVE__BUILD_INT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "psoarchive-build.h"
+
+/* A file, ready to go into an archive. The data is either the caller's own, or
+   in buf (which is freed by pso_build_cleanup). If the file's data is the same
+   as that of an earlier file, same is the index of that file (otherwise it is
+   the item's own index). */
+struct pso_build_item {
+    const uint8_t *data;
+    uint32_t len;
+    time_t ts;
+    uint8_t *buf;
+    uint32_t same;
+};
+
+/* Buffered output, for writing an archive out from front to back. If fd is
+   negative, everything is kept in the buffer (which grows as needed) rather
+   than being written anywhere. */
+struct pso_build_out {
+    int fd;
+    uint8_t *buf;
+    size_t size;
+    size_t used;
+    uint64_t pos;
+};
+
+/* These functions are all for internal use only. */
+pso_error_t pso_build_prepare(const pso_build_file_t *files, uint32_t count,
+                              int level, int threads,
+                              struct pso_build_item **rv);
+void pso_build_cleanup(struct pso_build_item *items, uint32_t count);
+pso_error_t pso_build_dedup(struct pso_build_item *items, uint32_t count);
+
+pso_error_t pso_build_out_init(struct pso_build_out *o, int fd);
+pso_error_t pso_build_out_init_mem(struct pso_build_out *o);
+pso_error_t pso_build_out_write(struct pso_build_out *o, const void *data,
+                                size_t len);
+pso_error_t pso_build_out_zero(struct pso_build_out *o, uint64_t len);
+pso_error_t pso_build_out_copy_fd(struct pso_build_out *o, int fd,
+                                  uint64_t len);
+pso_error_t pso_build_out_finish(struct pso_build_out *o);
+
+#endif /* !PSOARCHIVE__BUILD_INT_H */
@@ -0,0 +1,165 @@
+/*
+    This file is part of libpsoarchive.
+
+    Copyright (C) 2026 Lawrence Sebald
+
+    This library is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 2.1 or
+    version 3 of the License.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/******************************************************************************
+    Duplicate Data Index
+
+    Archives often have several files in them with exactly the same contents.
+    Since each entry in the file table has its own offset and size, there's no
+    reason those files can't all point at the same copy of the data. The
+    writers use this to find data they've already stored: a simple
+    open-addressed hash table (with linear probing) of a hash of each file's
+    data, which is then checked byte for byte against the stored copy.
+ ******************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "psoarchive-alloc.h"
+#include "dedup.h"
+#include "update.h"
+
+#define MULT1   0x9E3779B97F4A7C15ULL
+#define MULT2   0xFF51AFD7ED558CCDULL
+
+/* A quick 64-bit hash, taking 8 bytes at a time. It doesn't need to be any
+   good against someone trying to break it, since matches get checked. */
+uint64_t pso_dedup_hash(const uint8_t *data, size_t len) {
+    uint64_t h = MULT1 ^ len, w;
+
+    while(len >= 8) {
+        memcpy(&w, data, 8);
+        h = (h ^ w) * MULT2;
+        h ^= h >> 32;
+        data += 8;
+        len -= 8;
+    }
+
+    if(len) {
+        w = 0;
+        memcpy(&w, data, len);
+        h = (h ^ w) * MULT2;
+    }
+
+    h ^= h >> 29;
+    h *= MULT1;
+    h ^= h >> 32;
+
+    return h;
+}
+
+void pso_dedup_init(struct pso_dedup *d) {
+    d->slots = NULL;
+    d->mask = 0;
+    d->count = 0;
+}
+
+static void insert(struct pso_dedup_ent *slots, uint32_t mask,
+                   const struct pso_dedup_ent *ent) {
+    uint32_t h = (uint32_t)ent->hash & mask;
+
+    while(slots[h].used)
+        h = (h + 1) & mask;
+
+    slots[h] = *ent;
+}
+
+pso_error_t pso_dedup_add(struct pso_dedup *d, uint64_t hash, uint32_t len,
+                          uint64_t where) {
+    struct pso_dedup_ent *slots, ent;
+    uint32_t size, i;
+
+    /* Keep the table at most half full. */
+    if((d->count + 1) * 2 > d->mask + 1 || !d->slots) {
+        size = d->slots ? (d->mask + 1) * 2 : 64;
+
+        if(!(slots = (struct pso_dedup_ent *)
+             pso_malloc(size * sizeof(struct pso_dedup_ent))))
+            return PSOARCHIVE_EMEM;
+
+        memset(slots, 0, size * sizeof(struct pso_dedup_ent));
+
+        for(i = 0; d->slots && i <= d->mask; ++i) {
+            if(d->slots[i].used)
+                insert(slots, size - 1, &d->slots[i]);
+        }
+
+        pso_free(d->slots);
+        d->slots = slots;
+        d->mask = size - 1;
+    }
+
+    ent.hash = hash;
+    ent.where = where;
+    ent.len = len;
+    ent.used = 1;
+
+    insert(d->slots, d->mask, &ent);
+    ++d->count;
+
+    return PSOARCHIVE_OK;
+}
+
+/* Find the next bit of stored data that might be the same as what's being
+   added. Start with *iter set to zero, and keep calling until this returns
+   zero (or a match has been found). */
+int pso_dedup_next(const struct pso_dedup *d, uint64_t hash, uint32_t len,
+                   uint32_t *iter, uint64_t *where) {
+    const struct pso_dedup_ent *ent;
+
+    if(!d->slots)
+        return 0;
+
+    for(;;) {
+        ent = &d->slots[((uint32_t)hash + (*iter)++) & d->mask];
+
+        if(!ent->used)
+            return 0;
+
+        if(ent->hash == hash && ent->len == len) {
+            *where = ent->where;
+            return 1;
+        }
+    }
+}
+
+/* Check if the data at offset in the file is the same as what's in data. */
+int pso_dedup_same_fd(int fd, uint64_t offset, const uint8_t *data,
+                      size_t len) {
+    uint8_t buf[4096];
+    size_t n;
+
+    while(len) {
+        n = len > sizeof(buf) ? sizeof(buf) : len;
+
+        if(pso_update_read_at(fd, buf, n, offset) || memcmp(buf, data, n))
+            return 0;
+
+        data += n;
+        offset += n;
+        len -= n;
+    }
+
+    return 1;
+}
+
+void pso_dedup_free(struct pso_dedup *d) {
+    pso_free(d->slots);
+    d->slots = NULL;
+}
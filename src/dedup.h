@@ -0,0 +1,57 @@
+/*
+    This file is part of libpsoarchive.
+
+    Copyright (C) 2026 Lawrence Sebald
+
+    This library is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 2.1 or
+    version 3 of the License.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PSOARCHIVE__DEDUP_H
+#define PSOARCHIVE__DEDUP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "psoarchive-error.h"
+
+/* Hash index of the data that has been stored in an archive being written, so
+   that a file with the same contents as one that's already there can point at
+   the existing copy. Each entry just remembers where the data is (in whatever
+   terms the writer wants) -- the writer has to check that the data actually
+   matches before using it. */
+struct pso_dedup_ent {
+    uint64_t hash;
+    uint64_t where;
+    uint32_t len;
+    int used;
+};
+
+struct pso_dedup {
+    struct pso_dedup_ent *slots;
+    uint32_t mask;
+    uint32_t count;
+};
+
+/* These functions are all for internal use only. */
+uint64_t pso_dedup_hash(const uint8_t *data, size_t len);
+void pso_dedup_init(struct pso_dedup *d);
+pso_error_t pso_dedup_add(struct pso_dedup *d, uint64_t hash, uint32_t len,
+                          uint64_t where);
+int pso_dedup_next(const struct pso_dedup *d, uint64_t hash, uint32_t len,
+                   uint32_t *iter, uint64_t *where);
+int pso_dedup_same_fd(int fd, uint64_t offset, const uint8_t *data,
+                      size_t len);
+void pso_dedup_free(struct pso_dedup *d);
+
+#endif /* !PSOARCHIVE__DEDUP_H */
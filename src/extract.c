@@ -0,0 +1,226 @@
+/*
+    This file is part of libpsoarchive.
+
+    Copyright (C) 2026 Lawrence Sebald
+
+    This library is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 2.1 or
+    version 3 of the License.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/******************************************************************************
+    Bulk Archive Extraction
+
+    This ties together the archive readers, the PRS/PRSD decompressors, and the
+    worker threads to pull everything out of an archive in one go. Each file
+    is its own task, so as many files are read and decompressed at once as
+    there are threads to do it. The archive readers don't touch the handle
+    while reading, and read with pread (or straight out of the memory map), so
+    there's nothing to lock there.
+ ******************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#else
+#include <io.h>
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#include "psoarchive-alloc.h"
+#include "PRS.h"
+#include "PRSD.h"
+#include "extract.h"
+#include "workers.h"
+
+/* Longest name we'll deal with (archive filenames are at most 32 bytes). */
+#define NAME_LEN        64
+
+struct extract_job {
+    const struct pso_extract_src *src;
+    uint32_t flags;
+    pso_extract_cb_t cb;
+    void *udata;
+};
+
+static int ends_with(const char *s, const char *ext) {
+    size_t l1 = strlen(s), l2 = strlen(ext), i;
+
+    if(l1 < l2)
+        return 0;
+
+    for(i = 0; i < l2; ++i) {
+        if(tolower((unsigned char)s[l1 - l2 + i]) != ext[i])
+            return 0;
+    }
+
+    return 1;
+}
+
+int pso_extract_guess_format(const char *fn) {
+    if(ends_with(fn, ".prs"))
+        return PSO_EXTRACT_PRS;
+    else if(ends_with(fn, ".pr2") || ends_with(fn, ".pr3"))
+        return PSO_EXTRACT_PRSD;
+
+    return PSO_EXTRACT_RAW;
+}
+
+static int extract_task(void *udata, size_t idx) {
+    struct extract_job *job = (struct extract_job *)udata;
+    const struct pso_extract_src *src = job->src;
+    pso_extract_file_t f;
+    char name[NAME_LEN];
+    uint8_t *buf = NULL, *unc = NULL;
+    const uint8_t *data = NULL;
+    size_t len = 0;
+    ssize_t sz;
+    int rv;
+
+    memset(name, 0, sizeof(name));
+    if((rv = src->name(src->arc, (uint32_t)idx, name, NAME_LEN - 1)))
+        return rv;
+
+    /* Get at the data, either directly or by reading it in. */
+    if(src->data)
+        data = src->data(src->arc, (uint32_t)idx, &len);
+
+    if(!data) {
+        if((sz = src->size(src->arc, (uint32_t)idx)) < 0)
+            return (int)sz;
+
+        len = (size_t)sz;
+        if(!(buf = (uint8_t *)pso_malloc(len ? len : 1)))
+            return PSOARCHIVE_EMEM;
+
+        /* The readers won't do zero-length reads, so don't ask them to. */
+        if(len && (sz = src->read(src->arc, (uint32_t)idx, buf, len)) < 0) {
+            pso_free(buf);
+            return (int)sz;
+        }
+
+        data = buf;
+    }
+
+    f.hnd = (uint32_t)idx;
+    f.name = name;
+    f.data = data;
+    f.len = len;
+    f.format = PSO_EXTRACT_RAW;
+
+    /* Decompress it, if it looks like it's compressed. Anything that doesn't
+       actually decompress is passed along as it was. */
+    if((job->flags & PSO_EXTRACT_DECOMPRESS) && len) {
+        switch(pso_extract_guess_format(name)) {
+            case PSO_EXTRACT_PRS:
+                rv = pso_prs_decompress_buf(data, &unc, len);
+                break;
+
+            case PSO_EXTRACT_PRSD:
+                rv = pso_prsd_decompress_buf(data, &unc, len,
+                                             PSO_PRSD_AUTO_ENDIAN);
+                break;
+
+            default:
+                rv = -1;
+        }
+
+        if(rv >= 0) {
+            f.format = pso_extract_guess_format(name);
+            f.data = unc;
+            f.len = (size_t)rv;
+        }
+        else {
+            unc = NULL;
+        }
+    }
+
+    rv = job->cb(&f, job->udata);
+
+    pso_free(unc);
+    pso_free(buf);
+
+    return rv < 0 ? rv : 0;
+}
+
+pso_error_t pso_extract_run(const struct pso_extract_src *src, uint32_t flags,
+                            int threads, pso_extract_cb_t cb, void *udata) {
+    struct extract_job job;
+
+    if(!cb)
+        return PSOARCHIVE_EFAULT;
+
+    job.src = src;
+    job.flags = flags;
+    job.cb = cb;
+    job.udata = udata;
+
+    return (pso_error_t)pso_run_parallel(src->count, threads, &extract_task,
+                                         &job);
+}
+
+/* Write each file out into a directory. */
+static int write_file(const pso_extract_file_t *f, void *udata) {
+    const char *dir = (const char *)udata;
+    const uint8_t *data = f->data;
+    size_t len = f->len;
+    char *path;
+    ssize_t w;
+    int fd, rv = PSOARCHIVE_OK;
+
+    if(!(path = (char *)pso_malloc(strlen(dir) + NAME_LEN + 2)))
+        return PSOARCHIVE_EMEM;
+
+    /* Don't let a name in the archive put anything outside of the directory.
+       Anything that looks like it might is replaced with the file's handle. */
+    if(!f->name[0] || strchr(f->name, '/') || strchr(f->name, '\\') ||
+       !strcmp(f->name, ".") || !strcmp(f->name, ".."))
+        sprintf(path, "%s/%lu.bin", dir, (unsigned long)f->hnd);
+    else
+        sprintf(path, "%s/%s", dir, f->name);
+
+    if((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644)) < 0) {
+        pso_free(path);
+        return PSOARCHIVE_EFILE;
+    }
+
+    while(len) {
+        if((w = write(fd, data, len)) <= 0) {
+            rv = PSOARCHIVE_EIO;
+            break;
+        }
+
+        data += w;
+        len -= (size_t)w;
+    }
+
+    close(fd);
+    pso_free(path);
+
+    return rv;
+}
+
+pso_error_t pso_extract_dir(const struct pso_extract_src *src,
+                            const char *dir, uint32_t flags, int threads) {
+    if(!dir)
+        return PSOARCHIVE_EFAULT;
+
+    return pso_extract_run(src, flags, threads, &write_file, (void *)dir);
+}
@@ -0,0 +1,49 @@
+/*
+    This file is part of libpsoarchive.
+
+    Copyright (C) 2026 Lawrence Sebald
+
+    This library is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 2.1 or
+    version 3 of the License.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PSOARCHIVE__EXTRACT_INT_H
+#define PSOARCHIVE__EXTRACT_INT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "psoarchive-extract.h"
+
+/* The bits of an archive reader that the extraction code needs. The data
+   function may be NULL (or return NULL), in which case each file is read into
+   a buffer instead. */
+struct pso_extract_src {
+    void *arc;
+    uint32_t count;
+
+    ssize_t (*size)(void *arc, uint32_t hnd);
+    pso_error_t (*name)(void *arc, uint32_t hnd, char *fn, size_t len);
+    ssize_t (*read)(void *arc, uint32_t hnd, uint8_t *buf, size_t len);
+    const uint8_t *(*data)(void *arc, uint32_t hnd, size_t *len);
+};
+
+/* These functions are all for internal use only. */
+int pso_extract_guess_format(const char *fn);
+pso_error_t pso_extract_run(const struct pso_extract_src *src, uint32_t flags,
+                            int threads, pso_extract_cb_t cb, void *udata);
+pso_error_t pso_extract_dir(const struct pso_extract_src *src,
+                            const char *dir, uint32_t flags, int threads);
+
+#endif /* !PSOARCHIVE__EXTRACT_INT_H */
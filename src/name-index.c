@@ -0,0 +1,102 @@
+/*
+    This file is part of libpsoarchive.
+
+    Copyright (C) 2026 Lawrence Sebald
+
+    This library is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 2.1 or
+    version 3 of the License.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/******************************************************************************
+    Filename Index
+
+    Looking up a file by name in an archive is normally just a linear search
+    through all of the filenames, which is fine for a one-off lookup, but not so
+    much when doing a lot of them in an archive with thousands of files. This is
+    a simple open-addressed hash table of the filenames (of up to 32 bytes each,
+    not necessarily NUL terminated) that the archive readers can build when
+    opening an archive to make lookups take constant time.
+
+    Names are put into the table in order, with linear probing. Thus, if the
+    archive has more than one file with the same name, the first one will be
+    found by a lookup, just like with the linear search.
+ ******************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "psoarchive-error.h"
+#include "psoarchive-alloc.h"
+#include "name-index.h"
+
+/* FNV-1a, over at most NAME_INDEX_LEN bytes of the name. */
+static uint32_t hash_name(const char *fn) {
+    uint32_t h = 0x811C9DC5;
+    int i;
+
+    for(i = 0; i < NAME_INDEX_LEN && fn[i]; ++i) {
+        h ^= (uint8_t)fn[i];
+        h *= 0x01000193;
+    }
+
+    return h;
+}
+
+int pso_name_index_build(struct pso_name_index *idx, const char *names,
+                         size_t stride, uint32_t count) {
+    uint32_t size = 16, i, h;
+
+    /* Keep the table at most half full. */
+    while(size < count * 2)
+        size <<= 1;
+
+    if(!(idx->slots = (uint32_t *)pso_malloc(size * sizeof(uint32_t))))
+        return PSOARCHIVE_EMEM;
+
+    memset(idx->slots, 0, size * sizeof(uint32_t));
+
+    idx->mask = size - 1;
+    idx->names = names;
+    idx->stride = stride;
+
+    /* Slots hold the index of the file plus one, so that zero means empty. */
+    for(i = 0; i < count; ++i) {
+        h = hash_name(names + i * stride) & idx->mask;
+
+        while(idx->slots[h])
+            h = (h + 1) & idx->mask;
+
+        idx->slots[h] = i + 1;
+    }
+
+    return PSOARCHIVE_OK;
+}
+
+uint32_t pso_name_index_lookup(const struct pso_name_index *idx,
+                               const char *fn) {
+    uint32_t h = hash_name(fn) & idx->mask, ent;
+
+    while((ent = idx->slots[h])) {
+        if(!strncmp(idx->names + (ent - 1) * idx->stride, fn, NAME_INDEX_LEN))
+            return ent - 1;
+
+        h = (h + 1) & idx->mask;
+    }
+
+    return PSOARCHIVE_HND_INVALID;
+}
+
+void pso_name_index_free(struct pso_name_index *idx) {
+    pso_free(idx->slots);
+    idx->slots = NULL;
+}
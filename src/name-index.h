@@ -0,0 +1,47 @@
+/*
+    This file is part of libpsoarchive.
+
+    Copyright (C) 2026 Lawrence Sebald
+
+    This library is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 2.1 or
+    version 3 of the License.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PSOARCHIVE__NAME_INDEX_H
+#define PSOARCHIVE__NAME_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define NAME_INDEX_LEN      32
+
+/* Hash index of the filenames in an archive. The names themselves aren't
+   copied anywhere, the index just points at the array that the archive reader
+   already has them in (which means that array can't move while the index is in
+   use). */
+struct pso_name_index {
+    uint32_t *slots;
+    uint32_t mask;
+
+    const char *names;
+    size_t stride;
+};
+
+/* These functions are all for internal use only. */
+int pso_name_index_build(struct pso_name_index *idx, const char *names,
+                         size_t stride, uint32_t count);
+uint32_t pso_name_index_lookup(const struct pso_name_index *idx,
+                               const char *fn);
+void pso_name_index_free(struct pso_name_index *idx);
+
+#endif /* !PSOARCHIVE__NAME_INDEX_H */
@@ -0,0 +1,144 @@
+/*
+    This file is part of libpsoarchive.
+
+    Copyright (C) 2026 Lawrence Sebald
+
+    This library is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 2.1 or
+    version 3 of the License.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/******************************************************************************
+    In-place Archive Updates
+
+    The parts of updating an archive in place that AFS and GSL archives have in
+    common: positional I/O on the archive file, and finding somewhere to put
+    new file data. Both formats store every file at a 2048 byte boundary, and
+    each file's slot runs up to the next boundary after it, so that's the unit
+    free space is handed out in.
+ ******************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#else
+#include <io.h>
+#endif
+
+#include "update.h"
+
+#define ALIGN(x)    (((x) + 0x7FF) & ~(uint64_t)0x7FF)
+
+pso_error_t pso_update_read_at(int fd, uint8_t *buf, size_t len,
+                               uint64_t offset) {
+    ssize_t rv;
+
+#ifndef _WIN32
+    while(len) {
+        if((rv = pread(fd, buf, len, (off_t)offset)) <= 0)
+            return PSOARCHIVE_EIO;
+
+        buf += rv;
+        len -= (size_t)rv;
+        offset += (uint64_t)rv;
+    }
+#else
+    if(lseek(fd, (off_t)offset, SEEK_SET) == (off_t)-1)
+        return PSOARCHIVE_EIO;
+
+    if((rv = read(fd, buf, len)) < 0 || (size_t)rv != len)
+        return PSOARCHIVE_EIO;
+#endif
+
+    return PSOARCHIVE_OK;
+}
+
+pso_error_t pso_update_write_at(int fd, const uint8_t *buf, size_t len,
+                                uint64_t offset) {
+    ssize_t rv;
+
+#ifndef _WIN32
+    while(len) {
+        if((rv = pwrite(fd, buf, len, (off_t)offset)) <= 0)
+            return PSOARCHIVE_EIO;
+
+        buf += rv;
+        len -= (size_t)rv;
+        offset += (uint64_t)rv;
+    }
+#else
+    if(lseek(fd, (off_t)offset, SEEK_SET) == (off_t)-1)
+        return PSOARCHIVE_EIO;
+
+    if((rv = write(fd, buf, len)) < 0 || (size_t)rv != len)
+        return PSOARCHIVE_EIO;
+#endif
+
+    return PSOARCHIVE_OK;
+}
+
+/* Write out file data, padded with zeroes to the end of its slot. */
+pso_error_t pso_update_write_data(int fd, const uint8_t *buf, size_t len,
+                                  uint64_t offset) {
+    static const uint8_t zero[0x800] = { 0 };
+    pso_error_t rv;
+
+    if((rv = pso_update_write_at(fd, buf, len, offset)))
+        return rv;
+
+    offset += len;
+    return pso_update_write_at(fd, zero, (size_t)(ALIGN(offset) - offset),
+                               offset);
+}
+
+static int ext_cmp(const void *a, const void *b) {
+    const struct pso_extent *e1 = (const struct pso_extent *)a;
+    const struct pso_extent *e2 = (const struct pso_extent *)b;
+
+    if(e1->offset < e2->offset)
+        return -1;
+
+    return e1->offset > e2->offset;
+}
+
+/* Find a place for len bytes of data somewhere after start, that doesn't run
+   into any of the extents given. The first gap that's big enough is used. If
+   there isn't one, the data goes at the end of the archive (and *end is moved
+   past it). The extents are sorted in the process. */
+uint64_t pso_update_find_space(struct pso_extent *ext, size_t count,
+                               uint64_t start, uint64_t *end, uint64_t len) {
+    uint64_t pos = ALIGN(start), rv;
+    size_t i;
+
+    len = ALIGN(len);
+    qsort(ext, count, sizeof(struct pso_extent), &ext_cmp);
+
+    for(i = 0; i < count; ++i) {
+        if(!ext[i].len || ext[i].offset + ext[i].len <= pos)
+            continue;
+
+        if(ext[i].offset >= pos + len)
+            return pos;
+
+        pos = ALIGN(ext[i].offset + ext[i].len);
+    }
+
+    /* Nothing in the middle, so it goes on the end. */
+    rv = ALIGN(*end);
+    if(rv < pos)
+        rv = pos;
+
+    *end = rv + len;
+    return rv;
+}
@@ -0,0 +1,45 @@
+/*
+    This file is part of libpsoarchive.
+
+    Copyright (C) 2026 Lawrence Sebald
+
+    This library is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 2.1 or
+    version 3 of the License.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PSOARCHIVE__UPDATE_INT_H
+#define PSOARCHIVE__UPDATE_INT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "psoarchive-error.h"
+
+/* A piece of an archive that's in use. */
+struct pso_extent {
+    uint64_t offset;
+    uint64_t len;
+};
+
+/* These functions are all for internal use only. */
+pso_error_t pso_update_read_at(int fd, uint8_t *buf, size_t len,
+                               uint64_t offset);
+pso_error_t pso_update_write_at(int fd, const uint8_t *buf, size_t len,
+                                uint64_t offset);
+pso_error_t pso_update_write_data(int fd, const uint8_t *buf, size_t len,
+                                  uint64_t offset);
+uint64_t pso_update_find_space(struct pso_extent *ext, size_t count,
+                               uint64_t start, uint64_t *end, uint64_t len);
+
+#endif /* !PSOARCHIVE__UPDATE_INT_H */
@@ -0,0 +1,195 @@
+/*
+    This file is part of libpsoarchive.
+
+    Copyright (C) 2026 Lawrence Sebald
+
+    This library is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 2.1 or
+    version 3 of the License.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/******************************************************************************
+    Worker threads
+
+    This is a tiny bit of glue for running a bunch of independent tasks across
+    several threads. The calling thread does its share of the work too, and
+    each thread just grabs the next task that nobody has started on until they
+    have all been taken. If a thread can't be started for whatever reason, the
+    rest of them (including the caller) simply pick up the slack, so this never
+    fails outright. Without threads at all, everything runs on the calling
+    thread.
+ ******************************************************************************/
+
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#include "psoarchive-alloc.h"
+#include "workers.h"
+
+/* Don't go completely overboard, no matter what we're asked for. */
+#define MAX_THREADS     64
+
+struct workers {
+    pso_task_t task;
+    void *udata;
+    size_t count;
+    size_t next;
+    int err;
+
+#ifdef _WIN32
+    CRITICAL_SECTION lock;
+#else
+    pthread_mutex_t lock;
+#endif
+};
+
+int pso_default_threads(void) {
+#ifdef _WIN32
+    SYSTEM_INFO si;
+
+    GetSystemInfo(&si);
+    return (int)si.dwNumberOfProcessors;
+#elif defined(_SC_NPROCESSORS_ONLN)
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return n > 0 ? (int)n : 1;
+#else
+    return 1;
+#endif
+}
+
+/* Record the result of the last task (if it failed), and grab the next one to
+   do, if there is one and nothing has failed. */
+static int next_task(struct workers *w, int last, size_t *idx) {
+    int rv = 0;
+
+#ifdef _WIN32
+    EnterCriticalSection(&w->lock);
+#else
+    pthread_mutex_lock(&w->lock);
+#endif
+
+    if(last < 0 && !w->err)
+        w->err = last;
+
+    if(!w->err && w->next < w->count) {
+        *idx = w->next++;
+        rv = 1;
+    }
+
+#ifdef _WIN32
+    LeaveCriticalSection(&w->lock);
+#else
+    pthread_mutex_unlock(&w->lock);
+#endif
+
+    return rv;
+}
+
+#ifdef _WIN32
+static DWORD WINAPI worker(LPVOID arg) {
+#else
+static void *worker(void *arg) {
+#endif
+    struct workers *w = (struct workers *)arg;
+    size_t idx;
+    int rv = 0;
+
+    while(next_task(w, rv, &idx)) {
+        rv = w->task(w->udata, idx);
+    }
+
+    return 0;
+}
+
+int pso_run_parallel(size_t count, int threads, pso_task_t task,
+                     void *udata) {
+    struct workers w;
+#ifdef _WIN32
+    HANDLE *thds;
+#else
+    pthread_t *thds;
+#endif
+    int i, rv, started = 0;
+    size_t idx;
+
+    if(threads <= 0)
+        threads = pso_default_threads();
+
+    if(threads > MAX_THREADS)
+        threads = MAX_THREADS;
+
+    if((size_t)threads > count)
+        threads = (int)count;
+
+    /* Not worth the bother of starting up any threads? */
+    if(threads <= 1) {
+        for(idx = 0; idx < count; ++idx) {
+            if((rv = task(udata, idx)) < 0)
+                return rv;
+        }
+
+        return 0;
+    }
+
+    w.task = task;
+    w.udata = udata;
+    w.count = count;
+    w.next = 0;
+    w.err = 0;
+
+#ifdef _WIN32
+    InitializeCriticalSection(&w.lock);
+#else
+    pthread_mutex_init(&w.lock, NULL);
+#endif
+
+    /* The calling thread counts as one of the workers. */
+    if((thds = pso_malloc(sizeof(*thds) * (threads - 1)))) {
+        for(i = 0; i < threads - 1; ++i) {
+#ifdef _WIN32
+            if(!(thds[started] = CreateThread(NULL, 0, &worker, &w, 0, NULL)))
+                break;
+#else
+            if(pthread_create(&thds[started], NULL, &worker, &w))
+                break;
+#endif
+            ++started;
+        }
+    }
+
+    worker(&w);
+
+    for(i = 0; i < started; ++i) {
+#ifdef _WIN32
+        WaitForSingleObject(thds[i], INFINITE);
+        CloseHandle(thds[i]);
+#else
+        pthread_join(thds[i], NULL);
+#endif
+    }
+
+    pso_free(thds);
+
+#ifdef _WIN32
+    DeleteCriticalSection(&w.lock);
+#else
+    pthread_mutex_destroy(&w.lock);
+#endif
+
+    return w.err;
+}
@@ -0,0 +1,35 @@
+/*
+    This file is part of libpsoarchive.
+
+    Copyright (C) 2026 Lawrence Sebald
+
+    This library is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 2.1 or
+    version 3 of the License.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PSOARCHIVE__WORKERS_H
+#define PSOARCHIVE__WORKERS_H
+
+#include <stddef.h>
+
+/* A task to be run by pso_run_parallel. It's called once for each index from 0
+   up to the count given, in no particular order and on whatever thread. If it
+   returns a negative value, no more tasks are started, and that value is
+   returned from pso_run_parallel (once everything already running is done). */
+typedef int (*pso_task_t)(void *udata, size_t idx);
+
+/* These functions are all for internal use only. */
+int pso_default_threads(void);
+int pso_run_parallel(size_t count, int threads, pso_task_t task, void *udata);
+
+#endif /* !PSOARCHIVE__WORKERS_H */